@@ -9,6 +9,9 @@ complete -c hoshimi -f -n __fish_use_subcommand -a update -d "Update dotfiles to
 complete -c hoshimi -f -n __fish_use_subcommand -a config -d "Get or set config options within your configuration"
 complete -c hoshimi -f -n __fish_use_subcommand -a source -d "Source current configuration, updating modifiable dotfiles"
 complete -c hoshimi -f -n __fish_use_subcommand -a restart -d "(re)start the shell and reload terminals"
+complete -c hoshimi -f -n __fish_use_subcommand -a transition -d "Fade the running desktop into another theme"
+complete -c hoshimi -f -n __fish_use_subcommand -a fleet -d "Source or install for many user homes at once"
+complete -c hoshimi -f -n __fish_use_subcommand -a prerender -d "Render themes ahead of time so switching to them is instant"
 complete -c hoshimi -f -n __fish_use_subcommand -a osugen -d "Generate osu items needed for the race"
 
 # Global options (available for all commands)
@@ -19,8 +22,14 @@ complete -c hoshimi -s p -l packages -d "Comma-separated list of packages to ins
 complete -c hoshimi -s n -l not-packages -d "Comma-separated list of packages NOT to install or source" -r
 complete -c hoshimi -l no-secondary-commands -d "Don't do followup commands"
 complete -c hoshimi -l -maximum-followup-commands -d "Maximum number of followups a "
+complete -c hoshimi -l sync -d "Flush the sourced files to disk"
+complete -c hoshimi -l live-terminals -d "Recolor open terminals after sourcing"
+complete -c hoshimi -l duration -d "How long a transition takes" -r
+complete -c hoshimi -l homes -d "The homes a fleet command works on" -r -a "(__fish_complete_directories)"
 complete -c hoshimi -l version -d "Show version information"
 
+complete -c hoshimi -n "__fish_seen_subcommand_from prerender" -l all -d "Prerender every theme"
+
 # Package name completions (common Hyprland-related packages)
 set -l packages hypr,quickshell,fastfetch,ghostty,fish,foot,alacritty
 
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// The per-value helpers are inlined into the batch loops even at -Os, the
+// loops only vectorize with no calls left in them
+#ifdef __GNUC__
+#define COLORMATH_INLINE __attribute__((always_inline)) inline
+#else
+#define COLORMATH_INLINE inline
+#endif
+
+// Color spaces: sRGB, linear RGB, OKLab and its polar form OKLCh, and HSL,
+// plus WCAG luminance and contrast.
+//
+// Whole palettes are converted at once. Their channels are kept in separate
+// arrays (Channels), and every conversion is a loop over them marked
+// `omp simd`. The build passes -fopenmp-simd, which needs no OpenMP runtime,
+// and -fno-trapping-math, without which GCC keeps the float comparisons as
+// branches. The loops call no libm functions, which would keep them scalar:
+// roots are Newton steps from a guess made of the float's bits, and the
+// angles are polynomials, all accurate to about float precision. sRGB
+// decoding is a table of the 256 possible values. HSL is the one batch that
+// stays scalar, it branches on the largest channel. The scalar versions
+// share the same per-color code.
+//
+// Colors come in as any type with uint8_t r, g and b members. Batches write
+// those members of the colors they are given, single colors go out through
+// the type's (r, g, b) constructor. Color in practice.
+class ColorMath {
+public:
+  // One array per channel: r, g, b for RGB, L, a, b for OKLab, L, C, h for
+  // OKLCh and h, s, l for HSL
+  struct Channels {
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<float> z;
+
+    Channels() = default;
+    explicit Channels(size_t n) { resize(n); }
+
+    void resize(size_t n) {
+      x.resize(n);
+      y.resize(n);
+      z.resize(n);
+    }
+    size_t size() const { return x.size(); }
+  };
+
+  struct Lab {
+    float L, a, b;
+  };
+
+  // sRGB component to linear light, from a table of the 256 possible values
+  static float decode(uint8_t value) { return decodeTable()[value]; }
+
+  COLORMATH_INLINE static uint8_t encode(float linear) {
+    // linear^(1 / 2.4) is the cube root times its fourth root
+    float root = cubeRoot(linear > 0.0031308f ? linear : 0.0031308f);
+    float c = linear <= 0.0031308f
+                  ? 12.92f * linear
+                  : 1.055f * root * fourthRoot(root) - 0.055f;
+    float scaled = c * 255.0f + 0.5f;
+    return (uint8_t)(scaled < 0 ? 0 : scaled > 255 ? 255 : scaled);
+  }
+
+  // --- Batches ---
+
+  template <typename C>
+  static void linear(const C *colors, size_t n, Channels &out) {
+    out.resize(n);
+    const float *table = decodeTable().data();
+    float *x = out.x.data(), *y = out.y.data(), *z = out.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < n; ++i) {
+      x[i] = table[colors[i].r];
+      y[i] = table[colors[i].g];
+      z[i] = table[colors[i].b];
+    }
+  }
+
+  // Sets r, g and b of in.size() colors, the rest of them is left alone
+  template <typename C> static void fromLinear(const Channels &in, C *out) {
+    const float *x = in.x.data(), *y = in.y.data(), *z = in.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < in.size(); ++i) {
+      out[i].r = encode(x[i]);
+      out[i].g = encode(y[i]);
+      out[i].b = encode(z[i]);
+    }
+  }
+
+  // Linear RGB to OKLab, in place
+  static void oklab(Channels &c) {
+    float *x = c.x.data(), *y = c.y.data(), *z = c.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < c.size(); ++i)
+      toOklab(x[i], y[i], z[i]);
+  }
+
+  // OKLab to linear RGB, in place. Out of gamut values are not clipped
+  // until they are encoded.
+  static void linearFromOklab(Channels &c) {
+    float *x = c.x.data(), *y = c.y.data(), *z = c.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < c.size(); ++i)
+      fromOklab(x[i], y[i], z[i]);
+  }
+
+  // OKLab to OKLCh, in place. Hue is in degrees, 0 to 360.
+  static void oklch(Channels &c) {
+    float *y = c.y.data(), *z = c.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < c.size(); ++i) {
+      float a = y[i], b = z[i];
+      float chroma2 = a * a + b * b;
+      y[i] = chroma2 * inverseRoot(chroma2);
+      float h = atan2(b, a) * DEGREES;
+      z[i] = h < 0 ? h + 360.0f : h;
+    }
+  }
+
+  static void oklabFromOklch(Channels &c) {
+    float *y = c.y.data(), *z = c.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < c.size(); ++i) {
+      float chroma = y[i], h = z[i] / DEGREES;
+      y[i] = chroma * sine(h + PI / 2);
+      z[i] = chroma * sine(h);
+    }
+  }
+
+  // HSL straight from sRGB, hue in degrees, saturation and lightness 0 to 1
+  template <typename C>
+  static void hsl(const C *colors, size_t n, Channels &out) {
+    out.resize(n);
+    for (size_t i = 0; i < n; ++i)
+      toHsl(colors[i].r, colors[i].g, colors[i].b, out.x[i], out.y[i],
+            out.z[i]);
+  }
+
+  // WCAG relative luminance of linear RGB
+  static void luminance(const Channels &linear, float *out) {
+    const float *x = linear.x.data(), *y = linear.y.data(),
+                *z = linear.z.data();
+#pragma omp simd
+    for (size_t i = 0; i < linear.size(); ++i)
+      out[i] = luminance(x[i], y[i], z[i]);
+  }
+
+  // --- Single colors ---
+
+  COLORMATH_INLINE static float luminance(float r, float g, float b) {
+    return 0.2126f * r + 0.7152f * g + 0.0722f * b;
+  }
+
+  template <typename C> static float luminance(const C &color) {
+    return luminance(decode(color.r), decode(color.g), decode(color.b));
+  }
+
+  // WCAG contrast ratio of two luminances, 1 to 21
+  static float contrast(float l1, float l2) {
+    return l1 > l2 ? (l1 + 0.05f) / (l2 + 0.05f) : (l2 + 0.05f) / (l1 + 0.05f);
+  }
+
+  template <typename C> static Lab oklab(const C &color) {
+    Lab lab = {decode(color.r), decode(color.g), decode(color.b)};
+    toOklab(lab.L, lab.a, lab.b);
+    return lab;
+  }
+
+  template <typename C> static C fromOklab(Lab lab) {
+    fromOklab(lab.L, lab.a, lab.b);
+    return C(encode(lab.L), encode(lab.a), encode(lab.b));
+  }
+
+  static Lab mix(const Lab &from, const Lab &to, float t) {
+    return {from.L + (to.L - from.L) * t, from.a + (to.a - from.a) * t,
+            from.b + (to.b - from.b) * t};
+  }
+
+  static void toHsl(uint8_t r8, uint8_t g8, uint8_t b8, float &h, float &s,
+                    float &l) {
+    float r = r8 / 255.0f, g = g8 / 255.0f, b = b8 / 255.0f;
+    float max = std::fmax(r, std::fmax(g, b));
+    float min = std::fmin(r, std::fmin(g, b));
+    float delta = max - min;
+
+    l = (max + min) / 2;
+    s = delta == 0 ? 0 : delta / (1 - std::fabs(2 * l - 1));
+    if (delta == 0)
+      h = 0;
+    else if (max == r)
+      h = 60 * std::fmod((g - b) / delta + 6, 6.0f);
+    else if (max == g)
+      h = 60 * ((b - r) / delta + 2);
+    else
+      h = 60 * ((r - g) / delta + 4);
+  }
+
+private:
+  static constexpr float DEGREES = 57.29577951308232f;
+  static constexpr float PI = 3.14159265358979f;
+
+  COLORMATH_INLINE static float fromBits(uint32_t bits) {
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+  }
+
+  COLORMATH_INLINE static uint32_t toBits(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    return bits;
+  }
+
+  COLORMATH_INLINE static float cubeRoot(float x) {
+    float a = std::fabs(x);
+    float y = fromBits(toBits(a) / 3 + 709921077u);
+    y = (2 * y + a / (y * y)) * (1.0f / 3);
+    y = (2 * y + a / (y * y)) * (1.0f / 3);
+    y = (2 * y + a / (y * y)) * (1.0f / 3);
+    return std::copysign(y, x);
+  }
+
+  // x > 0
+  COLORMATH_INLINE static float fourthRoot(float x) {
+    float y = fromBits(toBits(x) / 4 + 798014912u);
+    y = (3 * y + x / (y * y * y)) * 0.25f;
+    y = (3 * y + x / (y * y * y)) * 0.25f;
+    y = (3 * y + x / (y * y * y)) * 0.25f;
+    return y;
+  }
+
+  // 1 / sqrt(x), 0 for x = 0
+  COLORMATH_INLINE static float inverseRoot(float x) {
+    float y = fromBits(0x5f3759dfu - (toBits(x) >> 1));
+    y = y * (1.5f - 0.5f * x * y * y);
+    y = y * (1.5f - 0.5f * x * y * y);
+    y = y * (1.5f - 0.5f * x * y * y);
+    return x > 0 ? y : 0;
+  }
+
+  // Radians, -pi to pi
+  COLORMATH_INLINE static float atan2(float y, float x) {
+    float ax = std::fabs(x), ay = std::fabs(y);
+    float max = ax > ay ? ax : ay, min = ax > ay ? ay : ax;
+    float t = min / (max > 0 ? max : 1);
+    float s = t * t;
+    float r = 0.05265332f - 0.01172120f * s;
+    r = -0.11643287f + s * r;
+    r = 0.19354346f + s * r;
+    r = -0.33262347f + s * r;
+    r = t * (0.99997726f + s * r);
+    r = ay > ax ? PI / 2 - r : r;
+    r = x < 0 ? PI - r : r;
+    return std::copysign(r, y);
+  }
+
+  COLORMATH_INLINE static float sine(float x) {
+    // Into -pi to pi, then -pi / 2 to pi / 2 where sin(x) = sin(pi - x)
+    float turns = x * (0.5f / PI);
+    x -= 2 * PI * (float)(int32_t)(turns + (turns < 0 ? -0.5f : 0.5f));
+    x = x > PI / 2 ? PI - x : x < -PI / 2 ? -PI - x : x;
+    float s = x * x;
+    float r = 1.0f / 362880 - s * (1.0f / 39916800);
+    r = -1.0f / 5040 + s * r;
+    r = 1.0f / 120 + s * r;
+    r = -1.0f / 6 + s * r;
+    return x * (1 + s * r);
+  }
+
+  static const std::array<float, 256> &decodeTable() {
+    static const std::array<float, 256> table = [] {
+      std::array<float, 256> t{};
+      for (int i = 0; i < 256; ++i) {
+        float c = i / 255.0f;
+        t[i] = c <= 0.04045f ? c / 12.92f
+                             : std::pow((c + 0.055f) / 1.055f, 2.4f);
+      }
+      return t;
+    }();
+    return table;
+  }
+
+  // Björn Ottosson's OKLab, from linear sRGB
+  COLORMATH_INLINE static void toOklab(float &x, float &y, float &z) {
+    float l =
+        cubeRoot(0.4122214708f * x + 0.5363325363f * y + 0.0514459929f * z);
+    float m =
+        cubeRoot(0.2119034982f * x + 0.6806995451f * y + 0.1073969566f * z);
+    float s =
+        cubeRoot(0.0883024619f * x + 0.2817188376f * y + 0.6299787005f * z);
+    x = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    y = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    z = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+  }
+
+  COLORMATH_INLINE static void fromOklab(float &x, float &y, float &z) {
+    float l = x + 0.3963377774f * y + 0.2158037573f * z;
+    float m = x - 0.1055613458f * y - 0.0638541728f * z;
+    float s = x - 0.0894841775f * y - 1.2914855480f * z;
+    l = l * l * l;
+    m = m * m * m;
+    s = s * s * s;
+    x = 4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s;
+    y = -1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s;
+    z = -0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s;
+  }
+};
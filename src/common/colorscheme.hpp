@@ -1,7 +1,10 @@
 #ifndef COLORS_H
 #define COLORS_H
 
+#include "colormath.hpp"
+
 #include <algorithm>
+#include <array>
 #include <cmath>
 #include <cstdint>
 #include <inttypes.h>
@@ -11,14 +14,30 @@
 #include <utility>
 #include <vector>
 
-#define BLACK Color("#0")
-#define WHITE Color("#ffffff")
+// Value of each hex digit, -1 for anything else
+struct HexTable {
+  int8_t values[256];
+  constexpr HexTable() : values() {
+    for (int i = 0; i < 256; ++i)
+      values[i] = -1;
+    for (int i = 0; i < 10; ++i)
+      values['0' + i] = i;
+    for (int i = 0; i < 6; ++i) {
+      values['a' + i] = 10 + i;
+      values['A' + i] = 10 + i;
+    }
+  }
+};
+inline constexpr HexTable HEX_DIGITS{};
 
 class Color {
 public:
-  int r;
-  int g;
-  int b;
+  // Packed into 32 bits, so a Color is passed and compared like an int
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  // Only set by 8 digit hex strings, none of the formats print it
+  uint8_t a;
 
   enum FLAGS {
     NOFLAGS = 0,
@@ -28,120 +47,101 @@ public:
     SPCSEP = 1 << 4
   };
 
-  Color() : r(0), g(0), b(0) {}
-  Color(uint8_t red, uint8_t green, uint8_t blue) : r(red), g(green), b(blue) {}
-  Color(std::string hex) {
-    if (hex[0] == '#') {
-      hex.erase(0, 1);
-    }
-
-    while (hex.length() < 6)
-      hex += '0';
-
-    for (std::string::size_type i = 0; i < hex.length(); i += 2) {
-      std::string hedec = {hex[i], hex[i + 1]};
-      int val = std::stoi(hedec, nullptr, 16);
-      switch (i) {
-      case 0:
-        r = val;
-        break;
-      case 2:
-        g = val;
-        break;
-      case 4:
-        b = val;
-        break;
-      }
-    }
+  // Longest toHex() output, "255, 255, 255" with quotes, plus a NUL
+  static constexpr size_t FORMAT_SIZE = 16;
+
+  constexpr Color() : r(0), g(0), b(0), a(0xff) {}
+  constexpr Color(uint8_t red, uint8_t green, uint8_t blue)
+      : r(red), g(green), b(blue), a(0xff) {}
+  constexpr Color(const char *hex) : Color() {
+    size_t length = 0;
+    while (hex[length])
+      length++;
+    parse(hex, length);
   }
-  Color(const char *hexS) {
-    std::string hex(hexS);
-    if (hex[0] == '#') {
-      hex.erase(0, 1);
-    }
+  Color(const std::string &hex) : Color() { parse(hex.data(), hex.size()); }
 
-    while (hex.length() < 6)
-      hex += '0';
-
-    for (std::string::size_type i = 0; i < hex.length(); i += 2) {
-      std::string hedec = {hex[i], hex[i + 1]};
-      int val = std::stoi(hedec, nullptr, 16);
-      switch (i) {
-      case 0:
-        r = val;
-        break;
-      case 2:
-        g = val;
-        break;
-      case 4:
-        b = val;
-        break;
-      }
-    }
+  constexpr uint32_t rgb() const {
+    return (uint32_t)r << 16 | (uint32_t)g << 8 | b;
   }
 
-  // Convert to hex string
-  std::string toHex(const int &flag = FLAGS::NOFLAGS) const {
-    std::stringstream ss;
-
-    // If WQUOT, open with a quote
+  // Format into out, which holds at least FORMAT_SIZE chars. Returns the
+  // length, out is NUL terminated.
+  size_t format(char *out, int flag = FLAGS::NOFLAGS) const {
+    char *p = out;
     if (flag & FLAGS::WQUOT)
-      ss << '"';
+      *p++ = '"';
 
     if (flag & FLAGS::RGB) {
-      ss << r;
-      if (flag & FLAGS::SPCSEP)
-        ss << ", ";
-      else
-        ss << ",";
-      ss << g;
-      if (flag & FLAGS::SPCSEP)
-        ss << ", ";
-      else
-        ss << ",";
-      ss << b;
-
-    } else { // If not NHASH, include the leading '#'
+      const char *separator = flag & FLAGS::SPCSEP ? ", " : ",";
+      p = decimal(p, r);
+      for (const char *s = separator; *s; ++s)
+        *p++ = *s;
+      p = decimal(p, g);
+      for (const char *s = separator; *s; ++s)
+        *p++ = *s;
+      p = decimal(p, b);
+    } else {
+      static constexpr char DIGITS[] = "0123456789abcdef";
       if (!(flag & FLAGS::NHASH))
-        ss << '#';
-
-      // Ensure we print two hex digits per color component with leading zeros
-      ss << std::hex << std::setfill('0') << std::nouppercase;
-      ss << std::setw(2) << (static_cast<int>(r) & 0xFF);
-      if (flag & FLAGS::SPCSEP)
-        ss << ' ';
-      ss << std::setw(2) << (static_cast<int>(g) & 0xFF);
-      if (flag & FLAGS::SPCSEP)
-        ss << ' ';
-      ss << std::setw(2) << (static_cast<int>(b) & 0xFF);
+        *p++ = '#';
+      const uint8_t components[3] = {r, g, b};
+      for (int i = 0; i < 3; ++i) {
+        if (i > 0 && (flag & FLAGS::SPCSEP))
+          *p++ = ' ';
+        *p++ = DIGITS[components[i] >> 4];
+        *p++ = DIGITS[components[i] & 0xf];
+      }
     }
 
-    // Close quote if requested
     if (flag & FLAGS::WQUOT)
-      ss << '"';
+      *p++ = '"';
+    *p = '\0';
+    return p - out;
+  }
 
-    return ss.str();
+  void appendTo(std::string &out, int flag = FLAGS::NOFLAGS) const {
+    char buffer[FORMAT_SIZE];
+    out.append(buffer, format(buffer, flag));
   }
 
-  Color mix(const Color &other, const float &percentage) const {
-    uint8_t nR = this->r + (other.r - this->r) * percentage;
-    uint8_t nG = this->g + (other.g - this->g) * percentage;
-    uint8_t nB = this->b + (other.b - this->b) * percentage;
+  // Convert to hex string. Short enough for the small string buffer, so
+  // this does not allocate either.
+  std::string toHex(const int &flag = FLAGS::NOFLAGS) const {
+    char buffer[FORMAT_SIZE];
+    return std::string(buffer, format(buffer, flag));
+  }
 
-    return Color(std::max(std::min(255, (int)nR), 0),
-                 std::max(std::min(255, (int)nG), 0),
-                 std::max(std::min(255, (int)nB), 0));
+  // A whole palette at once, into count buffers
+  static void formatAll(const Color *colors, size_t count, int flag,
+                        std::array<char, FORMAT_SIZE> *out) {
+    for (size_t i = 0; i < count; ++i)
+      colors[i].format(out[i].data(), flag);
+  }
+
+  static void parseAll(const std::string *hex, size_t count, Color *out) {
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = Color();
+      out[i].parse(hex[i].data(), hex[i].size());
+    }
   }
 
-  Color lighten(const float &percentage) const {
-    return mix(WHITE, percentage);
+  // Interpolated in OKLab, so the steps look even and the hue does not
+  // drift towards grey halfway
+  Color mix(const Color &other, const float &percentage) const {
+    return ColorMath::fromOklab<Color>(ColorMath::mix(
+        ColorMath::oklab(*this), ColorMath::oklab(other), percentage));
   }
-  Color darken(const float &percentage) const { return mix(BLACK, percentage); }
 
-  bool operator==(const Color &other) const {
-    return this->toHex() == other.toHex();
+  Color lighten(const float &percentage) const;
+  Color darken(const float &percentage) const;
+
+  constexpr bool operator==(const Color &other) const {
+    return rgb() == other.rgb();
+  }
+  constexpr bool operator!=(const Color &other) const {
+    return !(*this == other);
   }
-  bool operator!=(const Color &other) const { return !(*this == other); }
   bool operator>(const Color other) const {
     return (this->r + this->g + this->b) > (other.r + other.g + other.b);
   }
@@ -149,29 +149,75 @@ public:
     return (this->r + this->g + this->b) < (other.r + other.g + other.b);
   }
 
+  // HSL saturation and hue
   float saturation() const {
-    return (float)(this->r + this->g + this->b) / (255 * 3);
-  }
-  float brightness() const {
-    return 0.2126 * this->r + 0.7152 * this->g + 0.0722 * this->b;
+    float h, s, l;
+    ColorMath::toHsl(r, g, b, h, s, l);
+    return s;
   }
   float hue() const {
-    float R = (float)this->r / UINT8_MAX;
-    float G = (float)this->g / UINT8_MAX;
-    float B = (float)this->b / UINT8_MAX;
-
-    uint8_t maxColor = std::max(R, std::max(G, B));
-    uint8_t minColor = std::min(R, std::min(G, B));
-    if (maxColor == R)
-      return ((float)(G - B) / (maxColor - minColor)) * 60;
-    else if (maxColor == G)
-      return (2 + (float)(B - R) / (maxColor - minColor)) * 60;
-    else
-      return (4 + (float)(R - G) / (maxColor - minColor)) * 60;
+    float h, s, l;
+    ColorMath::toHsl(r, g, b, h, s, l);
+    return h;
+  }
+  // WCAG relative luminance, 0 to 1
+  float brightness() const { return ColorMath::luminance(*this); }
+  // WCAG contrast ratio, 1 to 21
+  float contrast(const Color &other) const {
+    return ColorMath::contrast(brightness(), other.brightness());
+  }
+  // Whether dark text reads better on it than light text: its contrast with
+  // black beats its contrast with white above a luminance of about 0.18
+  bool light() const {
+    float luminance = brightness();
+    return ColorMath::contrast(luminance, 0) >
+           ColorMath::contrast(luminance, 1);
+  }
+
+private:
+  // "#rrggbb", with or without the hash. Missing digits count as 0, so "#8"
+  // is #800000, and digits that are not hex as well.
+  constexpr void parse(const char *hex, size_t length) {
+    if (length > 0 && hex[0] == '#') {
+      hex++;
+      length--;
+    }
+
+    uint8_t *components[4] = {&r, &g, &b, &a};
+    size_t count = length >= 8 ? 4 : 3;
+    for (size_t i = 0; i < count; ++i) {
+      int high = digit(hex, length, 2 * i);
+      int low = digit(hex, length, 2 * i + 1);
+      *components[i] = (uint8_t)(std::max(high, 0) << 4 | std::max(low, 0));
+    }
+  }
+
+  static constexpr int digit(const char *hex, size_t length, size_t i) {
+    return i < length ? HEX_DIGITS.values[(uint8_t)hex[i]] : 0;
+  }
+
+  static char *decimal(char *out, uint8_t value) {
+    if (value >= 100)
+      *out++ = '0' + value / 100;
+    if (value >= 10)
+      *out++ = '0' + value / 10 % 10;
+    *out++ = '0' + value % 10;
+    return out;
   }
-  bool light() const { return (this->r + this->g + this->b) > 384; }
 };
 
+static_assert(sizeof(Color) == 4, "Color is meant to pack into 32 bits");
+
+inline constexpr Color BLACK(0, 0, 0);
+inline constexpr Color WHITE(0xff, 0xff, 0xff);
+
+inline Color Color::lighten(const float &percentage) const {
+  return mix(WHITE, percentage);
+}
+inline Color Color::darken(const float &percentage) const {
+  return mix(BLACK, percentage);
+}
+
 class Colorscheme {
 public:
   Color backgroundColor;
@@ -210,47 +256,14 @@ public:
       // lumiscent and saturated if dark mode, or still saturated but less
       // luminescent on light mode
 
-      if (!backgroundColor.light()) {
-        highlightColor = Color(std::min(paletteColors[13].r * (int)1.2, 255),
-                               paletteColors[13].g / 2,
-                               std::min(paletteColors[13].b * (int)1.3, 255));
+      if (!backgroundColor.light() && paletteColors.size() > 13) {
+        // Bright magenta, a little more vivid
+        ColorMath::Lab lab = ColorMath::oklab(paletteColors[13]);
+        lab.a *= 1.2f;
+        lab.b *= 1.2f;
+        highlightColor = ColorMath::fromOklab<Color>(lab);
       } else {
-        constexpr int targetPurple = 270;
-
-        auto score = [&](const Color &color) -> int {
-          const float CR = color > backgroundColor
-                               ? (color.brightness() + 0.05) /
-                                     (backgroundColor.brightness() + 0.05)
-                               : (backgroundColor.brightness() + 0.05) /
-                                     (color.brightness() + 0.05);
-
-          const float CS = std::min((float)1, CR / 7);
-
-          const float hueDiff =
-              std::min(std::abs(color.hue() - targetPurple),
-                       (float)360 - std::abs((color.hue(), targetPurple)));
-
-          const float hueScore = 1 - (hueDiff / 60);
-
-          const float vibrancyScore = std::exp(
-              -((color.saturation() - 0.7) * (color.saturation() - 0.7) / 0.1));
-
-          return 0.5 * CS + 0.3 * hueScore + 0.2 * vibrancyScore;
-        };
-
-        typedef std::pair<Color, float> scoredcolor_t;
-
-        scoredcolor_t bestColor = {Color("#0"), 0};
-
-        for (size_t i = 0; i < paletteColors.size(); ++i) {
-          if (score(paletteColors[i]) > bestColor.second) {
-            bestColor = {paletteColors[i], score(paletteColors[i])};
-          } else {
-            continue;
-          }
-        }
-
-        highlightColor = bestColor.first;
+        highlightColor = pickHighlight(paletteColors, backgroundColor);
       }
     }
 
@@ -260,6 +273,50 @@ public:
     main.push_back(highlightColor);
   }
 
+  // Rebuild main after the role colors were changed
+  void syncMain() {
+    main = {backgroundColor, foregroundColor, selectedColor,
+            activeColor,     iconColor,       errorColor,
+            passwordColor,   borderColor,     highlightColor};
+  }
+
+  // The palette color that best reads as a highlight on background: high
+  // contrast, a purple hue and a vivid chroma. Scored for the whole palette
+  // in one batch in OKLCh.
+  static Color pickHighlight(const std::vector<Color> &palette,
+                             const Color &background) {
+    constexpr float targetPurple = 300; // OKLCh hue, HSL 270 is about 294
+    constexpr float targetChroma = 0.18f;
+
+    const size_t n = palette.size();
+    ColorMath::Channels lch;
+    ColorMath::linear(palette.data(), n, lch);
+    std::vector<float> luminance(n);
+    ColorMath::luminance(lch, luminance.data());
+    ColorMath::oklab(lch);
+    ColorMath::oklch(lch);
+
+    const float backgroundLuminance = background.brightness();
+    Color best = BLACK;
+    float bestScore = 0;
+    for (size_t i = 0; i < n; ++i) {
+      float contrast =
+          ColorMath::contrast(luminance[i], backgroundLuminance) / 7;
+      float hueDiff = std::fabs(lch.z[i] - targetPurple);
+      hueDiff = std::min(hueDiff, 360 - hueDiff);
+      float chromaDiff = lch.y[i] - targetChroma;
+
+      float score = 0.5f * std::min(1.0f, contrast) +
+                    0.3f * (1 - hueDiff / 60) +
+                    0.2f * std::exp(-chromaDiff * chromaDiff / 0.005f);
+      if (score > bestScore) {
+        best = palette[i];
+        bestScore = score;
+      }
+    }
+    return best;
+  }
+
   Colorscheme(Color mainColors[9]) {
     backgroundColor = mainColors[0];
     foregroundColor = mainColors[1];
@@ -0,0 +1,217 @@
+#pragma once
+
+#include "colormath.hpp"
+#include "colorscheme.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+// Moves role colors just far enough in OKLCh lightness to be readable. Chroma
+// and hue are kept, so a color stays recognizably itself, only lighter or
+// darker.
+//
+// Each color is tried at every lightness step at once: the candidates are
+// converted and measured as one batch, and the one nearest the original that
+// meets the target wins. If none does, the most readable one does.
+class ContrastSolver {
+public:
+  enum Method { WCAG, APCA };
+
+  struct Settings {
+    bool enabled = false;
+    Method method = WCAG;
+    // WCAG ratio (1 to 21) or APCA Lc (0 to about 106)
+    float target = 4.5f;
+    // What the colors have to be readable against: they are drawn on the
+    // background, and the foreground is drawn on them
+    bool background = true;
+    bool foreground = false;
+    // Role names as in the theme, e.g. "selectedColor". Empty means all.
+    std::vector<std::string> roles;
+  };
+
+  struct Adjustment {
+    std::string role;
+    Color before;
+    Color after;
+    float contrastBefore;
+    float contrastAfter;
+    bool met;
+  };
+
+  static const std::vector<std::string> &roleNames() {
+    static const std::vector<std::string> names = {
+        "selectedColor", "activeColor",  "iconColor",     "errorColor",
+        "passwordColor", "borderColor", "highlightColor"};
+    return names;
+  }
+
+  // Adjust the colors in place, returns the ones that changed
+  static std::vector<Adjustment> solve(Colorscheme &colors,
+                                       const Settings &settings) {
+    std::vector<Adjustment> adjusted;
+    if (!settings.enabled || (!settings.background && !settings.foreground))
+      return adjusted;
+
+    std::vector<std::pair<std::string, Color *>> targets;
+    for (const std::string &name : roleNames()) {
+      if (!settings.roles.empty() &&
+          std::find(settings.roles.begin(), settings.roles.end(), name) ==
+              settings.roles.end())
+        continue;
+      targets.push_back({name, role(colors, name)});
+    }
+
+    // Every target at every lightness step, in one batch
+    const size_t n = targets.size();
+    std::vector<Color> originals(n);
+    for (size_t i = 0; i < n; ++i)
+      originals[i] = *targets[i].second;
+
+    ColorMath::Channels lch;
+    ColorMath::linear(originals.data(), n, lch);
+    ColorMath::oklab(lch);
+    ColorMath::oklch(lch);
+
+    ColorMath::Channels candidates(n * STEPS);
+    for (size_t i = 0; i < n; ++i) {
+      for (size_t step = 0; step < STEPS; ++step) {
+        size_t k = i * STEPS + step;
+        candidates.x[k] = (float)step / (STEPS - 1);
+        candidates.y[k] = lch.y[i];
+        candidates.z[k] = lch.z[i];
+      }
+    }
+    ColorMath::oklabFromOklch(candidates);
+    ColorMath::linearFromOklab(candidates);
+    std::vector<Color> encoded(n * STEPS);
+    ColorMath::fromLinear(candidates, encoded.data());
+
+    std::vector<float> scores(n * STEPS);
+    measure(encoded.data(), encoded.size(), colors, settings, scores.data());
+
+    std::vector<float> current(n);
+    measure(originals.data(), n, colors, settings, current.data());
+
+    for (size_t i = 0; i < n; ++i) {
+      if (current[i] >= settings.target)
+        continue;
+
+      // Nearest lightness that meets the target, else the best one
+      const float *score = &scores[i * STEPS];
+      size_t best = STEPS;
+      float bestDistance = std::numeric_limits<float>::max();
+      size_t highest = 0;
+      for (size_t step = 0; step < STEPS; ++step) {
+        float distance = std::fabs((float)step / (STEPS - 1) - lch.x[i]);
+        if (score[step] >= settings.target && distance < bestDistance) {
+          best = step;
+          bestDistance = distance;
+        }
+        if (score[step] > score[highest])
+          highest = step;
+      }
+
+      bool met = best < STEPS;
+      size_t chosen = met ? best : highest;
+      if (score[chosen] <= current[i])
+        continue;
+
+      *targets[i].second = encoded[i * STEPS + chosen];
+      adjusted.push_back({targets[i].first, originals[i],
+                          encoded[i * STEPS + chosen], current[i],
+                          score[chosen], met});
+    }
+
+    if (!adjusted.empty())
+      colors.syncMain();
+    return adjusted;
+  }
+
+  // APCA lightness contrast (0.0.98G) of text on background. Negative for
+  // light text on a dark background.
+  static float apca(const Color &text, const Color &background) {
+    float textY = apcaLuminance(text);
+    float backgroundY = apcaLuminance(background);
+    if (std::fabs(backgroundY - textY) < 0.0005f)
+      return 0;
+
+    // Dark text on a light background and the reverse are weighed apart
+    float s;
+    if (backgroundY > textY) {
+      s = (std::pow(backgroundY, 0.56f) - std::pow(textY, 0.57f)) * 1.14f;
+      return s < 0.1f ? 0 : (s - 0.027f) * 100;
+    }
+    s = (std::pow(backgroundY, 0.65f) - std::pow(textY, 0.62f)) * 1.14f;
+    return s > -0.1f ? 0 : (s + 0.027f) * 100;
+  }
+
+private:
+  static constexpr size_t STEPS = 257;
+
+  static Color *role(Colorscheme &colors, const std::string &name) {
+    if (name == "selectedColor")
+      return &colors.selectedColor;
+    if (name == "activeColor")
+      return &colors.activeColor;
+    if (name == "iconColor")
+      return &colors.iconColor;
+    if (name == "errorColor")
+      return &colors.errorColor;
+    if (name == "passwordColor")
+      return &colors.passwordColor;
+    if (name == "borderColor")
+      return &colors.borderColor;
+    return &colors.highlightColor;
+  }
+
+  // The lower of the contrasts against what the settings ask for
+  static void measure(const Color *candidates, size_t n,
+                      const Colorscheme &colors, const Settings &settings,
+                      float *out) {
+    if (settings.method == APCA) {
+      for (size_t i = 0; i < n; ++i) {
+        float score = std::numeric_limits<float>::max();
+        if (settings.background)
+          score = std::fabs(apca(candidates[i], colors.backgroundColor));
+        if (settings.foreground)
+          score = std::min(
+              score, std::fabs(apca(colors.foregroundColor, candidates[i])));
+        out[i] = score;
+      }
+      return;
+    }
+
+    ColorMath::Channels linear;
+    ColorMath::linear(candidates, n, linear);
+    ColorMath::luminance(linear, out);
+    const float background = colors.backgroundColor.brightness();
+    const float foreground = colors.foregroundColor.brightness();
+    for (size_t i = 0; i < n; ++i) {
+      float luminance = out[i];
+      float score = std::numeric_limits<float>::max();
+      if (settings.background)
+        score = ColorMath::contrast(luminance, background);
+      if (settings.foreground)
+        score = std::min(score, ColorMath::contrast(luminance, foreground));
+      out[i] = score;
+    }
+  }
+
+  // APCA's own luminance: a plain 2.4 gamma and a soft clamp near black
+  static float apcaLuminance(const Color &color) {
+    static const std::array<float, 256> gamma = [] {
+      std::array<float, 256> table{};
+      for (int i = 0; i < 256; ++i)
+        table[i] = std::pow(i / 255.0f, 2.4f);
+      return table;
+    }();
+    float y = 0.2126729f * gamma[color.r] + 0.7151522f * gamma[color.g] +
+              0.0721750f * gamma[color.b];
+    return y < 0.022f ? y + std::pow(0.022f - y, 1.414f) : y;
+  }
+};
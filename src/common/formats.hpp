@@ -0,0 +1,591 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+enum FileType {
+  QS,
+  VALUE_PAIR,
+  CSS,
+  DEFAULT_VALUE,
+};
+
+// Index of the assignments in a config file, built by a small tokenizer per
+// format. Every key maps to the byte span of its value, so an edit is an exact
+// lookup instead of a substring match over every line.
+//
+//   VALUE_PAIR  INI / TOML / ghostty / kitty: `key = value` or `key value`.
+//               Keys inside a [section] are indexed both as "section.key" and
+//               as "key" (first occurrence). Ghostty style indexed values
+//               (`palette = 3=#rrggbb`) are indexed as "palette[3]".
+//   CSS         `name: value;` declarations inside blocks.
+//   QS          QML `property type name: value` and `name: value` bindings.
+class ConfigIndex {
+public:
+  struct Span {
+    uint32_t begin;
+    uint32_t end;
+  };
+
+  std::unordered_map<std::string, Span> spans;
+
+  const Span *find(const std::string &key) const {
+    auto it = spans.find(key);
+    return it == spans.end() ? nullptr : &it->second;
+  }
+
+  static ConfigIndex tokenize(FileType type, const std::string &text) {
+    ConfigIndex index;
+    switch (type) {
+    case VALUE_PAIR:
+      index.tokenizeValuePairs(text);
+      break;
+    case CSS:
+      index.tokenizeCss(text);
+      break;
+    case QS:
+      index.tokenizeQml(text);
+      break;
+    default:
+      break;
+    }
+    return index;
+  }
+
+  void serialize(std::string &out) const {
+    for (const auto &[key, span] : spans) {
+      uint32_t length = key.size();
+      out.append((const char *)&length, sizeof(length));
+      out.append(key);
+      out.append((const char *)&span, sizeof(span));
+    }
+  }
+
+  bool deserialize(const char *data, size_t size, size_t textSize) {
+    spans.clear();
+    while (size > 0) {
+      uint32_t length;
+      Span span;
+      if (size < sizeof(length))
+        return false;
+      memcpy(&length, data, sizeof(length));
+      data += sizeof(length), size -= sizeof(length);
+      if (size < length + sizeof(span))
+        return false;
+      std::string key(data, length);
+      memcpy(&span, data + length, sizeof(span));
+      data += length + sizeof(span), size -= length + sizeof(span);
+
+      if (span.begin > span.end || span.end > textSize)
+        return false;
+      spans.emplace(std::move(key), span);
+    }
+    return true;
+  }
+
+private:
+  void add(const std::string &key, size_t begin, size_t end) {
+    spans.emplace(key, Span{(uint32_t)begin, (uint32_t)end});
+  }
+
+  static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+  // Trim [begin, end) of surrounding whitespace
+  static void trim(const std::string &text, size_t &begin, size_t &end) {
+    while (begin < end && isSpace(text[begin]))
+      begin++;
+    while (end > begin && isSpace(text[end - 1]))
+      end--;
+  }
+
+  void tokenizeValuePairs(const std::string &text) {
+    std::string section;
+    size_t lineBegin = 0;
+
+    while (lineBegin < text.size()) {
+      size_t lineEnd = text.find('\n', lineBegin);
+      if (lineEnd == std::string::npos)
+        lineEnd = text.size();
+
+      size_t begin = lineBegin, end = lineEnd;
+      trim(text, begin, end);
+      lineBegin = lineEnd + 1;
+
+      if (begin == end || text[begin] == '#' || text[begin] == ';')
+        continue;
+
+      if (text[begin] == '[') {
+        size_t close = text.find(']', begin);
+        if (close != std::string::npos && close < end) {
+          size_t nameBegin = begin + 1, nameEnd = close;
+          // TOML arrays of tables, [[name]]
+          while (nameBegin < nameEnd && text[nameBegin] == '[')
+            nameBegin++;
+          trim(text, nameBegin, nameEnd);
+          section = text.substr(nameBegin, nameEnd - nameBegin);
+        }
+        continue;
+      }
+
+      // `key = value`, or `key value` when there is no '='
+      size_t separator = text.find('=', begin);
+      size_t keyEnd;
+      if (separator != std::string::npos && separator < end) {
+        keyEnd = separator;
+      } else {
+        keyEnd = begin;
+        while (keyEnd < end && !isSpace(text[keyEnd]))
+          keyEnd++;
+        separator = keyEnd;
+      }
+
+      size_t keyBegin = begin;
+      trim(text, keyBegin, keyEnd);
+      size_t valueBegin = std::min(separator + 1, end), valueEnd = end;
+      trim(text, valueBegin, valueEnd);
+      if (keyBegin == keyEnd)
+        continue;
+
+      std::string key = text.substr(keyBegin, keyEnd - keyBegin);
+
+      // Indexed values, `palette = 3=#rrggbb`
+      size_t digitsEnd = valueBegin;
+      while (digitsEnd < valueEnd && isdigit((unsigned char)text[digitsEnd]))
+        digitsEnd++;
+      if (digitsEnd > valueBegin && digitsEnd < valueEnd &&
+          text[digitsEnd] == '=') {
+        key += "[" + text.substr(valueBegin, digitsEnd - valueBegin) + "]";
+        valueBegin = digitsEnd + 1;
+      }
+
+      if (!section.empty())
+        add(section + "." + key, valueBegin, valueEnd);
+      add(key, valueBegin, valueEnd);
+    }
+  }
+
+  void tokenizeCss(const std::string &text) {
+    size_t i = 0;
+    int depth = 0;
+    size_t statement = 0;
+
+    while (i < text.size()) {
+      if (text.compare(i, 2, "/*") == 0) {
+        size_t close = text.find("*/", i + 2);
+        i = close == std::string::npos ? text.size() : close + 2;
+        statement = i;
+        continue;
+      }
+
+      char c = text[i];
+      if (c == '{') {
+        depth++;
+        statement = i + 1;
+      } else if (c == '}') {
+        depth = std::max(0, depth - 1);
+        statement = i + 1;
+      } else if (c == ';') {
+        statement = i + 1;
+      } else if (c == ':' && depth > 0) {
+        // A declaration ends at ';' or '}', a nested selector such as
+        // `a:hover {` reaches a '{' first and is not one
+        size_t valueEnd = text.find_first_of(";{}", i + 1);
+        if (valueEnd == std::string::npos)
+          valueEnd = text.size();
+        if (valueEnd < text.size() && text[valueEnd] == '{') {
+          i = valueEnd;
+          continue;
+        }
+
+        size_t keyBegin = statement, keyEnd = i;
+        while (keyBegin < keyEnd && isspace((unsigned char)text[keyBegin]))
+          keyBegin++;
+        trim(text, keyBegin, keyEnd);
+        size_t valueBegin = i + 1;
+        while (valueBegin < valueEnd &&
+               isspace((unsigned char)text[valueBegin]))
+          valueBegin++;
+        while (valueEnd > valueBegin &&
+               isspace((unsigned char)text[valueEnd - 1]))
+          valueEnd--;
+
+        if (keyBegin < keyEnd)
+          add(text.substr(keyBegin, keyEnd - keyBegin), valueBegin, valueEnd);
+        i = valueEnd;
+        continue;
+      }
+      i++;
+    }
+  }
+
+  void tokenizeQml(const std::string &text) {
+    size_t lineBegin = 0;
+
+    while (lineBegin < text.size()) {
+      size_t lineEnd = text.find('\n', lineBegin);
+      if (lineEnd == std::string::npos)
+        lineEnd = text.size();
+
+      size_t begin = lineBegin, end = lineEnd;
+      trim(text, begin, end);
+      lineBegin = lineEnd + 1;
+
+      if (begin == end || text.compare(begin, 2, "//") == 0)
+        continue;
+
+      size_t colon = text.find(':', begin);
+      if (colon == std::string::npos || colon >= end)
+        continue;
+
+      // The key is the last word before the colon, which skips
+      // `readonly property color`
+      size_t keyEnd = colon;
+      while (keyEnd > begin && isSpace(text[keyEnd - 1]))
+        keyEnd--;
+      size_t keyBegin = keyEnd;
+      while (keyBegin > begin && (isalnum((unsigned char)text[keyBegin - 1]) ||
+                                  text[keyBegin - 1] == '_'))
+        keyBegin--;
+      if (keyBegin == keyEnd)
+        continue;
+
+      // Values run to the end of the line, minus a trailing comment
+      size_t valueBegin = colon + 1, valueEnd = end;
+      size_t comment = text.find("//", valueBegin);
+      bool quoted = false;
+      for (size_t j = valueBegin; j < end; ++j) {
+        if (text[j] == '"')
+          quoted = !quoted;
+        if (!quoted && j == comment) {
+          valueEnd = j;
+          break;
+        }
+        if (comment != std::string::npos && j > comment)
+          comment = text.find("//", j);
+      }
+      trim(text, valueBegin, valueEnd);
+
+      add(text.substr(keyBegin, keyEnd - keyBegin), valueBegin, valueEnd);
+    }
+  }
+};
+
+// A config file being edited: its text, its index and the pending edits.
+// Edits are applied in one pass by render().
+class ConfigDocument {
+public:
+  ConfigDocument(FileType type, std::string text, ConfigIndex index)
+      : type(type), text(std::move(text)), index(std::move(index)) {}
+  ConfigDocument(FileType type, std::string text)
+      : type(type), text(std::move(text)) {
+    index = ConfigIndex::tokenize(type, this->text);
+  }
+
+  bool has(const std::string &key) const { return index.find(key); }
+
+  // Returns whether the value changed, false if the key does not exist or
+  // already has that value
+  bool set(const std::string &key, const std::string &value) {
+    const ConfigIndex::Span *span = index.find(key);
+    if (!span)
+      return false;
+
+    auto it = edits.find(span->begin);
+    const std::string current =
+        it != edits.end()
+            ? it->second.second
+            : text.substr(span->begin, span->end - span->begin);
+    if (current == value)
+      return false;
+
+    edits[span->begin] = {span->end, value};
+    return true;
+  }
+
+  bool edited() const { return !edits.empty(); }
+
+  // The edited text. If renderedIndex is given it receives the index of the
+  // result, which is the old one with its spans shifted past the edits.
+  std::string render(ConfigIndex *renderedIndex = nullptr) const {
+    std::string out;
+    out.reserve(text.size() + edits.size() * 8);
+
+    size_t pos = 0;
+    for (const auto &[begin, edit] : orderedEdits()) {
+      out.append(text, pos, begin - pos);
+      out += edit.second;
+      pos = edit.first;
+    }
+    out.append(text, pos, std::string::npos);
+
+    if (renderedIndex) {
+      auto ordered = orderedEdits();
+      renderedIndex->spans.clear();
+      for (const auto &[key, span] : index.spans) {
+        // Every edit before the span moves it by the change in length
+        long shift = 0;
+        size_t length = span.end - span.begin;
+        for (const auto &[begin, edit] : ordered) {
+          if (begin > span.begin)
+            break;
+          if (begin == span.begin) {
+            length = edit.second.size();
+            break;
+          }
+          shift += (long)edit.second.size() - (long)(edit.first - begin);
+        }
+        uint32_t shiftedBegin = span.begin + shift;
+        renderedIndex->spans.emplace(
+            key, ConfigIndex::Span{shiftedBegin,
+                                   (uint32_t)(shiftedBegin + length)});
+      }
+    }
+
+    return out;
+  }
+
+  FileType getType() const { return type; }
+  const ConfigIndex &getIndex() const { return index; }
+
+private:
+  FileType type;
+  std::string text;
+  ConfigIndex index;
+  // value begin -> (value end, new value)
+  std::unordered_map<uint32_t, std::pair<uint32_t, std::string>> edits;
+
+  std::vector<std::pair<uint32_t, std::pair<uint32_t, std::string>>>
+  orderedEdits() const {
+    std::vector<std::pair<uint32_t, std::pair<uint32_t, std::string>>> ordered(
+        edits.begin(), edits.end());
+    std::sort(ordered.begin(), ordered.end(),
+              [](const auto &a, const auto &b) { return a.first < b.first; });
+    return ordered;
+  }
+};
+
+// Indexes of target files cached under $XDG_CACHE_HOME/hoshimi/index, valid
+// for as long as the file keeps its mtime and size. A repeated source can then
+// edit the file without tokenizing it again.
+class ConfigIndexCache {
+public:
+  static bool load(const fs::path &file, FileType type, size_t textSize,
+                   ConfigIndex &out) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0 || (size_t)st.st_size != textSize)
+      return false;
+
+    std::ifstream cached(cacheFile(file), std::ios::binary);
+    if (!cached)
+      return false;
+    std::string data((std::istreambuf_iterator<char>(cached)),
+                     std::istreambuf_iterator<char>());
+
+    std::string header = makeHeader(st, type);
+    if (data.compare(0, header.size(), header) != 0)
+      return false;
+    return out.deserialize(data.data() + header.size(),
+                           data.size() - header.size(), textSize);
+  }
+
+  static void store(const fs::path &file, FileType type,
+                    const ConfigIndex &index) {
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+      return;
+
+    std::string data = makeHeader(st, type);
+    index.serialize(data);
+
+    fs::path cachePath = cacheFile(file);
+    std::error_code ec;
+    fs::create_directories(cachePath.parent_path(), ec);
+    fs::path tmp = cachePath.string() + ".tmp";
+    std::ofstream o(tmp, std::ios::binary);
+    if (o && o.write(data.data(), data.size())) {
+      o.close();
+      fs::rename(tmp, cachePath, ec);
+    }
+  }
+
+private:
+  static std::string makeHeader(const struct stat &st, FileType type) {
+    uint64_t fields[4] = {0x31584449534f48ull, // "HOSIDX1"
+                          (uint64_t)st.st_mtim.tv_sec * 1000000000 +
+                              st.st_mtim.tv_nsec,
+                          (uint64_t)st.st_size, (uint64_t)type};
+    return std::string((const char *)fields, sizeof(fields));
+  }
+
+  static fs::path cacheFile(const fs::path &file) {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    fs::path dir = xdg_cache_home ? fs::path(xdg_cache_home)
+                                  : fs::path(home ? home : "") / ".cache";
+
+    std::error_code ec;
+    std::string key = fs::weakly_canonical(file, ec).string();
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key)
+      hash = (hash ^ c) * 1099511628211ull;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".idx", hash);
+    return dir / "hoshimi/index" / name;
+  }
+};
+
+// A block of QML properties owned by hoshimi, kept between
+//
+//   // hoshimi:begin
+//   ...
+//   // hoshimi:end
+//
+// and regenerated as a whole. Code outside the markers is left alone. The
+// block starts with a hoshimiHash property, a hash of the values below it, so
+// QML can tell whether anything actually changed.
+class QmlPropertyBlock {
+public:
+  static constexpr const char *BEGIN = "// hoshimi:begin";
+  static constexpr const char *END = "// hoshimi:end";
+
+  // declaration is used for properties the file does not declare yet, e.g.
+  // "property color backgroundColor"
+  void add(const std::string &name, const std::string &declaration,
+           const std::string &value) {
+    properties.push_back({name, declaration, value});
+  }
+
+  std::string hash() const {
+    uint64_t hash = 14695981039346656037ull;
+    for (const auto &property : properties) {
+      for (unsigned char c : property.name + ":" + property.value + "\n")
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    char out[17];
+    snprintf(out, sizeof(out), "%016" PRIx64, hash);
+    return out;
+  }
+
+  // The text with the block replaced. A file without markers is migrated: the
+  // lines declaring these properties are removed and the block goes where the
+  // first of them was, or before the closing brace of the root object.
+  std::string apply(const std::string &text) const {
+    size_t begin = text.find(BEGIN);
+    size_t end = begin == std::string::npos ? begin : text.find(END, begin);
+
+    if (end != std::string::npos) {
+      size_t lineBegin = lineStart(text, begin);
+      size_t lineEnd = text.find('\n', end);
+      lineEnd = lineEnd == std::string::npos ? text.size() : lineEnd + 1;
+
+      std::string region = text.substr(lineBegin, lineEnd - lineBegin);
+      return text.substr(0, lineBegin) +
+             render(region, indentOf(text, lineBegin)) + text.substr(lineEnd);
+    }
+
+    // Lines of the existing declarations, in file order
+    ConfigIndex index = ConfigIndex::tokenize(QS, text);
+    std::vector<std::pair<size_t, size_t>> lines;
+    for (const auto &property : properties) {
+      if (const ConfigIndex::Span *span = index.find(property.name)) {
+        size_t lineEnd = text.find('\n', span->end);
+        lines.emplace_back(lineStart(text, span->begin),
+                           lineEnd == std::string::npos ? text.size()
+                                                        : lineEnd + 1);
+      }
+    }
+    std::sort(lines.begin(), lines.end());
+    lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+
+    std::string existing;
+    for (const auto &[lineBegin, lineEnd] : lines)
+      existing += text.substr(lineBegin, lineEnd - lineBegin);
+
+    if (lines.empty()) {
+      size_t brace = text.rfind('}');
+      size_t insert =
+          brace == std::string::npos ? text.size() : lineStart(text, brace);
+      return text.substr(0, insert) + render(existing, "    ") +
+             text.substr(insert);
+    }
+
+    std::string out;
+    size_t pos = 0;
+    for (const auto &[lineBegin, lineEnd] : lines) {
+      out.append(text, pos, lineBegin - pos);
+      if (lineBegin == lines.front().first)
+        out += render(existing, indentOf(text, lineBegin));
+      pos = lineEnd;
+    }
+    out.append(text, pos, std::string::npos);
+    return out;
+  }
+
+private:
+  struct Property {
+    std::string name;
+    std::string declaration;
+    std::string value;
+  };
+
+  std::vector<Property> properties;
+
+  static size_t lineStart(const std::string &text, size_t pos) {
+    size_t newline = pos == 0 ? std::string::npos : text.rfind('\n', pos - 1);
+    return newline == std::string::npos ? 0 : newline + 1;
+  }
+
+  static std::string indentOf(const std::string &text, size_t lineBegin) {
+    size_t end = text.find_first_not_of(" \t", lineBegin);
+    return text.substr(lineBegin, (end == std::string::npos ? text.size()
+                                                            : end) -
+                                      lineBegin);
+  }
+
+  // The block, keeping the declarations (e.g. a readonly qualifier or another
+  // type) that existing already uses for a property
+  std::string render(const std::string &existing,
+                     const std::string &indent) const {
+    ConfigIndex index = ConfigIndex::tokenize(QS, existing);
+    auto declaration = [&](const std::string &name,
+                           const std::string &fallback) {
+      const ConfigIndex::Span *span = index.find(name);
+      if (!span)
+        return fallback;
+      size_t lineBegin = lineStart(existing, span->begin);
+      size_t colon = existing.rfind(':', span->begin);
+      size_t first = existing.find_first_not_of(" \t", lineBegin);
+      if (colon == std::string::npos || first >= colon)
+        return fallback;
+      std::string found = existing.substr(first, colon - first);
+      while (!found.empty() && isspace((unsigned char)found.back()))
+        found.pop_back();
+      return found;
+    };
+
+    std::string out = indent + BEGIN + "\n";
+    out += indent +
+           declaration("hoshimiHash", "readonly property string hoshimiHash") +
+           ": \"" + hash() + "\"\n";
+    for (const auto &property : properties)
+      out += indent + declaration(property.name, property.declaration) + ": " +
+             property.value + "\n";
+    out += indent + END + "\n";
+    return out;
+  }
+};
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "utils/utils.hpp"
+
+#include <cerrno>
+#include <cjson/cJSON.h>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Client for Hyprland's request socket, the one hyprctl talks to. Every
+// request is a fresh connection: write the command, read the reply until
+// Hyprland closes the socket.
+//
+// The socket is found through HYPRLAND_INSTANCE_SIGNATURE, so pointing that
+// (or XDG_RUNTIME_DIR) at a stand-in server is enough to exercise a caller
+// without a running compositor.
+class Hyprland {
+public:
+  struct Client {
+    std::string address;
+    std::string windowClass;
+  };
+
+  static fs::path defaultSocket() {
+    const char *signature = getenv("HYPRLAND_INSTANCE_SIGNATURE");
+    if (!signature || !*signature)
+      return fs::path();
+
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    fs::path socket = fs::path(runtime ? runtime : "") / "hypr" / signature /
+                      ".socket.sock";
+    // Hyprland before 0.40 kept its sockets in /tmp
+    std::error_code ec;
+    if (!runtime || !fs::exists(socket, ec))
+      socket = fs::path("/tmp/hypr") / signature / ".socket.sock";
+    return socket;
+  }
+
+  explicit Hyprland(fs::path socket = defaultSocket())
+      : socket(std::move(socket)) {}
+
+  bool available() const {
+    std::error_code ec;
+    return !socket.empty() && fs::exists(socket, ec);
+  }
+
+  // Send one request and read the whole reply
+  bool request(const std::string &command, std::string &reply) const {
+    return request(command.data(), command.size(), reply);
+  }
+
+  // The same for a command that is already in a buffer. Nothing is allocated
+  // once reply has grown to the size of the answers.
+  bool request(const char *command, size_t size, std::string &reply) const {
+    reply.clear();
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket.native().size() >= sizeof(address.sun_path))
+      return false;
+    strcpy(address.sun_path, socket.c_str());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return false;
+
+    // A compositor that hangs must not hang the source with it
+    timeval timeout{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+      close(fd);
+      return false;
+    }
+
+    const char *data = command;
+    size_t left = size;
+    while (left > 0) {
+      ssize_t n = ::write(fd, data, left);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        close(fd);
+        return false;
+      }
+      data += n;
+      left -= n;
+    }
+
+    char buffer[8192];
+    while (true) {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0) {
+        close(fd);
+        return false;
+      }
+      if (n == 0)
+        break;
+      reply.append(buffer, n);
+    }
+
+    close(fd);
+    return true;
+  }
+
+  // Several commands in one request. Hyprland answers each with "ok" or an
+  // error; returns whether all of them succeeded.
+  bool batch(const std::vector<std::string> &commands) const {
+    if (commands.empty())
+      return true;
+
+    std::string command = "[[BATCH]]";
+    for (size_t i = 0; i < commands.size(); ++i) {
+      if (i > 0)
+        command += ";";
+      command += commands[i];
+    }
+
+    std::string reply;
+    if (!request(command, reply))
+      return false;
+
+    // The replies are separated by blank lines
+    size_t okCount = 0;
+    size_t pos = 0;
+    while (pos < reply.size()) {
+      size_t end = reply.find("\n\n", pos);
+      if (end == std::string::npos)
+        end = reply.size();
+      if (reply.compare(pos, end - pos, "ok") == 0)
+        okCount++;
+      pos = reply.find_first_not_of('\n', end);
+    }
+    return okCount == commands.size();
+  }
+
+  bool clients(std::vector<Client> &out) const {
+    out.clear();
+
+    std::string reply;
+    if (!request("j/clients", reply))
+      return false;
+
+    cJSON *json = cJSON_Parse(reply.c_str());
+    if (!json || !cJSON_IsArray(json)) {
+      cJSON_Delete(json);
+      return false;
+    }
+
+    for (cJSON *client = json->child; client; client = client->next) {
+      cJSON *address = cJSON_GetObjectItemCaseSensitive(client, "address");
+      cJSON *windowClass = cJSON_GetObjectItemCaseSensitive(client, "class");
+      if (!cJSON_IsString(address) || !cJSON_IsString(windowClass))
+        continue;
+      out.push_back({address->valuestring, windowClass->valuestring});
+    }
+
+    cJSON_Delete(json);
+    return true;
+  }
+
+  // Address of the focused window, empty if there is none
+  std::string activeWindow() const {
+    std::string reply;
+    if (!request("j/activewindow", reply))
+      return "";
+
+    cJSON *json = cJSON_Parse(reply.c_str());
+    cJSON *address = cJSON_GetObjectItemCaseSensitive(json, "address");
+    std::string active = cJSON_IsString(address) ? address->valuestring : "";
+    cJSON_Delete(json);
+    return active;
+  }
+
+  const fs::path &getSocket() const { return socket; }
+
+private:
+  fs::path socket;
+};
@@ -0,0 +1,153 @@
+#ifndef HOSHIMI_PALETTE_H
+#define HOSHIMI_PALETTE_H
+
+// The palette hoshimi publishes in $XDG_RUNTIME_DIR/hoshimi/palette every
+// time it sources, and on every frame of a transition. Map the file once and
+// read the colors straight from memory: the file is rewritten in place, never
+// replaced, so the mapping stays current.
+//
+// One color is a single aligned load. For several colors that have to belong
+// together, hoshimi_palette_snapshot copies them under the sequence number,
+// which is odd while hoshimi is writing. hoshimi_palette_sequence is enough to
+// notice that anything changed.
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HOSHIMI_PALETTE_MAGIC 0x4c505348u // "HSPL"
+#define HOSHIMI_PALETTE_VERSION 1u
+#define HOSHIMI_PALETTE_ROLES 9u
+#define HOSHIMI_PALETTE_COLORS (HOSHIMI_PALETTE_ROLES + 16u)
+// How often hoshimi_palette_snapshot tries before it gives up
+#define HOSHIMI_PALETTE_RETRIES 4096
+
+// Indexes of the role colors, the 16 ANSI colors follow them
+enum {
+  HOSHIMI_BACKGROUND = 0,
+  HOSHIMI_FOREGROUND,
+  HOSHIMI_SELECTED,
+  HOSHIMI_ACTIVE,
+  HOSHIMI_ICON,
+  HOSHIMI_ERROR,
+  HOSHIMI_PASSWORD,
+  HOSHIMI_BORDER,
+  HOSHIMI_HIGHLIGHT,
+  HOSHIMI_ANSI = HOSHIMI_PALETTE_ROLES
+};
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sequence;
+  uint32_t count;
+  // 0xRRGGBBAA
+  uint32_t colors[HOSHIMI_PALETTE_COLORS];
+} HoshimiPalette;
+
+// $XDG_RUNTIME_DIR/hoshimi/palette, or $TMPDIR/hoshimi-<uid>/hoshimi/palette
+// without a runtime directory. Returns 0 if it does not fit.
+static inline int hoshimi_palette_path(char *out, size_t size) {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  const char *tmp = getenv("TMPDIR");
+  int n = runtime && *runtime
+              ? snprintf(out, size, "%s/hoshimi/palette", runtime)
+              : snprintf(out, size, "%s/hoshimi-%u/hoshimi/palette",
+                         tmp && *tmp ? tmp : "/tmp", (unsigned)getuid());
+  return n > 0 && (size_t)n < size;
+}
+
+// Map the palette read-only, NULL if hoshimi has not published one yet
+static inline const HoshimiPalette *hoshimi_palette_map(const char *path) {
+  char buffer[4096];
+  if (!path) {
+    if (!hoshimi_palette_path(buffer, sizeof(buffer)))
+      return NULL;
+    path = buffer;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HoshimiPalette)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *mapped =
+      mmap(NULL, sizeof(HoshimiPalette), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return NULL;
+
+  const HoshimiPalette *palette = (const HoshimiPalette *)mapped;
+  if (__atomic_load_n(&palette->magic, __ATOMIC_ACQUIRE) !=
+          HOSHIMI_PALETTE_MAGIC ||
+      palette->version != HOSHIMI_PALETTE_VERSION) {
+    munmap(mapped, sizeof(HoshimiPalette));
+    return NULL;
+  }
+  return palette;
+}
+
+static inline void hoshimi_palette_unmap(const HoshimiPalette *palette) {
+  if (palette)
+    munmap((void *)palette, sizeof(HoshimiPalette));
+}
+
+static inline uint32_t
+hoshimi_palette_sequence(const HoshimiPalette *palette) {
+  return __atomic_load_n(&palette->sequence, __ATOMIC_ACQUIRE);
+}
+
+// One color, 0xRRGGBBAA
+static inline uint32_t hoshimi_palette_color(const HoshimiPalette *palette,
+                                             unsigned index) {
+  if (index >= HOSHIMI_PALETTE_COLORS)
+    return 0;
+  return __atomic_load_n(&palette->colors[index], __ATOMIC_RELAXED);
+}
+
+// Copy every color as one consistent set and store the sequence number it
+// belongs to in sequence, if not NULL. Returns 0 if no consistent copy was
+// made after HOSHIMI_PALETTE_RETRIES tries, e.g. while a writer is stuck
+// halfway; out then holds whatever was read last.
+static inline int hoshimi_palette_snapshot(const HoshimiPalette *palette,
+                                           uint32_t out[HOSHIMI_PALETTE_COLORS],
+                                           uint32_t *sequence) {
+  for (int tries = 0; tries < HOSHIMI_PALETTE_RETRIES; ++tries) {
+    uint32_t before = hoshimi_palette_sequence(palette);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+
+    for (unsigned i = 0; i < HOSHIMI_PALETTE_COLORS; ++i)
+      out[i] = __atomic_load_n(&palette->colors[i], __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&palette->sequence, __ATOMIC_RELAXED) == before) {
+      if (sequence)
+        *sequence = before;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HOSHIMI_PALETTE_H
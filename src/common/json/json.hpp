@@ -6,17 +6,22 @@
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
 #include <libgen.h>
+#include <map>
+#include <mutex>
 #include <ostream>
 #include <regex>
 #include <string>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <zip.h>
 
 #include "../colorscheme.hpp"
+#include "../contrast.hpp"
 #include "../utils/utils.h"
 #include "../utils/utils.hpp"
 
@@ -140,6 +145,130 @@ inline int extract_zipped_file(const char *filename, const char *destdir,
   return 0;
 }
 
+// Merged themes, keyed by the files they were merged from. hoshimi fleet
+// turns it on and loads every home's theme before starting on the homes, so
+// homes whose themes are the same files (a shared themes directory, say) only
+// pay for one merge. An entry is only used while none of the files it was
+// merged from changed, by modification time, size and inode.
+class ThemeCache {
+public:
+  static ThemeCache &get() {
+    static ThemeCache cache;
+    return cache;
+  }
+
+  ~ThemeCache() {
+    for (auto &[key, entry] : entries)
+      cJSON_Delete(entry.merged);
+  }
+
+  bool enabled = false;
+
+  // A copy of the merged theme, nullptr if there is none or it is stale.
+  // files are all the files the theme could be merged from, existing or not.
+  cJSON *find(const std::vector<fs::path> &files) {
+    if (!enabled)
+      return nullptr;
+
+    std::vector<Stamp> current = stamps(files);
+    // The theme may have been merged by someone else, see Fleet: whoever
+    // asks has to be able to read every file of it
+    for (const Stamp &stamp : current) {
+      if (stamp.exists &&
+          faccessat(AT_FDCWD, stamp.file.c_str(), R_OK, AT_EACCESS) != 0)
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = entries.find(key(current));
+    if (it == entries.end() || !same(it->second.stamps, current))
+      return nullptr;
+    reused++;
+    return cJSON_Duplicate(it->second.merged, true);
+  }
+
+  void store(const std::vector<fs::path> &files, const cJSON *merged) {
+    if (!enabled || !merged)
+      return;
+
+    std::vector<Stamp> current = stamps(files);
+    cJSON *copy = cJSON_Duplicate(merged, true);
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry &entry = entries[key(current)];
+    cJSON_Delete(entry.merged);
+    entry = {std::move(current), copy};
+  }
+
+  // Themes merged, and loads that reused one of them
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+  }
+  size_t hits() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return reused;
+  }
+
+private:
+  struct Stamp {
+    std::string file;
+    bool exists;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    long mtimeSec;
+    long mtimeNsec;
+  };
+
+  struct Entry {
+    std::vector<Stamp> stamps;
+    cJSON *merged = nullptr;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, Entry> entries;
+  size_t reused = 0;
+
+  // Files are compared by where they really are, so the same themes reached
+  // through different homes share an entry
+  static std::vector<Stamp> stamps(const std::vector<fs::path> &files) {
+    std::vector<Stamp> out;
+    for (const fs::path &file : files) {
+      std::error_code ec;
+      fs::path real = fs::canonical(file, ec);
+      Stamp stamp{ec ? file.string() : real.string(), false, 0, 0, 0, 0, 0};
+      struct stat st;
+      if (!ec && stat(real.c_str(), &st) == 0) {
+        stamp = {real.string(), true,          st.st_dev,
+                 st.st_ino,     st.st_size,    st.st_mtim.tv_sec,
+                 st.st_mtim.tv_nsec};
+      }
+      out.push_back(stamp);
+    }
+    return out;
+  }
+
+  static std::string key(const std::vector<Stamp> &stamps) {
+    std::string out;
+    for (const Stamp &stamp : stamps) {
+      out += stamp.file;
+      out += '\n';
+    }
+    return out;
+  }
+
+  static bool same(const std::vector<Stamp> &a, const std::vector<Stamp> &b) {
+    if (a.size() != b.size())
+      return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+      if (a[i].exists != b[i].exists || a[i].device != b[i].device ||
+          a[i].inode != b[i].inode || a[i].size != b[i].size ||
+          a[i].mtimeSec != b[i].mtimeSec || a[i].mtimeNsec != b[i].mtimeNsec)
+        return false;
+    }
+    return true;
+  }
+};
+
 class JsonHandlerBase {
 private:
   // Deep merge function for cJSON objects
@@ -163,6 +292,17 @@ private:
         if (cJSON_IsObject(baseItem) && cJSON_IsObject(overrideItem)) {
           deepMergeCJSON(baseItem, overrideItem);
         }
+        // Commands run one after another, and two files listing one each
+        // means both run: they are appended, never merged by index
+        else if (cJSON_IsArray(baseItem) && cJSON_IsArray(overrideItem) &&
+                 strcmp(overrideItem->string, "commands") == 0) {
+          cJSON *command = NULL;
+          cJSON_ArrayForEach(command, overrideItem) {
+            cJSON *duplicate = cJSON_Duplicate(command, true);
+            if (duplicate)
+              cJSON_AddItemToArray(baseItem, duplicate);
+          }
+        }
         // If both are arrays, merge array elements
         else if (cJSON_IsArray(baseItem) && cJSON_IsArray(overrideItem)) {
           // For arrays, we'll replace individual indices
@@ -273,7 +413,10 @@ private:
     additionals_t values;
 
     for (auto it : results) {
-      cJSON *results_json = getJsonFromFile(it.c_str());
+      // Most directories have no shared file, which is not worth an error
+      const fs::path shared = THEMES_PATH / it;
+      cJSON *results_json =
+          fs::exists(shared) ? getJsonFromFile(shared.c_str()) : nullptr;
 
       if (getOrdering(results_json) == Ordering::FIRST) {
         values.first_additionals.push_back(it);
@@ -293,20 +436,23 @@ private:
   cJSON *loadThemeConfig(const char *themeName) {
     // Build paths
     std::string themeDir = std::string(THEMES_PATH) + "/" + themeName;
-    additionals_t additionalJson = getAllJsonPaths(themeName);
     std::string themeConfigPath = themeDir + ".json";
+
+    std::vector<fs::path> sources = themeSources(themeName);
+    if (cJSON *cached = ThemeCache::get().find(sources))
+      return cached;
+
+    additionals_t additionalJson = getAllJsonPaths(themeName);
     // Start with an empty object
     cJSON *mergedConfig = cJSON_CreateObject();
 
     auto merge = [&](std::vector<std::string> additionals) -> void {
       for (auto it : additionals) {
         std::string defaultFile = std::string(THEMES_PATH) + '/' + it;
-        HLOG("JSON") << std::string(THEMES_PATH) << std::endl;
-        HLOG("JSON") << "theme file " << defaultFile << std::endl;
         if (!fs::exists(defaultFile)) {
           continue;
         }
-        std::cout << "FILE: " << defaultFile.c_str() << std::endl;
+        HDBG("JSON") << "theme file " << defaultFile << std::endl;
         cJSON *defaultConfig = getJsonFromFile(defaultFile.c_str());
         if (defaultConfig) {
           deepMergeCJSON(mergedConfig, defaultConfig);
@@ -326,9 +472,27 @@ private:
       cJSON_Delete(themeConfig);
     }
 
+    ThemeCache::get().store(sources, mergedConfig);
     return mergedConfig;
   }
 
+  // Every file a theme can be merged from, whether it exists or not: the
+  // shared *.json of each directory on the way to it, and its own file
+  std::vector<fs::path> themeSources(const char *themeName) {
+    std::vector<std::string> dirs;
+    boost::split(dirs, themeName, boost::is_any_of("/"),
+                 boost::token_compress_on);
+
+    std::vector<fs::path> sources = {THEMES_PATH / "*.json"};
+    fs::path dir = THEMES_PATH;
+    for (size_t i = 0; i + 1 < dirs.size(); ++i) {
+      dir /= dirs[i];
+      sources.push_back(dir / "*.json");
+    }
+    sources.push_back(THEMES_PATH / (std::string(themeName) + ".json"));
+    return sources;
+  }
+
 public:
   cJSON *getJsonFromFile(const char *filePath) {
     std::ifstream input(filePath, std::ios::binary);
@@ -355,7 +519,18 @@ public:
     return json;
   }
 
-  JsonHandlerBase() {
+  JsonHandlerBase() : JsonHandlerBase(themeOverride()) {}
+
+  // The theme the default constructors load instead of the configured one,
+  // empty for the configured one. Lets code that only knows the default
+  // constructors, like the osu generators, render another theme.
+  static std::string &themeOverride() {
+    static std::string theme;
+    return theme;
+  }
+
+  // Load the given theme instead of the one the main config names
+  explicit JsonHandlerBase(const std::string &theme) {
     // Get data path
     const char *xdg_config_home = getenv("XDG_CONFIG_HOME");
     const char *home = getenv("HOME");
@@ -381,7 +556,15 @@ public:
       return std::string();
     };
 
-    std::string themeName = getStringOrEmpty(MAIN_CONFIG_JSON, "config");
+    std::string themeName = theme;
+    if (!themeName.empty()) {
+      if (!fs::exists(THEMES_PATH / (themeName + ".json"))) {
+        cJSON_Delete(MAIN_CONFIG_JSON);
+        throw std::runtime_error("No theme named " + themeName + " in " +
+                                 THEMES_PATH.string());
+      }
+    } else
+      themeName = getStringOrEmpty(MAIN_CONFIG_JSON, "config");
     if (themeName.empty()) {
       HERR("json " + MAIN_CONFIG_PATH.string())
           << "Warning: 'config' key missing or not a string in main config."
@@ -395,6 +578,61 @@ public:
 
   std::string getThemePath() { return THEME_CONFIG_FILE.string(); }
 
+  const fs::path &getThemesPath() const { return THEMES_PATH; }
+
+  // The resolved value of a dotted key such as "colors" or
+  // "globals.wallpaperDirectory", printed as compact JSON. The merged theme is
+  // searched first, then the main config. Empty if the key is not set.
+  std::string getResolved(const std::string &key) {
+    cJSON *item = findResolved(key);
+    if (!item)
+      return std::string();
+
+    char *printed = cJSON_PrintUnformatted(item);
+    std::string value = printed ? printed : "";
+    cJSON_free(printed);
+    return value;
+  }
+
+  // The item itself, owned by the handler. nullptr if the key is not set.
+  cJSON *findResolved(const std::string &key) const {
+    std::vector<std::string> parts;
+    boost::split(parts, key, boost::is_any_of("."));
+
+    for (cJSON *root : {THEME_CONFIG_JSON, MAIN_CONFIG_JSON}) {
+      cJSON *item = root;
+      for (const auto &part : parts) {
+        if (!item)
+          break;
+        item = cJSON_GetObjectItemCaseSensitive(item, part.c_str());
+      }
+      if (item)
+        return item;
+    }
+
+    return nullptr;
+  }
+
+  // The merged theme and the main config as compact JSON, everything the
+  // resolved values come from
+  std::string printAll() const {
+    std::string out;
+    for (cJSON *root : {THEME_CONFIG_JSON, MAIN_CONFIG_JSON}) {
+      char *printed = root ? cJSON_PrintUnformatted(root) : nullptr;
+      out += printed ? printed : "";
+      out += '\n';
+      cJSON_free(printed);
+    }
+    return out;
+  }
+
+  // The theme's name as the main config gives it, e.g. "catppuccin/latte"
+  std::string getThemeName() const {
+    return THEME_CONFIG_FILE.lexically_relative(THEMES_PATH)
+        .replace_extension()
+        .string();
+  }
+
   ~JsonHandlerBase() {
     cJSON_Delete(THEME_CONFIG_JSON);
     cJSON_Delete(MAIN_CONFIG_JSON);
@@ -425,11 +663,26 @@ public:
     std::vector<std::string> linesAdded;
   };
 
+  struct TemplateTarget {
+    std::filesystem::path templateFile;
+    std::filesystem::path file;
+  };
+
+  // A followup command. Commands without "after" may run alongside each
+  // other; timeout is in seconds, 0 for none.
+  struct Command {
+    std::string name;
+    std::string command;
+    std::vector<std::string> after;
+    double timeout = 0;
+  };
+
   struct Config {
     std::string wallpaper;
     std::string osuSkin;
-    std::vector<std::string> commands;
+    std::vector<Command> commands;
     std::vector<CustomWriter> writers;
+    std::vector<TemplateTarget> templates;
   };
 
   Config getConfig() {
@@ -495,9 +748,33 @@ public:
     cJSON *commandsJson = getObj(THEME_CONFIG_JSON, "commands");
     if (commandsJson && cJSON_IsArray(commandsJson)) {
       for (cJSON *cmd = commandsJson->child; cmd; cmd = cmd->next) {
+        Command command;
         if (cJSON_IsString(cmd) && cmd->valuestring) {
-          config.commands.emplace_back(cmd->valuestring);
+          command.command = cmd->valuestring;
+        } else if (cJSON_IsObject(cmd)) {
+          command.command = getString(cmd, "command");
+          command.name = getString(cmd, "name");
+
+          cJSON *after = getObj(cmd, "after");
+          if (cJSON_IsString(after) && after->valuestring)
+            command.after.emplace_back(after->valuestring);
+          else if (cJSON_IsArray(after)) {
+            for (cJSON *dep = after->child; dep; dep = dep->next) {
+              if (cJSON_IsString(dep) && dep->valuestring)
+                command.after.emplace_back(dep->valuestring);
+            }
+          }
+
+          cJSON *timeout = getObj(cmd, "timeout");
+          if (cJSON_IsNumber(timeout))
+            command.timeout = timeout->valuedouble;
         }
+
+        if (command.command.empty())
+          continue;
+        if (command.name.empty())
+          command.name = command.command;
+        config.commands.push_back(std::move(command));
       }
     }
 
@@ -528,6 +805,33 @@ public:
       }
     }
 
+    cJSON *templatesJson = getObj(THEME_CONFIG_JSON, "templates");
+    if (templatesJson && cJSON_IsArray(templatesJson)) {
+      for (cJSON *target = templatesJson->child; target;
+           target = target->next) {
+        if (!cJSON_IsObject(target))
+          continue;
+        TemplateTarget tt;
+
+        std::string templateFile = getString(target, "template");
+        std::string file = getString(target, "file");
+        if (templateFile.empty() || file.empty())
+          continue;
+        if (home && templateFile.rfind("~/", 0) == 0)
+          templateFile = std::string(home) + templateFile.substr(1);
+        if (home && file.rfind("~/", 0) == 0)
+          file = std::string(home) + file.substr(1);
+
+        // Relative template paths live in ~/.config/hoshimi/templates
+        tt.templateFile = templateFile;
+        if (tt.templateFile.is_relative())
+          tt.templateFile = CONFIG_DIRECTORY_PATH / "templates" / templateFile;
+        tt.file = file;
+
+        config.templates.push_back(std::move(tt));
+      }
+    }
+
     // osu skin
     std::string osuPath = getString(globals, "osuSkin");
     trimTrailingSlashes(osuPath);
@@ -535,6 +839,13 @@ public:
       osuPath = std::string(home) + osuPath.substr(1);
     config.osuSkin = osuPath;
 
+    return config;
+  }
+
+  // Unpack the parts of the osu skin the generators use into osu/ in the
+  // working directory. Only the osu generators need this, so it is not part
+  // of reading the config.
+  static bool extractOsuSkin(const std::string &osuPath) {
     int err = 0;
     zip_t *skin = zip_open(osuPath.c_str(), 0, &err);
 
@@ -543,6 +854,7 @@ public:
       zip_error_init_with_code(&error, err);
       HERR("JSON") << "Cannot open zip archive: " << osuPath.c_str() << ": "
                    << zip_error_strerror(&error) << std::endl;
+      return false;
     } else {
 
       mkdir("osu/", 0755);
@@ -613,7 +925,7 @@ public:
 
     zip_close(skin);
 
-    return config;
+    return true;
   }
 };
 
@@ -622,7 +934,8 @@ private:
   cJSON *colors;
 
 public:
-  ColorsHandler() {
+  ColorsHandler() : ColorsHandler(themeOverride()) {}
+  explicit ColorsHandler(const std::string &theme) : JsonHandlerBase(theme) {
     colors = cJSON_Duplicate(
         cJSON_GetObjectItemCaseSensitive(THEME_CONFIG_JSON, "colors"), true);
     if (!colors) {
@@ -632,6 +945,56 @@ public:
 
   ~ColorsHandler() { cJSON_Delete(colors); }
 
+  // Role colors the contrast solver changed in the last getColors()
+  std::vector<ContrastSolver::Adjustment> adjusted;
+
+  // colors.contrast: true for the defaults, or an object with method
+  // ("wcag" or "apca"), target, against (["background", "foreground"]) and
+  // colors (the roles to adjust)
+  ContrastSolver::Settings contrastSettings() const {
+    ContrastSolver::Settings settings;
+    cJSON *contrast = cJSON_GetObjectItemCaseSensitive(colors, "contrast");
+    if (cJSON_IsBool(contrast)) {
+      settings.enabled = cJSON_IsTrue(contrast);
+      return settings;
+    }
+    if (!cJSON_IsObject(contrast))
+      return settings;
+    settings.enabled = true;
+
+    cJSON *method = cJSON_GetObjectItemCaseSensitive(contrast, "method");
+    if (cJSON_IsString(method) && strcmp(method->valuestring, "apca") == 0) {
+      settings.method = ContrastSolver::APCA;
+      settings.target = 60;
+    }
+
+    cJSON *target = cJSON_GetObjectItemCaseSensitive(contrast, "target");
+    if (cJSON_IsNumber(target))
+      settings.target = (float)target->valuedouble;
+
+    cJSON *against = cJSON_GetObjectItemCaseSensitive(contrast, "against");
+    if (cJSON_IsArray(against)) {
+      settings.background = false;
+      cJSON *item;
+      cJSON_ArrayForEach(item, against) {
+        if (!cJSON_IsString(item))
+          continue;
+        if (strcmp(item->valuestring, "background") == 0)
+          settings.background = true;
+        else if (strcmp(item->valuestring, "foreground") == 0)
+          settings.foreground = true;
+      }
+    }
+
+    cJSON *roles = cJSON_GetObjectItemCaseSensitive(contrast, "colors");
+    cJSON *item;
+    cJSON_ArrayForEach(item, roles) {
+      if (cJSON_IsString(item))
+        settings.roles.push_back(item->valuestring);
+    }
+    return settings;
+  }
+
   Colorscheme getColors() {
 
     // Use safer access methods
@@ -718,6 +1081,8 @@ public:
         selectedColorValue, iconColorValue,   errorColorValue,
         passwordColorValue, borderColorValue, highlightColor};
 
-    return Colorscheme(mainColors, paletteColors);
+    Colorscheme scheme(mainColors, paletteColors);
+    adjusted = ContrastSolver::solve(scheme, contrastSettings());
+    return scheme;
   }
 };
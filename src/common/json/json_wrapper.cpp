@@ -29,7 +29,7 @@ Config *load_config(void) {
 
       cConfig->commands = (char **)malloc(sizeof(char *) * (count + 1));
       for (int i = 0; i < count; i++) {
-        cConfig->commands[i] = strdup(cppConfig.commands[i].c_str());
+        cConfig->commands[i] = strdup(cppConfig.commands[i].command.c_str());
       }
       cConfig->commands[count] = nullptr;
     } else {
@@ -80,6 +80,15 @@ void free_config(Config *config) {
   free(config);
 }
 
+int prepare_osu_skin(void) {
+  try {
+    ShellHandler handler;
+    return ShellHandler::extractOsuSkin(handler.getConfig().osuSkin) ? 0 : 1;
+  } catch (...) {
+    return 1;
+  }
+}
+
 C_ColorScheme *load_colorscheme(void) {
   try {
     ColorsHandler handler;
@@ -32,6 +32,10 @@ typedef struct {
 Config *load_config(void);
 void free_config(Config *config);
 
+// Unpack the configured osu skin into osu/ in the working directory, where
+// the generators look for it. Returns 0 on success.
+int prepare_osu_skin(void);
+
 C_ColorScheme *load_colorscheme(void);
 void free_colorscheme(C_ColorScheme *colors);
 
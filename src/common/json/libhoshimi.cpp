@@ -0,0 +1,176 @@
+#include "libhoshimi.h"
+#include "json.hpp"
+
+#include <exception>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+struct hoshimi_theme {
+  struct Callback {
+    int id;
+    hoshimi_change_fn function;
+    void *user;
+  };
+
+  // The theme asked for, empty for the configured one
+  std::string requested;
+
+  // Everything the getters hand out, replaced as a whole on reload
+  std::unique_ptr<ColorsHandler> handler;
+  std::string name;
+  hoshimi_color roles[HOSHIMI_ROLES] = {};
+  std::vector<hoshimi_color> palette;
+  std::map<std::string, std::string> printed;
+  // Both configs as compact JSON, to tell whether a reload changed anything
+  std::string snapshot;
+
+  std::string error;
+  uint64_t generation = 0;
+  std::vector<Callback> callbacks;
+  int nextCallback = 1;
+};
+
+namespace {
+
+hoshimi_color convert(const Color &color) {
+  return {color.r, color.g, color.b, color.a};
+}
+
+// Load into theme, returns 1 if something changed, 0 if not and -1 if the
+// configuration could not be read
+int load(hoshimi_theme *theme) {
+  try {
+    auto handler = std::make_unique<ColorsHandler>(theme->requested);
+    const Colorscheme colors = handler->getColors();
+    std::string snapshot = handler->printAll() + handler->getThemeName();
+    theme->error.clear();
+
+    // Everything a getter returns comes from the configs, so the same
+    // snapshot means nothing changed
+    if (theme->handler && snapshot == theme->snapshot)
+      return 0;
+
+    for (size_t i = 0; i < HOSHIMI_ROLES && i < colors.main.size(); ++i)
+      theme->roles[i] = convert(colors.main[i]);
+    theme->palette.clear();
+    for (const Color &color : colors.palette)
+      theme->palette.push_back(convert(color));
+    theme->name = handler->getThemeName();
+    theme->printed.clear();
+    theme->snapshot = std::move(snapshot);
+    theme->handler = std::move(handler);
+    theme->generation++;
+    return 1;
+  } catch (const std::exception &e) {
+    theme->error = e.what();
+    return -1;
+  }
+}
+
+} // namespace
+
+extern "C" {
+
+hoshimi_theme *hoshimi_open(const char *name) {
+  hoshimi_theme *theme = new (std::nothrow) hoshimi_theme;
+  if (!theme)
+    return nullptr;
+  if (name)
+    theme->requested = name;
+  load(theme);
+  return theme;
+}
+
+void hoshimi_close(hoshimi_theme *theme) { delete theme; }
+
+const char *hoshimi_error(const hoshimi_theme *theme) {
+  if (!theme)
+    return "No theme";
+  return theme->error.empty() ? nullptr : theme->error.c_str();
+}
+
+int hoshimi_reload(hoshimi_theme *theme) {
+  if (!theme)
+    return -1;
+
+  int changed = load(theme);
+  if (changed == 1) {
+    // A copy, so callbacks can add or remove callbacks
+    const std::vector<hoshimi_theme::Callback> callbacks = theme->callbacks;
+    for (const auto &callback : callbacks)
+      callback.function(theme, callback.user);
+  }
+  return changed;
+}
+
+uint64_t hoshimi_generation(const hoshimi_theme *theme) {
+  return theme ? theme->generation : 0;
+}
+
+int hoshimi_on_change(hoshimi_theme *theme, hoshimi_change_fn callback,
+                      void *user) {
+  if (!theme || !callback)
+    return -1;
+  theme->callbacks.push_back({theme->nextCallback, callback, user});
+  return theme->nextCallback++;
+}
+
+void hoshimi_remove_callback(hoshimi_theme *theme, int id) {
+  if (!theme)
+    return;
+  auto &callbacks = theme->callbacks;
+  for (auto it = callbacks.begin(); it != callbacks.end(); ++it) {
+    if (it->id == id) {
+      callbacks.erase(it);
+      return;
+    }
+  }
+}
+
+const char *hoshimi_name(const hoshimi_theme *theme) {
+  return theme && theme->handler ? theme->name.c_str() : nullptr;
+}
+
+const hoshimi_color *hoshimi_roles(const hoshimi_theme *theme) {
+  return theme && theme->handler ? theme->roles : nullptr;
+}
+
+const hoshimi_color *hoshimi_palette(const hoshimi_theme *theme,
+                                     size_t *count) {
+  if (!theme || !theme->handler) {
+    if (count)
+      *count = 0;
+    return nullptr;
+  }
+  if (count)
+    *count = theme->palette.size();
+  return theme->palette.data();
+}
+
+const char *hoshimi_get(hoshimi_theme *theme, const char *key) {
+  if (!theme || !theme->handler || !key)
+    return nullptr;
+
+  // Printed once per key and load, the pointer stays valid until reload
+  auto it = theme->printed.find(key);
+  if (it == theme->printed.end()) {
+    std::string value = theme->handler->getResolved(key);
+    if (value.empty())
+      return nullptr;
+    it = theme->printed.emplace(key, std::move(value)).first;
+  }
+  return it->second.c_str();
+}
+
+const char *hoshimi_get_string(const hoshimi_theme *theme, const char *key) {
+  if (!theme || !theme->handler || !key)
+    return nullptr;
+
+  cJSON *item = theme->handler->findResolved(key);
+  return cJSON_IsString(item) ? item->valuestring : nullptr;
+}
+
+} // extern "C"
@@ -0,0 +1,92 @@
+#ifndef LIBHOSHIMI_H
+#define LIBHOSHIMI_H
+
+// In-process access to hoshimi's resolved configuration, for native tools and
+// QML plugins that would otherwise run `hoshimi config ... get`.
+//
+// A hoshimi_theme is a loaded theme: the main config with the theme and its
+// shared files merged in, exactly as `hoshimi source` resolves it. Reading
+// never writes anything or touches anything outside the config directory.
+//
+// Strings and arrays returned by the getters are borrowed: they belong to the
+// handle and stay valid until the next hoshimi_reload or hoshimi_close on it.
+// A handle is not safe to use from several threads at once; separate handles
+// are independent.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LIBHOSHIMI_VERSION 1
+
+typedef struct hoshimi_theme hoshimi_theme;
+
+typedef struct {
+  uint8_t r, g, b, a;
+} hoshimi_color;
+
+// Indexes into hoshimi_roles, the same order as the shared palette
+enum {
+  HOSHIMI_ROLE_BACKGROUND = 0,
+  HOSHIMI_ROLE_FOREGROUND,
+  HOSHIMI_ROLE_SELECTED,
+  HOSHIMI_ROLE_ACTIVE,
+  HOSHIMI_ROLE_ICON,
+  HOSHIMI_ROLE_ERROR,
+  HOSHIMI_ROLE_PASSWORD,
+  HOSHIMI_ROLE_BORDER,
+  HOSHIMI_ROLE_HIGHLIGHT,
+  HOSHIMI_ROLES
+};
+
+typedef void (*hoshimi_change_fn)(hoshimi_theme *theme, void *user);
+
+// Load a theme by name ("catppuccin/latte"), or the configured one for NULL.
+// Returns NULL only when out of memory; a theme that failed to load is
+// reported by hoshimi_error.
+hoshimi_theme *hoshimi_open(const char *theme);
+void hoshimi_close(hoshimi_theme *theme);
+
+// Why the last open or reload failed, NULL if it did not
+const char *hoshimi_error(const hoshimi_theme *theme);
+
+// Read the configuration again. Returns 1 if anything changed, in which case
+// the change callbacks have run, 0 if nothing did and -1 if it could not be
+// read, in which case the handle keeps what it had.
+int hoshimi_reload(hoshimi_theme *theme);
+
+// Counts the loads that changed something, starting at 1
+uint64_t hoshimi_generation(const hoshimi_theme *theme);
+
+// Called from hoshimi_reload after a change. Returns an id for
+// hoshimi_remove_callback.
+int hoshimi_on_change(hoshimi_theme *theme, hoshimi_change_fn callback,
+                      void *user);
+void hoshimi_remove_callback(hoshimi_theme *theme, int id);
+
+// The theme's name, e.g. "catppuccin/latte"
+const char *hoshimi_name(const hoshimi_theme *theme);
+
+// HOSHIMI_ROLES colors, indexed by HOSHIMI_ROLE_*
+const hoshimi_color *hoshimi_roles(const hoshimi_theme *theme);
+
+// The ANSI palette, count is set to its size
+const hoshimi_color *hoshimi_palette(const hoshimi_theme *theme,
+                                     size_t *count);
+
+// The value of a dotted key such as "globals.wallpaperDirectory" as compact
+// JSON. The theme is searched first, then the main config. NULL if unset.
+const char *hoshimi_get(hoshimi_theme *theme, const char *key);
+
+// The same for a string value, without the quotes. NULL if the key is unset
+// or not a string.
+const char *hoshimi_get_string(const hoshimi_theme *theme, const char *key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBHOSHIMI_H
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "colormath.hpp"
+#include "colorscheme.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+// The xterm 256 color palette derived from the theme instead of xterm's stock
+// one. 0-15 are the theme's palette. The 6x6x6 cube (16-231) spans the
+// theme: its corners are the background, the foreground and the six base
+// colors (red at 1, green at 2 and so on), with everything in between
+// interpolated in OKLab. The grey ramp (232-255) runs from the background to
+// the foreground.
+class Palette256 {
+public:
+  explicit Palette256(const Colorscheme &scheme) : colors(256) {
+    for (size_t i = 0; i < 16; ++i)
+      colors[i] = i < scheme.palette.size() ? scheme.palette[i] : BLACK;
+
+    auto corner = [&](size_t i) { return ColorMath::oklab(colors[i]); };
+    const ColorMath::Lab background = ColorMath::oklab(scheme.backgroundColor);
+    const ColorMath::Lab foreground = ColorMath::oklab(scheme.foregroundColor);
+    // Indexed by red + 2 * green + 4 * blue, as the ANSI colors are
+    const ColorMath::Lab corners[8] = {background, corner(1), corner(2),
+                                       corner(3),  corner(4), corner(5),
+                                       corner(6),  foreground};
+
+    ColorMath::Channels lab(216 + 24);
+    for (size_t r = 0; r < 6; ++r) {
+      for (size_t g = 0; g < 6; ++g) {
+        for (size_t b = 0; b < 6; ++b) {
+          auto lerp = [](const ColorMath::Lab &from, const ColorMath::Lab &to,
+                         size_t step) {
+            return ColorMath::mix(from, to, step / 5.0f);
+          };
+          // Along red, then green, then blue
+          ColorMath::Lab c00 = lerp(corners[0], corners[1], r);
+          ColorMath::Lab c10 = lerp(corners[2], corners[3], r);
+          ColorMath::Lab c01 = lerp(corners[4], corners[5], r);
+          ColorMath::Lab c11 = lerp(corners[6], corners[7], r);
+          ColorMath::Lab c0 = lerp(c00, c10, g);
+          ColorMath::Lab c1 = lerp(c01, c11, g);
+          ColorMath::Lab c = lerp(c0, c1, b);
+
+          size_t k = 36 * r + 6 * g + b;
+          lab.x[k] = c.L;
+          lab.y[k] = c.a;
+          lab.z[k] = c.b;
+        }
+      }
+    }
+    for (size_t i = 0; i < 24; ++i) {
+      ColorMath::Lab c =
+          ColorMath::mix(background, foreground, (i + 1) / 25.0f);
+      lab.x[216 + i] = c.L;
+      lab.y[216 + i] = c.a;
+      lab.z[216 + i] = c.b;
+    }
+
+    ColorMath::linearFromOklab(lab);
+    ColorMath::fromLinear(lab, colors.data() + 16);
+  }
+
+  const Color &operator[](size_t i) const { return colors[i]; }
+  const std::vector<Color> &all() const { return colors; }
+
+  // Index of the palette color nearest to any truecolor, by distance in
+  // OKLab. The answer comes from a 32x32x32 table over the RGB cube, which is
+  // filled the first time it is needed.
+  uint8_t nearest(const Color &color) const {
+    std::call_once(lutBuilt, [this]() { buildLut(); });
+    return lut[(color.r >> 3) << 10 | (color.g >> 3) << 5 | color.b >> 3];
+  }
+
+private:
+  std::vector<Color> colors;
+  mutable std::vector<uint8_t> lut;
+  mutable std::once_flag lutBuilt;
+
+  void buildLut() const {
+    ColorMath::Channels palette;
+    ColorMath::linear(colors.data(), colors.size(), palette);
+    ColorMath::oklab(palette);
+
+    // The center of every cell
+    std::vector<Color> centers(32 * 32 * 32);
+    for (size_t i = 0; i < centers.size(); ++i)
+      centers[i] = Color((i >> 10) * 8 + 4, (i >> 5 & 31) * 8 + 4,
+                         (i & 31) * 8 + 4);
+    ColorMath::Channels cells;
+    ColorMath::linear(centers.data(), centers.size(), cells);
+    ColorMath::oklab(cells);
+
+    lut.resize(centers.size());
+    for (size_t i = 0; i < centers.size(); ++i) {
+      float best = std::numeric_limits<float>::max();
+      for (size_t j = 0; j < palette.size(); ++j) {
+        float dL = cells.x[i] - palette.x[j];
+        float da = cells.y[i] - palette.y[j];
+        float db = cells.z[i] - palette.z[j];
+        float distance = dL * dL + da * da + db * db;
+        if (distance < best) {
+          best = distance;
+          lut[i] = (uint8_t)j;
+        }
+      }
+    }
+  }
+};
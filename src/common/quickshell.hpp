@@ -0,0 +1,132 @@
+#pragma once
+
+#include "utils/process.hpp"
+#include "utils/processes.hpp"
+#include "utils/utils.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Owns the Quickshell lifecycle across a restart. The new instance is started
+// next to the old one, and the old one is only stopped once the new one
+// answers over IPC, so the bar is never gone for longer than the switch.
+//
+// The outcome goes to $XDG_RUNTIME_DIR/hoshimi/quickshell for scripts:
+// "state=ready" or "state=failed", the pid of the running instance, how long
+// the restart took and why it failed.
+class QuickshellSupervisor {
+public:
+  struct Status {
+    bool ready = false;
+    pid_t pid = -1;
+    long milliseconds = 0;
+    std::string reason;
+  };
+
+  static fs::path statusFile() {
+    return Utils::runtimeDir() / "quickshell";
+  }
+
+  explicit QuickshellSupervisor(int readyTimeoutMs = 10000)
+      : readyTimeoutMs(readyTimeoutMs) {}
+
+  Status restart() {
+    auto begin = std::chrono::steady_clock::now();
+    Status status;
+
+    ProcessTable &table = ProcessTable::get();
+    table.refresh();
+    std::vector<ProcessTable::Process> old = table.find("qs");
+
+    Process::Child child;
+    Process::Options options;
+    options.detach = true;
+    if (!Process::start({"qs"}, child, options)) {
+      status.reason = "qs could not be started: " + child.result.errors;
+      if (!status.reason.empty() && status.reason.back() == '\n')
+        status.reason.pop_back();
+    } else if (waitReady(child, status.reason)) {
+      status.ready = true;
+      status.pid = child.pid;
+      if (!old.empty() && !table.terminate(old))
+        HERR("quickshell") << "The old instance did not stop in time"
+                           << std::endl;
+    } else if (!Process::exited(child)) {
+      // Never came up, keep the old instance rather than leaving no bar
+      kill(child.pid, SIGTERM);
+    }
+
+    // Without a working new instance the old one, if any, is still running
+    if (!status.ready && !old.empty())
+      status.pid = old.front().pid;
+
+    status.milliseconds =
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin)
+            .count();
+    writeStatus(status);
+    return status;
+  }
+
+  static bool writeStatus(const Status &status) {
+    fs::path path = statusFile();
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    // Written aside and renamed, a script never reads half a status
+    fs::path tmp = path;
+    tmp += ".tmp";
+    {
+      std::ofstream f(tmp, std::ios::trunc);
+      if (!f.is_open())
+        return false;
+      f << "state=" << (status.ready ? "ready" : "failed") << "\n";
+      f << "pid=" << status.pid << "\n";
+      f << "milliseconds=" << status.milliseconds << "\n";
+      if (!status.reason.empty())
+        f << "reason=" << status.reason << "\n";
+      if (!f)
+        return false;
+    }
+    fs::rename(tmp, path, ec);
+    return !ec;
+  }
+
+private:
+  int readyTimeoutMs;
+
+  // An instance is ready once it answers `qs ipc show`, which needs its
+  // config to be loaded
+  bool waitReady(Process::Child &child, std::string &reason) const {
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(readyTimeoutMs);
+    const std::vector<std::string> probe = {
+        "qs", "ipc", "--pid", std::to_string(child.pid), "show"};
+
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (Process::exited(child)) {
+        reason = "qs exited with status " +
+                 std::to_string(child.result.exitCode) + " while starting";
+        return false;
+      }
+
+      Process::Result result;
+      if (Process::run(probe, result, 1000))
+        return true;
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    reason = "qs did not answer over IPC within " +
+             std::to_string(readyTimeoutMs) + " ms";
+    return false;
+  }
+};
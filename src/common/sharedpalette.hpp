@@ -0,0 +1,133 @@
+#pragma once
+
+#include "colorscheme.hpp"
+#include "json/hoshimi_palette.h"
+#include "utils/utils.hpp"
+
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Writes the current palette to a small file in $XDG_RUNTIME_DIR that readers
+// map into memory. The layout and the reader side are in hoshimi_palette.h,
+// which is installed for other programs. The file is written in place, never
+// replaced, so a mapping stays valid for as long as the reader keeps it.
+//
+// Writes are guarded by a sequence number that is odd while a write is in
+// progress: a reader copies the colors and tries again if the number was odd
+// or changed in between. Only one process may write at a time, a source can
+// run during a transition, so writers hold a flock on the file.
+class SharedPalette {
+public:
+  using Layout = HoshimiPalette;
+
+  static constexpr uint32_t MAGIC = HOSHIMI_PALETTE_MAGIC;
+  static constexpr uint32_t VERSION = HOSHIMI_PALETTE_VERSION;
+  // The nine role colors in Colorscheme::main order, then the 16 ANSI ones
+  static constexpr uint32_t ROLES = HOSHIMI_PALETTE_ROLES;
+  static constexpr uint32_t COLORS = HOSHIMI_PALETTE_COLORS;
+
+  static fs::path file() {
+    return Utils::runtimeDir() / "palette";
+  }
+
+  SharedPalette() = default;
+  SharedPalette(const SharedPalette &) = delete;
+  SharedPalette &operator=(const SharedPalette &) = delete;
+  ~SharedPalette() {
+    if (layout)
+      munmap(layout, sizeof(Layout));
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Map the file, creating it the first time
+  bool open(const fs::path &path = file()) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    void *mapped = MAP_FAILED;
+    if (flock(fd, LOCK_EX) == 0) {
+      if (fstat(fd, &st) == 0 && ((size_t)st.st_size >= sizeof(Layout) ||
+                                  ftruncate(fd, sizeof(Layout)) == 0))
+        mapped = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    }
+    if (mapped == MAP_FAILED) {
+      close(fd);
+      fd = -1;
+      return false;
+    }
+
+    layout = (Layout *)mapped;
+    // A new file, or one from another version, starts over
+    if (layout->magic != MAGIC || layout->version != VERSION) {
+      layout->sequence = 0;
+      layout->count = COLORS;
+      layout->version = VERSION;
+      __atomic_store_n(&layout->magic, MAGIC, __ATOMIC_RELEASE);
+    }
+    // Odd under the lock means a writer died halfway. Its colors may be
+    // torn, but the next publish rewrites all of them.
+    uint32_t sequence = __atomic_load_n(&layout->sequence, __ATOMIC_RELAXED);
+    if (sequence & 1)
+      __atomic_store_n(&layout->sequence, sequence + 1, __ATOMIC_RELEASE);
+    flock(fd, LOCK_UN);
+    return true;
+  }
+
+  bool isOpen() const { return layout != nullptr; }
+
+  // Publish roles (ROLES of them) and palette (up to 16). Nothing is
+  // allocated, this runs once per frame of a transition.
+  void publish(const Color *roles, const Color *palette, size_t paletteSize) {
+    if (!layout || flock(fd, LOCK_EX) != 0)
+      return;
+
+    uint32_t sequence = __atomic_load_n(&layout->sequence, __ATOMIC_RELAXED);
+    __atomic_store_n(&layout->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < COLORS; ++i) {
+      const Color *color = nullptr;
+      if (i < ROLES)
+        color = &roles[i];
+      else if (i - ROLES < paletteSize)
+        color = &palette[i - ROLES];
+      __atomic_store_n(&layout->colors[i], color ? pack(*color) : 0,
+                       __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&layout->sequence, sequence + 2, __ATOMIC_RELEASE);
+    flock(fd, LOCK_UN);
+  }
+
+  void publish(const Colorscheme &colors) {
+    const Color roles[ROLES] = {
+        colors.backgroundColor, colors.foregroundColor, colors.selectedColor,
+        colors.activeColor,     colors.iconColor,       colors.errorColor,
+        colors.passwordColor,   colors.borderColor,     colors.highlightColor};
+    publish(roles, colors.palette.data(), colors.palette.size());
+  }
+
+private:
+  Layout *layout = nullptr;
+  int fd = -1;
+
+  static uint32_t pack(const Color &color) {
+    return (uint32_t)color.r << 24 | (uint32_t)color.g << 16 |
+           (uint32_t)color.b << 8 | color.a;
+  }
+};
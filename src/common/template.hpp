@@ -0,0 +1,348 @@
+#pragma once
+
+#include "colorscheme.hpp"
+#include "palette256.hpp"
+#include "utils/utils.h"
+#include "utils/utils.hpp"
+
+#include <algorithm>
+#include <boost/algorithm/string.hpp>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Color templates, e.g.
+//
+//   background = {{background|hex_nohash}}
+//   color3 {{palette.3}}
+//   --rgb-text: {{foreground|rgb_spaced}};
+//
+// A placeholder names a color of the Colorscheme followed by any number of
+// filters, each of which maps onto a Color::FLAGS bit. A template is compiled
+// once into a flat list of literal spans and color ops, so rendering is a
+// single linear append.
+class Template {
+public:
+  enum Slot : int16_t {
+    LITERAL = -1,
+    BACKGROUND,
+    FOREGROUND,
+    SELECTED,
+    ACTIVE,
+    ICON,
+    ERROR,
+    PASSWORD,
+    BORDER,
+    HIGHLIGHT,
+    PALETTE, // PALETTE + n is color n of the 256 color palette
+  };
+
+  // Filter bits past Color::FLAGS
+  enum Filter : uint16_t {
+    ANSI256 = 1 << 8, // the index of the nearest 256 palette color
+  };
+
+  struct Op {
+    int16_t slot;
+    uint16_t flags;
+    uint32_t offset; // into literals, for LITERAL ops
+    uint32_t length;
+  };
+
+  std::string literals;
+  std::vector<Op> ops;
+
+  // Compile a template. On failure returns false and describes the problem
+  // (with its line number) in error.
+  static bool compile(const std::string &source, Template &out,
+                      std::string &error) {
+    out.literals.clear();
+    out.ops.clear();
+
+    size_t pos = 0;
+    while (pos < source.size()) {
+      size_t open = source.find("{{", pos);
+      size_t close =
+          open == std::string::npos ? open : source.find("}}", open + 2);
+      if (close == std::string::npos) {
+        out.addLiteral(source.data() + pos, source.size() - pos);
+        break;
+      }
+
+      out.addLiteral(source.data() + pos, open - pos);
+
+      Op op;
+      std::string placeholder = source.substr(open + 2, close - open - 2);
+      if (!parsePlaceholder(placeholder, op, error)) {
+        size_t line = 1 + std::count(source.begin(), source.begin() + open,
+                                     '\n');
+        error = "line " + std::to_string(line) + ": " + error;
+        return false;
+      }
+      out.ops.push_back(op);
+      pos = close + 2;
+    }
+
+    return true;
+  }
+
+  void render(const Colorscheme &colors, std::string &out) const {
+    // The 256 color palette is only derived for templates that use it
+    std::unique_ptr<Palette256> extended;
+    for (const Op &op : ops) {
+      if (op.slot >= PALETTE + 16 || (op.flags & ANSI256)) {
+        extended.reset(new Palette256(colors));
+        break;
+      }
+    }
+
+    out.reserve(out.size() + literals.size() + ops.size() * 16);
+    for (const Op &op : ops) {
+      if (op.slot == LITERAL) {
+        out.append(literals, op.offset, op.length);
+        continue;
+      }
+
+      const Color &value = op.slot >= PALETTE + 16
+                               ? (*extended)[op.slot - PALETTE]
+                               : color(colors, op.slot);
+      if (op.flags & ANSI256)
+        out += std::to_string(extended->nearest(value));
+      else
+        value.appendTo(out, op.flags);
+    }
+  }
+
+  std::string render(const Colorscheme &colors) const {
+    std::string out;
+    render(colors, out);
+    return out;
+  }
+
+  static const Color &color(const Colorscheme &colors, int slot) {
+    switch (slot) {
+    case BACKGROUND:
+      return colors.backgroundColor;
+    case FOREGROUND:
+      return colors.foregroundColor;
+    case SELECTED:
+      return colors.selectedColor;
+    case ACTIVE:
+      return colors.activeColor;
+    case ICON:
+      return colors.iconColor;
+    case ERROR:
+      return colors.errorColor;
+    case PASSWORD:
+      return colors.passwordColor;
+    case BORDER:
+      return colors.borderColor;
+    case HIGHLIGHT:
+      return colors.highlightColor;
+    default:
+      return colors.palette[slot - PALETTE];
+    }
+  }
+
+  // Serialized form used by TemplateCache. The layout is only ever read back
+  // by the same binary, so the ops are stored as they are in memory.
+  void serialize(std::string &out) const {
+    uint32_t literalsSize = literals.size();
+    uint32_t opCount = ops.size();
+    out.append((const char *)&literalsSize, sizeof(literalsSize));
+    out.append(literals);
+    out.append((const char *)&opCount, sizeof(opCount));
+    out.append((const char *)ops.data(), ops.size() * sizeof(Op));
+  }
+
+  bool deserialize(const char *data, size_t size) {
+    uint32_t literalsSize, opCount;
+    if (size < sizeof(literalsSize))
+      return false;
+    memcpy(&literalsSize, data, sizeof(literalsSize));
+    data += sizeof(literalsSize), size -= sizeof(literalsSize);
+
+    if (size < literalsSize + sizeof(opCount))
+      return false;
+    literals.assign(data, literalsSize);
+    data += literalsSize, size -= literalsSize;
+
+    memcpy(&opCount, data, sizeof(opCount));
+    data += sizeof(opCount), size -= sizeof(opCount);
+    if (size != opCount * sizeof(Op))
+      return false;
+    ops.resize(opCount);
+    memcpy(ops.data(), data, size);
+
+    for (const Op &op : ops) {
+      if (op.slot < LITERAL || op.slot >= PALETTE + 256)
+        return false;
+      if (op.slot == LITERAL && op.offset + op.length > literals.size())
+        return false;
+    }
+    return true;
+  }
+
+private:
+  void addLiteral(const char *text, size_t length) {
+    if (length == 0)
+      return;
+    // Merge with the previous literal so the op list stays flat
+    if (!ops.empty() && ops.back().slot == LITERAL) {
+      ops.back().length += length;
+    } else {
+      ops.push_back({LITERAL, 0, (uint32_t)literals.size(), (uint32_t)length});
+    }
+    literals.append(text, length);
+  }
+
+  static bool parsePlaceholder(const std::string &placeholder, Op &op,
+                               std::string &error) {
+    std::vector<std::string> parts;
+    boost::split(parts, placeholder, boost::is_any_of("|"));
+    for (auto &part : parts)
+      boost::trim(part);
+
+    static const char *names[] = {"background", "foreground", "selected",
+                                  "active",     "icon",       "error",
+                                  "password",   "border",     "highlight"};
+
+    const std::string &name = parts[0];
+    op.slot = LITERAL;
+    for (int i = 0; i < PALETTE; ++i) {
+      if (name == names[i])
+        op.slot = i;
+    }
+    if (boost::starts_with(name, "palette.")) {
+      char *end = nullptr;
+      long index = strtol(name.c_str() + 8, &end, 10);
+      if (end != name.c_str() + 8 && *end == '\0' && index >= 0 && index < 256)
+        op.slot = PALETTE + index;
+    }
+    if (op.slot == LITERAL) {
+      error = "unknown color '" + name + "'";
+      return false;
+    }
+
+    op.flags = Color::FLAGS::NOFLAGS;
+    op.offset = op.length = 0;
+    for (size_t i = 1; i < parts.size(); ++i) {
+      const std::string &filter = parts[i];
+      if (filter == "hex")
+        continue;
+      else if (filter == "hex_nohash")
+        op.flags |= Color::FLAGS::NHASH;
+      else if (filter == "quoted")
+        op.flags |= Color::FLAGS::WQUOT;
+      else if (filter == "rgb")
+        op.flags |= Color::FLAGS::RGB;
+      else if (filter == "rgb_spaced")
+        op.flags |= Color::FLAGS::RGB | Color::FLAGS::SPCSEP;
+      else if (filter == "spaced")
+        op.flags |= Color::FLAGS::SPCSEP;
+      else if (filter == "ansi256")
+        op.flags |= ANSI256;
+      else {
+        error = "unknown filter '" + filter + "'";
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Compiled templates are cached under $XDG_CACHE_HOME/hoshimi/templates and
+// reused for as long as the template's mtime and size stay the same, so an
+// unchanged template is never re-read or re-parsed.
+class TemplateCache {
+public:
+  static bool load(const fs::path &templatePath, Template &out) {
+    struct stat st;
+    if (stat(templatePath.c_str(), &st) != 0) {
+      char *err = hoshimi_error_strerror(init_err(2, templatePath.c_str()));
+      HERR("Template") << err << std::endl;
+      free(err);
+      return false;
+    }
+
+    const fs::path cachePath = cacheFile(templatePath);
+    const uint64_t mtime =
+        (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    const uint64_t size = st.st_size;
+
+    std::ifstream cached(cachePath, std::ios::binary);
+    if (cached) {
+      std::string data((std::istreambuf_iterator<char>(cached)),
+                       std::istreambuf_iterator<char>());
+      const size_t header = sizeof(MAGIC) + 2 * sizeof(uint64_t);
+      if (data.size() >= header &&
+          memcmp(data.data(), MAGIC, sizeof(MAGIC)) == 0 &&
+          memcmp(data.data() + sizeof(MAGIC), &mtime, sizeof(mtime)) == 0 &&
+          memcmp(data.data() + sizeof(MAGIC) + sizeof(mtime), &size,
+                 sizeof(size)) == 0 &&
+          out.deserialize(data.data() + header, data.size() - header)) {
+        HDBG("Template") << "Cache hit for " << templatePath << std::endl;
+        return true;
+      }
+    }
+
+    std::ifstream input(templatePath, std::ios::binary);
+    std::string source((std::istreambuf_iterator<char>(input)),
+                       std::istreambuf_iterator<char>());
+
+    std::string error;
+    if (!Template::compile(source, out, error)) {
+      HERR("Template " + templatePath.string()) << error << std::endl;
+      return false;
+    }
+
+    std::string data(MAGIC, sizeof(MAGIC));
+    data.append((const char *)&mtime, sizeof(mtime));
+    data.append((const char *)&size, sizeof(size));
+    out.serialize(data);
+
+    // Write through a temporary file so a concurrent reader never sees a
+    // partially written cache entry
+    std::error_code ec;
+    fs::create_directories(cachePath.parent_path(), ec);
+    fs::path tmp = cachePath.string() + ".tmp";
+    std::ofstream o(tmp, std::ios::binary);
+    if (o && o.write(data.data(), data.size())) {
+      o.close();
+      fs::rename(tmp, cachePath, ec);
+    }
+
+    return true;
+  }
+
+private:
+  static constexpr char MAGIC[8] = {'H', 'S', 'T', 'P', 'L', '0', '0', '1'};
+
+  static fs::path cacheFile(const fs::path &templatePath) {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    fs::path dir = xdg_cache_home ? fs::path(xdg_cache_home)
+                                  : fs::path(home ? home : "") / ".cache";
+
+    // FNV-1a of the absolute path names the cache entry
+    std::error_code ec;
+    std::string key = fs::absolute(templatePath, ec).string();
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : key)
+      hash = (hash ^ c) * 1099511628211ull;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 ".bin", hash);
+    return dir / "hoshimi/templates" / name;
+  }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "colorscheme.hpp"
+#include "utils/scheduler.hpp"
+#include "utils/utils.hpp"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Recolors running terminals by writing OSC color sequences to the user's
+// pseudo terminals: 4 for the palette, 10 and 11 for the foreground and
+// background, 12 for the cursor. Every emulator that implements xterm's color
+// control applies them right away, no config reload involved.
+class LiveTerminals {
+public:
+  static std::string sequence(const Colorscheme &colors) {
+    std::string out;
+    out.reserve(64 * 20);
+    for (size_t i = 0; i < colors.palette.size() && i < 16; ++i)
+      out += osc("4;" + std::to_string(i) + ";", colors.palette[i]);
+    out += osc("10;", colors.foregroundColor);
+    out += osc("11;", colors.backgroundColor);
+    out += osc("12;", colors.selectedColor);
+    return out;
+  }
+
+  // The pseudo terminals in /dev/pts that belong to the current user
+  static std::vector<fs::path> userPtys(const fs::path &dir = "/dev/pts") {
+    std::vector<fs::path> ptys;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      const std::string name = entry.path().filename().string();
+      if (name.empty() ||
+          name.find_first_not_of("0123456789") != std::string::npos)
+        continue;
+
+      struct stat st;
+      if (stat(entry.path().c_str(), &st) == 0 && S_ISCHR(st.st_mode) &&
+          st.st_uid == getuid())
+        ptys.push_back(entry.path());
+    }
+    return ptys;
+  }
+
+  // Where the colors are in a sequence, in the order they are set: the
+  // palette, then the foreground, the background and the cursor. Each is the
+  // eight characters of "rr/gg/bb", so a sequence can be recolored in place.
+  static std::vector<size_t> colorOffsets(const std::string &sequence) {
+    std::vector<size_t> offsets;
+    for (size_t pos = sequence.find("rgb:"); pos != std::string::npos;
+         pos = sequence.find("rgb:", pos + 4))
+      offsets.push_back(pos + 4);
+    return offsets;
+  }
+
+  // Terminals are opened non-blocking so one that is not reading its input
+  // cannot stall the others
+  static int open(const fs::path &pty) {
+    return ::open(pty.c_str(), O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  }
+
+  static bool write(int fd, const char *data, size_t size) {
+    while (size > 0) {
+      ssize_t n = ::write(fd, data, size);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      data += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Write the sequence to one terminal
+  static bool send(const fs::path &pty, const std::string &sequence) {
+    int fd = open(pty);
+    if (fd < 0)
+      return false;
+
+    bool sent = write(fd, sequence.data(), sequence.size());
+    close(fd);
+    return sent;
+  }
+
+  // Recolor every terminal in ptys in parallel, returns how many took it
+  static size_t sendAll(const std::vector<fs::path> &ptys,
+                        const std::string &sequence) {
+    std::atomic<size_t> sent{0};
+    Scheduler scheduler;
+    for (const auto &pty : ptys) {
+      scheduler.add(pty.string(), [&sent, &pty, &sequence]() {
+        if (send(pty, sequence))
+          sent++;
+        return true;
+      });
+    }
+    scheduler.run();
+    return sent;
+  }
+
+private:
+  static std::string osc(const std::string &code, const Color &color) {
+    char rgb[16];
+    snprintf(rgb, sizeof(rgb), "rgb:%02x/%02x/%02x", color.r & 0xff,
+             color.g & 0xff, color.b & 0xff);
+    return "\033]" + code + rgb + "\033\\";
+  }
+};
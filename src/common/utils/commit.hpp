@@ -0,0 +1,490 @@
+#pragma once
+
+#include "store.hpp"
+#include "utils.h"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Two-phase commit of rendered files. Writers stage their output in memory
+// while a batch is active; commit() then writes every file to a temporary
+// next to its target and, only if all of them were written, renames them over
+// the targets one after another. A failure in the first phase leaves every
+// target untouched. The renames exchange the target with its temporary, so
+// the old file is still there when a later rename fails and is put back, and
+// apps see either the old theme or the new one.
+//
+// Files where only a small tail changes can instead be staged as a splice:
+// the tail from an offset on is rewritten in place, which avoids copying a
+// large file whose head hoshimi does not own. The old tail is read first, to
+// be written back if the commit fails.
+//
+// A target can also be staged as a link into the ContentStore, which is how
+// a prerendered theme is switched to: the link is made next to the target and
+// renamed over it like any other temporary.
+class CommitBatch {
+public:
+  // The batch writers stage into, if any. Without one WriterBase writes each
+  // file on its own (still through a temporary and a rename).
+  static CommitBatch *&active() {
+    static CommitBatch *batch = nullptr;
+    return batch;
+  }
+
+  void stage(const fs::path &target, std::string contents) {
+    std::lock_guard<std::mutex> lock(mutex);
+    files[resolve(target)] = std::move(contents);
+  }
+
+  // Replace target by a link to the store's object
+  void stageLink(const fs::path &target, const std::string &object) {
+    std::lock_guard<std::mutex> lock(mutex);
+    links[resolve(target)] = ContentStore::objects() / object;
+  }
+
+  // Replace everything from offset on with tail. seen is the stat of the file
+  // the offset was found in; if the file changed since, the commit fails
+  // rather than splicing into different contents.
+  void stageTail(const fs::path &target, off_t offset, std::string tail,
+                 const struct stat &seen) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Objects in the store are never written to, a link to one becomes a
+    // file of its own
+    if (ContentStore::owns(target)) {
+      std::string contents;
+      if (readFile(target, contents) && (size_t)offset <= contents.size()) {
+        contents.resize(offset);
+        files[resolve(target)] = contents + tail;
+        return;
+      }
+    }
+    tails[resolve(target)] = {offset, std::move(tail), seen, -1, {}};
+  }
+
+  void discard(const fs::path &target) {
+    std::lock_guard<std::mutex> lock(mutex);
+    files.erase(resolve(target));
+    tails.erase(resolve(target));
+    links.erase(resolve(target));
+  }
+
+  // Run after the files are in place, e.g. to make an app reload them. With a
+  // target the action only runs if that file was actually replaced.
+  void afterCommit(std::function<void()> action) {
+    afterCommit(fs::path(), std::move(action));
+  }
+  void afterCommit(const fs::path &target, std::function<void()> action) {
+    std::lock_guard<std::mutex> lock(mutex);
+    actions.emplace_back(target.empty() ? target : resolve(target),
+                         std::move(action));
+  }
+
+  // Queue the action on the active batch, or run it right away without one
+  static void whenCommitted(std::function<void()> action) {
+    whenCommitted(fs::path(), std::move(action));
+  }
+  static void whenCommitted(const fs::path &target,
+                            std::function<void()> action) {
+    if (CommitBatch *batch = active())
+      batch->afterCommit(target, std::move(action));
+    else
+      action();
+  }
+
+  size_t size() const { return files.size() + tails.size() + links.size(); }
+
+  // Set on a batch that is only read with take(): writers stage their output
+  // even when it is what the file already holds
+  bool capture = false;
+
+  static bool capturing() { return active() && active()->capture; }
+
+  // Everything staged, with the tails applied to the files as they are now,
+  // instead of committing it. The queued actions are dropped.
+  std::map<fs::path, std::string> take() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<fs::path, std::string> out = std::move(files);
+    for (auto &[target, tail] : tails) {
+      std::string contents;
+      if (out.count(target) || !readFile(target, contents) ||
+          (size_t)tail.offset > contents.size())
+        continue;
+      contents.resize(tail.offset);
+      out[target] = contents + tail.contents;
+    }
+
+    files.clear();
+    tails.clear();
+    links.clear();
+    actions.clear();
+    return out;
+  }
+
+  bool commit(bool sync = false) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    using Written = std::vector<std::pair<fs::path, fs::path>>;
+    auto rollback = [this](const Written &tmps) {
+      for (const auto &[tmpFile, _] : tmps)
+        unlink(tmpFile.c_str());
+      for (auto &[_, tail] : tails) {
+        if (tail.fd >= 0)
+          close(tail.fd);
+      }
+      files.clear();
+      tails.clear();
+      links.clear();
+      actions.clear();
+      changed.clear();
+      return false;
+    };
+
+    // Phase 1: every file goes to a temporary in its target's directory, and
+    // every splice target is opened and checked to be the file it was read as
+    Written written;
+    for (const auto &[target, contents] : files) {
+      tails.erase(target);
+      links.erase(target);
+      fs::path tmp = temporary(target);
+      if (!writeTemporary(target, tmp, contents))
+        return rollback(written);
+      written.emplace_back(tmp, target);
+    }
+    for (const auto &[target, object] : links) {
+      tails.erase(target);
+      fs::path tmp = temporary(target);
+      unlink(tmp.c_str());
+      if (symlink(object.c_str(), tmp.c_str()) != 0) {
+        HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+        return rollback(written);
+      }
+      written.emplace_back(tmp, target);
+    }
+    for (auto &[target, tail] : tails) {
+      if (!openTail(target, tail))
+        return rollback(written);
+    }
+
+    // Phase 2: move them all over their targets. The old files stay behind
+    // at the temporaries and the old tails are kept, so a failure halfway
+    // puts every target back as it was.
+    bool ok = true;
+    std::vector<Previous> previous(written.size(), Previous::NONE);
+    size_t renamed = 0;
+    for (; renamed < written.size(); ++renamed) {
+      const auto &[tmp, target] = written[renamed];
+      if (!replace(tmp, target, previous[renamed])) {
+        HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+        ok = false;
+        break;
+      }
+    }
+    std::vector<std::pair<const fs::path *, Tail *>> spliced;
+    for (auto &[target, tail] : tails) {
+      if (!ok)
+        break;
+      spliced.emplace_back(&target, &tail);
+      ok = spliceTail(target, tail);
+    }
+
+    changed.clear();
+    std::set<fs::path> kept;
+    if (ok) {
+      for (const auto &[_, target] : written)
+        changed.insert(target);
+      for (const auto &[target, _] : tails)
+        changed.insert(target);
+    } else {
+      // Whatever cannot be put back is reported and stays changed
+      for (auto &[target, tail] : spliced) {
+        if (!restoreTail(*target, *tail))
+          changed.insert(*target);
+      }
+      for (size_t i = 0; i < renamed; ++i) {
+        const auto &[tmp, target] = written[i];
+        if (restore(tmp, target, previous[i]))
+          continue;
+        changed.insert(target);
+        if (previous[i] == Previous::SWAPPED ||
+            previous[i] == Previous::MOVED) {
+          HERR("Commit " + target.string())
+              << "The previous file is kept at " << tmp << std::endl;
+          kept.insert(tmp);
+        }
+      }
+    }
+
+    // The temporaries now hold the old files, or the new ones after a
+    // failure
+    for (const auto &[tmp, _] : written) {
+      if (!kept.count(tmp))
+        unlink(tmp.c_str());
+    }
+    for (auto &[_, tail] : tails)
+      close(tail.fd);
+
+    // One syncfs per filesystem instead of an fsync per file, once
+    // everything is in place
+    std::map<dev_t, fs::path> devices;
+    for (const auto &target : sync ? changed : std::set<fs::path>()) {
+      struct stat st;
+      if (stat(target.c_str(), &st) == 0)
+        devices.emplace(st.st_dev, target);
+    }
+    for (const auto &[_, file] : devices) {
+      int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        syncfs(fd);
+        close(fd);
+      }
+    }
+
+    files.clear();
+    tails.clear();
+    links.clear();
+    // Nothing to reload or follow up on when the old theme is back
+    for (auto &[target, action] : actions) {
+      if (ok && (target.empty() || changed.count(target)))
+        action();
+    }
+    actions.clear();
+
+    return ok;
+  }
+
+  // The targets the last commit() changed: all of them after a success, and
+  // after a failure the ones that could not be put back, normally none
+  const std::set<fs::path> &changedFiles() const { return changed; }
+
+  // The file a target is committed to. The rename has to replace the file a
+  // symlink points to, not the symlink, unless the symlink leads into the
+  // store: then it is the symlink that is replaced.
+  static fs::path resolve(const fs::path &target) {
+    std::error_code ec;
+    if (ContentStore::owns(target)) {
+      fs::path dir = fs::weakly_canonical(fs::absolute(target).parent_path(),
+                                          ec);
+      return ec ? target : dir / target.filename();
+    }
+    fs::path resolved = fs::weakly_canonical(target, ec);
+    return ec ? target : resolved;
+  }
+
+  // Write a single file through a temporary and a rename
+  static bool writeFile(const fs::path &target, const std::string &contents) {
+    CommitBatch batch;
+    batch.stage(target, contents);
+    return batch.commit();
+  }
+
+  // Splice a single file's tail in place
+  static bool writeTail(const fs::path &target, off_t offset,
+                        const std::string &tail, const struct stat &seen) {
+    CommitBatch batch;
+    batch.stageTail(target, offset, tail, seen);
+    return batch.commit();
+  }
+
+private:
+  struct Tail {
+    off_t offset;
+    std::string contents;
+    struct stat seen;
+    int fd;
+    // What was there from offset on, read when the file is opened
+    std::string previous;
+  };
+
+  // What a rename in phase 2 did with the file it replaced: SWAPPED and
+  // MOVED leave it at the temporary, NONE means there was none, and LOST
+  // that it could not be kept
+  enum class Previous { SWAPPED, MOVED, NONE, LOST };
+
+  std::mutex mutex;
+  std::map<fs::path, std::string> files;
+  std::map<fs::path, Tail> tails;
+  std::map<fs::path, fs::path> links;
+  std::vector<std::pair<fs::path, std::function<void()>>> actions;
+  std::set<fs::path> changed;
+
+  static fs::path temporary(const fs::path &target) {
+    return target.parent_path() / ("." + target.filename().string() +
+                                   ".hoshimi-" + std::to_string(getpid()));
+  }
+
+  static bool readFile(const fs::path &path, std::string &contents) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+      return false;
+    contents.assign(std::istreambuf_iterator<char>(f),
+                    std::istreambuf_iterator<char>());
+    return true;
+  }
+
+  // Move tmp over target and leave what target was at tmp: previous says
+  // what became of it, for restore()
+  static bool replace(const fs::path &tmp, const fs::path &target,
+                      Previous &previous) {
+    previous = Previous::SWAPPED;
+    if (renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, target.c_str(),
+                  RENAME_EXCHANGE) == 0)
+      return true;
+    if (errno == ENOENT) {
+      previous = Previous::NONE;
+      return rename(tmp.c_str(), target.c_str()) == 0;
+    }
+    if (errno != ENOSYS && errno != EINVAL)
+      return false;
+
+    // Kernels or filesystems without RENAME_EXCHANGE: a second link keeps
+    // the old file while the new one is renamed over it
+    const fs::path old = tmp.string() + ".old";
+    unlink(old.c_str());
+    previous = link(target.c_str(), old.c_str()) == 0 ? Previous::MOVED
+               : errno == ENOENT                       ? Previous::NONE
+                                                       : Previous::LOST;
+    if (rename(tmp.c_str(), target.c_str()) != 0) {
+      int error = errno;
+      unlink(old.c_str());
+      errno = error;
+      return false;
+    }
+    if (previous == Previous::MOVED && rename(old.c_str(), tmp.c_str()) != 0) {
+      unlink(old.c_str());
+      previous = Previous::LOST;
+    }
+    return true;
+  }
+
+  // Put back what replace() moved away
+  static bool restore(const fs::path &tmp, const fs::path &target,
+                      Previous previous) {
+    bool restored = false;
+    switch (previous) {
+    case Previous::SWAPPED:
+      restored = renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, target.c_str(),
+                           RENAME_EXCHANGE) == 0;
+      break;
+    case Previous::MOVED:
+      restored = rename(tmp.c_str(), target.c_str()) == 0;
+      break;
+    case Previous::NONE:
+      restored = unlink(target.c_str()) == 0;
+      break;
+    case Previous::LOST:
+      errno = ENOENT;
+      break;
+    }
+    if (!restored)
+      HERR("Commit " + target.string())
+          << "Could not put the previous file back: " << strerror(errno)
+          << std::endl;
+    return restored;
+  }
+
+  // Open a splice target, check it is the file the offset was found in and
+  // keep its current tail for restoreTail()
+  static bool openTail(const fs::path &target, Tail &tail) {
+    tail.fd = open(target.c_str(), O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (tail.fd < 0 || fstat(tail.fd, &st) != 0) {
+      HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+      return false;
+    }
+
+    if (st.st_ino != tail.seen.st_ino || st.st_size != tail.seen.st_size ||
+        st.st_mtim.tv_sec != tail.seen.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != tail.seen.st_mtim.tv_nsec ||
+        tail.offset > st.st_size) {
+      HERR("Commit " + target.string())
+          << "File changed while it was being written" << std::endl;
+      return false;
+    }
+
+    tail.previous.resize(st.st_size - tail.offset);
+    size_t read = 0;
+    while (read < tail.previous.size()) {
+      ssize_t n = pread(tail.fd, &tail.previous[read],
+                        tail.previous.size() - read, tail.offset + read);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        HERR("Commit " + target.string())
+            << (n < 0 ? strerror(errno) : "File shrank while it was read")
+            << std::endl;
+        return false;
+      }
+      read += n;
+    }
+    return true;
+  }
+
+  static bool spliceTail(const fs::path &target, const Tail &tail) {
+    if (!Utils::writeAll(tail.fd, tail.contents.data(), tail.contents.size(),
+                         tail.offset) ||
+        ftruncate(tail.fd, tail.offset + tail.contents.size()) != 0) {
+      HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  static bool restoreTail(const fs::path &target, const Tail &tail) {
+    if (!Utils::writeAll(tail.fd, tail.previous.data(), tail.previous.size(),
+                         tail.offset) ||
+        ftruncate(tail.fd, tail.seen.st_size) != 0) {
+      HERR("Commit " + target.string())
+          << "Could not put the previous contents back: " << strerror(errno)
+          << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  static bool writeTemporary(const fs::path &target, const fs::path &tmp,
+                             const std::string &contents) {
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+      return false;
+    }
+
+    // Keep the mode of the file being replaced. Objects in the store are
+    // read-only, the file that replaces a link to one is the user's again.
+    struct stat st;
+    if (stat(target.c_str(), &st) == 0)
+      fchmod(fd, (st.st_mode & 07777) |
+                     (ContentStore::owns(target) ? S_IWUSR : 0));
+
+    if (!Utils::writeAll(fd, contents.data(), contents.size())) {
+      HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+      close(fd);
+      unlink(tmp.c_str());
+      return false;
+    }
+
+    if (close(fd) != 0) {
+      HERR("Commit " + target.string()) << strerror(errno) << std::endl;
+      unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+};
@@ -0,0 +1,375 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <spawn.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+// Runs children from argv arrays with posix_spawn, without a shell in
+// between. Any number of them can run at once: start() spawns, wait() runs an
+// epoll loop over their pidfds and output pipes until all of them exited,
+// streaming what they print as it arrives.
+class Process {
+public:
+  enum Output {
+    CAPTURE, // stdin from /dev/null, stdout and stderr into the Result
+    INHERIT, // the child shares hoshimi's terminal, e.g. for paru prompts
+    DISCARD, // everything to /dev/null
+  };
+
+  struct Options {
+    Output output = CAPTURE;
+    // Start the child in its own session and do not wait for it
+    bool detach = false;
+    // 0 waits for as long as the child runs
+    int timeoutMs = 0;
+    // Called with every chunk read, error is set for stderr
+    std::function<void(const char *, size_t, bool error)> onOutput;
+  };
+
+  struct Result {
+    int exitCode = -1;
+    bool timedOut = false;
+    std::string output;
+    std::string errors;
+    double wallMs = 0;
+    double cpuMs = 0;
+  };
+
+  struct Child {
+    std::string name;
+    pid_t pid = -1;
+    Options options;
+    Result result;
+
+    Child() = default;
+    Child(const Child &) = delete;
+    Child &operator=(const Child &) = delete;
+    ~Child() { closeFds(); }
+
+  private:
+    friend class Process;
+    int pidfd = -1;
+    int out = -1;
+    int err = -1;
+    bool exited = false;
+    std::chrono::steady_clock::time_point started;
+
+    void closeFds() {
+      for (int *fd : {&pidfd, &out, &err}) {
+        if (*fd >= 0)
+          close(*fd);
+        *fd = -1;
+      }
+    }
+  };
+
+  // Timings of every waited child are logged when set, main sets it from -v
+  inline static bool verbose = false;
+
+  static bool start(const std::vector<std::string> &argv, Child &child) {
+    return start(argv, child, Options());
+  }
+
+  static bool start(const std::vector<std::string> &argv, Child &child,
+                    const Options &options) {
+    child.options = options;
+    child.result = Result();
+    child.exited = false;
+    if (child.name.empty() && !argv.empty())
+      child.name = argv[0];
+    if (argv.empty())
+      return false;
+
+    ignoreSigpipe();
+
+    int outPipe[2] = {-1, -1};
+    int errPipe[2] = {-1, -1};
+    if (options.output == CAPTURE && !options.detach &&
+        (pipe2(outPipe, O_CLOEXEC | O_NONBLOCK) != 0 ||
+         pipe2(errPipe, O_CLOEXEC | O_NONBLOCK) != 0)) {
+      for (int fd : {outPipe[0], outPipe[1], errPipe[0], errPipe[1]})
+        if (fd >= 0)
+          close(fd);
+      return false;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (options.output != INHERIT || options.detach) {
+      posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                       O_RDONLY, 0);
+    }
+    if (outPipe[1] >= 0) {
+      posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+      posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+    } else if (options.output == DISCARD || options.detach) {
+      posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                       O_WRONLY, 0);
+      posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t unblocked;
+    sigemptyset(&unblocked);
+    posix_spawnattr_setsigmask(&attr, &unblocked);
+    // Children get the default SIGPIPE back, see ignoreSigpipe()
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (options.detach)
+      flags |= POSIX_SPAWN_SETSID;
+    posix_spawnattr_setflags(&attr, flags);
+
+    std::vector<char *> args;
+    for (const auto &arg : argv)
+      args.push_back(const_cast<char *>(arg.c_str()));
+    args.push_back(nullptr);
+
+    child.started = std::chrono::steady_clock::now();
+    int spawned = posix_spawnp(&child.pid, args[0], &actions, &attr,
+                               args.data(), environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (int fd : {outPipe[1], errPipe[1]})
+      if (fd >= 0)
+        close(fd);
+
+    if (spawned != 0) {
+      for (int fd : {outPipe[0], errPipe[0]})
+        if (fd >= 0)
+          close(fd);
+      child.pid = -1;
+      child.result.errors = argv[0] + ": " + strerror(spawned) + "\n";
+      return false;
+    }
+
+    child.out = outPipe[0];
+    child.err = errPipe[0];
+#ifdef SYS_pidfd_open
+    child.pidfd = syscall(SYS_pidfd_open, child.pid, 0);
+    if (child.pidfd >= 0)
+      fcntl(child.pidfd, F_SETFD, FD_CLOEXEC);
+#endif
+    return true;
+  }
+
+  // Wait for every started child to exit, reading their output meanwhile.
+  // Detached children are skipped. Returns whether all of them exited with
+  // status 0.
+  static bool wait(const std::vector<Child *> &children) {
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0)
+      return false;
+
+    size_t running = 0;
+    for (Child *child : children) {
+      if (child->pid < 0 || child->exited || child->options.detach)
+        continue;
+      running++;
+      for (int fd : {child->pidfd, child->out, child->err}) {
+        if (fd < 0)
+          continue;
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = child;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event);
+      }
+    }
+
+    while (running > 0) {
+      // Wake up for the nearest deadline, and every 50 ms if some child has
+      // no pidfd (kernels before 5.3) and has to be polled with waitpid
+      int timeout = -1;
+      auto now = std::chrono::steady_clock::now();
+      for (Child *child : children) {
+        if (child->pid < 0 || child->exited || child->options.detach)
+          continue;
+        if (child->pidfd < 0)
+          timeout = timeout < 0 ? 50 : std::min(timeout, 50);
+        if (child->options.timeoutMs > 0 && !child->result.timedOut) {
+          auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          child->started +
+                          std::chrono::milliseconds(child->options.timeoutMs) -
+                          now)
+                          .count();
+          int ms = (int)std::max<long>(0, left);
+          timeout = timeout < 0 ? ms : std::min(timeout, ms);
+        }
+      }
+
+      epoll_event events[16];
+      int n = epoll_wait(epoll, events, 16, timeout);
+      if (n < 0 && errno != EINTR)
+        break;
+
+      for (int i = 0; i < n; ++i) {
+        Child *child = static_cast<Child *>(events[i].data.ptr);
+        drain(*child);
+      }
+
+      now = std::chrono::steady_clock::now();
+      for (Child *child : children) {
+        if (child->pid < 0 || child->exited || child->options.detach)
+          continue;
+        if (child->options.timeoutMs > 0 && !child->result.timedOut &&
+            now - child->started >=
+                std::chrono::milliseconds(child->options.timeoutMs)) {
+          kill(child->pid, SIGKILL);
+          child->result.timedOut = true;
+        }
+        if (reap(*child, child->result.timedOut))
+          running--;
+      }
+    }
+
+    close(epoll);
+
+    bool ok = true;
+    for (Child *child : children) {
+      if (child->options.detach)
+        continue;
+      if (verbose && child->pid >= 0)
+        HLOG("Process") << child->name << " took "
+                        << (long)child->result.wallMs << " ms, "
+                        << (long)child->result.cpuMs << " ms of CPU."
+                        << std::endl;
+      ok = ok && child->exited && !child->result.timedOut &&
+           child->result.exitCode == 0;
+    }
+    return ok;
+  }
+
+  // Whether a started child has exited, reaping it if it has. For children
+  // that are not waited for, like detached ones.
+  static bool exited(Child &child) {
+    return child.pid < 0 || child.exited || reap(child, false);
+  }
+
+  // Run one child to completion. Returns whether it ran and exited with
+  // status 0.
+  static bool run(const std::vector<std::string> &argv, Result &result,
+                  const Options &options) {
+    Child child;
+    bool ok = start(argv, child, options) && wait({&child});
+    result = child.result;
+    return ok;
+  }
+
+  static bool run(const std::vector<std::string> &argv, Result &result,
+                  int timeoutMs = 0) {
+    Options options;
+    options.timeoutMs = timeoutMs;
+    return run(argv, result, options);
+  }
+
+  // Start a child in a session of its own that outlives hoshimi
+  static bool detach(const std::vector<std::string> &argv) {
+    Child child;
+    Options options;
+    options.detach = true;
+    return start(argv, child, options);
+  }
+
+  // Split a command line on whitespace when it needs nothing from a shell.
+  // Returns false if it does (quotes, expansions, redirections, ...), then it
+  // has to go through sh -c.
+  static bool words(const std::string &command,
+                    std::vector<std::string> &argv) {
+    argv.clear();
+    if (command.find_first_of("|&;<>()$`\\\"'*?[]#~={}\n") !=
+        std::string::npos)
+      return false;
+
+    size_t pos = 0;
+    while ((pos = command.find_first_not_of(" \t", pos)) != std::string::npos) {
+      size_t end = command.find_first_of(" \t", pos);
+      if (end == std::string::npos)
+        end = command.size();
+      argv.push_back(command.substr(pos, end - pos));
+      pos = end;
+    }
+    return !argv.empty();
+  }
+
+private:
+  // A child that closes its end of a pipe or socket early must not kill
+  // hoshimi, the write fails instead. An ignored SIGPIPE would be inherited
+  // through exec, so start() sets it back to the default in every child:
+  // `yes | head -1` has to end the way it does in a shell.
+  static void ignoreSigpipe() {
+    static const bool ignored = signal(SIGPIPE, SIG_IGN) != SIG_ERR;
+    (void)ignored;
+  }
+
+  static void drain(Child &child) {
+    char buffer[4096];
+    for (int *fd : {&child.out, &child.err}) {
+      if (*fd < 0)
+        continue;
+      bool error = fd == &child.err;
+      std::string &into = error ? child.result.errors : child.result.output;
+
+      ssize_t n;
+      while ((n = read(*fd, buffer, sizeof(buffer))) > 0 ||
+             (n < 0 && errno == EINTR)) {
+        if (n <= 0)
+          continue;
+        into.append(buffer, n);
+        if (child.options.onOutput)
+          child.options.onOutput(buffer, n, error);
+      }
+      // End of file, nothing will come through this pipe anymore
+      if (n == 0) {
+        close(*fd);
+        *fd = -1;
+      }
+    }
+  }
+
+  // Reap the child if it exited, or wait for it if block is set (it was just
+  // killed). Output is read until the child exits, not until its pipes
+  // close, which may be never if it left something running in the
+  // background.
+  static bool reap(Child &child, bool block) {
+    int status = 0;
+    rusage usage{};
+    pid_t waited = wait4(child.pid, &status, block ? 0 : WNOHANG, &usage);
+    if (waited != child.pid)
+      return false;
+
+    drain(child);
+    child.exited = true;
+    child.result.wallMs =
+        std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - child.started)
+            .count();
+    child.result.cpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+                             1000.0 +
+                         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) /
+                             1000.0;
+    if (WIFEXITED(status))
+      child.result.exitCode = WEXITSTATUS(status);
+    child.closeFds();
+    return true;
+  }
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <poll.h>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// The process table, read from /proc once and then reused for the rest of the
+// run instead of forking pgrep or killall for every lookup. Processes are
+// signalled through pidfds, which keep referring to the process they were
+// opened for even if its pid is reused in the meantime.
+class ProcessTable {
+public:
+  struct Process {
+    pid_t pid;
+    std::string comm;
+    std::string cmdline;
+    int pidfd = -1;
+  };
+
+  static ProcessTable &get() {
+    static ProcessTable table;
+    return table;
+  }
+
+  ProcessTable(const ProcessTable &) = delete;
+  ProcessTable &operator=(const ProcessTable &) = delete;
+
+  ~ProcessTable() { clear(); }
+
+  // Read /proc again, e.g. after processes were started or stopped
+  void refresh() {
+    std::lock_guard<std::mutex> lock(mutex);
+    clear();
+    scan();
+  }
+
+  // Processes whose name (comm, as matched by pgrep -x) is name. Each one
+  // returned holds a pidfd.
+  std::vector<Process> find(const std::string &name) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!scanned)
+      scan();
+
+    std::vector<Process> found;
+    auto range = byComm.equal_range(name);
+    for (auto it = range.first; it != range.second; ++it) {
+      Process &process = processes[it->second];
+      if (process.pidfd < 0 && !open(process))
+        continue;
+      found.push_back(process);
+    }
+    return found;
+  }
+
+  // Send sig to every process called name, returns how many got it
+  size_t signal(const std::string &name, int sig) {
+    size_t sent = 0;
+    for (const Process &process : find(name)) {
+      if (sendSignal(process, sig))
+        sent++;
+    }
+    return sent;
+  }
+
+  // SIGTERM every process called name and wait up to timeoutMs for them to
+  // exit. Returns false if any is still running.
+  bool terminate(const std::string &name, int timeoutMs = 1000) {
+    return terminate(find(name), timeoutMs);
+  }
+
+  // The same for processes already found, e.g. to stop an old instance of a
+  // program while leaving the one just started alone
+  bool terminate(const std::vector<Process> &targets, int timeoutMs = 1000) {
+    std::vector<pollfd> fds;
+    for (const Process &process : targets) {
+      if (sendSignal(process, SIGTERM) && process.pidfd >= 0)
+        fds.push_back({process.pidfd, POLLIN, 0});
+    }
+
+    // A pidfd becomes readable when its process exits
+    bool exited = true;
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (pollfd &fd : fds) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      deadline - std::chrono::steady_clock::now())
+                      .count();
+      if (poll(&fd, 1, std::max<long>(0, left)) <= 0)
+        exited = false;
+    }
+
+    refresh();
+    return exited;
+  }
+
+private:
+  std::mutex mutex;
+  bool scanned = false;
+  std::vector<Process> processes;
+  std::multimap<std::string, size_t> byComm;
+
+  ProcessTable() = default;
+
+  static std::string readFile(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(f)),
+                       std::istreambuf_iterator<char>());
+  }
+
+  void scan() {
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator("/proc", ec)) {
+      const std::string name = entry.path().filename().string();
+      if (name.find_first_not_of("0123456789") != std::string::npos)
+        continue;
+
+      Process process;
+      process.pid = atoi(name.c_str());
+      process.comm = readFile(entry.path() / "comm");
+      if (process.comm.empty())
+        continue; // Exited while scanning
+      if (process.comm.back() == '\n')
+        process.comm.pop_back();
+
+      // Zombies have exited already, only their parent has not reaped them
+      std::string stat = readFile(entry.path() / "stat");
+      size_t state = stat.rfind(") ");
+      if (state != std::string::npos && state + 2 < stat.size() &&
+          stat[state + 2] == 'Z')
+        continue;
+
+      // Arguments are separated by NULs
+      process.cmdline = readFile(entry.path() / "cmdline");
+      for (char &c : process.cmdline) {
+        if (c == '\0')
+          c = ' ';
+      }
+      while (!process.cmdline.empty() && process.cmdline.back() == ' ')
+        process.cmdline.pop_back();
+
+      byComm.emplace(process.comm, processes.size());
+      processes.push_back(std::move(process));
+    }
+    scanned = true;
+  }
+
+  void clear() {
+    for (Process &process : processes) {
+      if (process.pidfd >= 0)
+        close(process.pidfd);
+    }
+    processes.clear();
+    byComm.clear();
+    scanned = false;
+  }
+
+  // Open a pidfd and check it still refers to the process that was scanned:
+  // the pid could have been reused between the scan and the open
+  static bool open(Process &process) {
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, process.pid, 0);
+    if (fd < 0)
+      return errno == ENOSYS; // Old kernel, fall back to plain pids
+
+    std::string comm =
+        readFile("/proc/" + std::to_string(process.pid) + "/comm");
+    if (!comm.empty() && comm.back() == '\n')
+      comm.pop_back();
+    if (comm != process.comm) {
+      close(fd);
+      return false;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    process.pidfd = fd;
+#endif
+    return true;
+  }
+
+  static bool sendSignal(const Process &process, int sig) {
+#ifdef SYS_pidfd_send_signal
+    if (process.pidfd >= 0)
+      return syscall(SYS_pidfd_send_signal, process.pidfd, sig, NULL, 0) == 0;
+#endif
+    return kill(process.pid, sig) == 0;
+  }
+};
@@ -0,0 +1,201 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs jobs (writers, generators, followup commands) on a bounded set of
+// threads. A job may name jobs it has to run after; everything else runs
+// concurrently. Every job gets its own log buffer, and buffers are flushed in
+// the order the jobs were added, so the output of one job is never interleaved
+// with another's. A scheduler run from inside a job flushes into that job's
+// buffers.
+class Scheduler {
+public:
+  struct Job {
+    std::string name;
+    std::function<bool()> run;
+    std::vector<size_t> after;
+
+    bool ok = false;
+    bool started = false;
+    bool done = false;
+    double milliseconds = 0;
+    std::ostringstream out;
+    std::ostringstream err;
+  };
+
+  explicit Scheduler(size_t maxThreads = std::thread::hardware_concurrency())
+      : maxThreads(std::max<size_t>(1, maxThreads)) {}
+
+  // Returns the job's index, which later jobs can list in after. A job whose
+  // dependency failed is not run and fails too.
+  size_t add(const std::string &name, std::function<bool()> run,
+             std::vector<size_t> after = {}) {
+    jobs.emplace_back(new Job);
+    jobs.back()->name = name;
+    jobs.back()->run = std::move(run);
+    jobs.back()->after = std::move(after);
+    return jobs.size() - 1;
+  }
+
+  size_t size() const { return jobs.size(); }
+
+  // Run every job and wait for all of them. Returns the number of jobs that
+  // reported failure.
+  size_t run(bool verbose = false) {
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t running = 0;
+    size_t nextFlush = 0;
+    std::ostream &out = Utils::logStream();
+    std::ostream &err = Utils::errStream();
+    std::ostream *outerLog = Utils::logSink();
+    std::ostream *outerErr = Utils::errSink();
+
+    auto finish = [&](Job &job) {
+      job.done = true;
+      while (nextFlush < jobs.size() && jobs[nextFlush]->done) {
+        flush(*jobs[nextFlush], out, err, verbose);
+        nextFlush++;
+      }
+      changed.notify_all();
+    };
+
+    // The next job whose dependencies are done, or nullptr if there is none
+    // right now. Jobs behind a failed dependency are failed on the way.
+    auto next = [&]() -> Job * {
+      bool failedAny = true;
+      while (failedAny) {
+        failedAny = false;
+        for (auto &candidate : jobs) {
+          Job &job = *candidate;
+          if (job.started)
+            continue;
+
+          bool ready = true, blocked = false;
+          for (size_t dependency : job.after) {
+            const Job &before = *jobs[dependency];
+            if (!before.done)
+              ready = false;
+            else if (!before.ok)
+              blocked = true;
+          }
+
+          if (blocked) {
+            fail(job, "Not run, a job it runs after failed.");
+            finish(job);
+            failedAny = true;
+          } else if (ready) {
+            job.started = true;
+            return &job;
+          }
+        }
+      }
+      return nullptr;
+    };
+
+    auto worker = [&]() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (true) {
+        Job *found = next();
+        if (!found) {
+          bool pending = std::any_of(
+              jobs.begin(), jobs.end(),
+              [](const std::unique_ptr<Job> &job) { return !job->started; });
+          if (!pending)
+            return;
+          // Waiting jobs with nothing left running are in a cycle
+          if (running == 0) {
+            for (auto &job : jobs) {
+              if (job->started)
+                continue;
+              fail(*job, "Not run, its ordering has a cycle.");
+              finish(*job);
+            }
+            return;
+          }
+          changed.wait(lock);
+          continue;
+        }
+
+        Job &job = *found;
+        running++;
+        lock.unlock();
+
+        Utils::logSink() = &job.out;
+        Utils::errSink() = &job.err;
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+          job.ok = job.run();
+        } catch (const std::exception &e) {
+          HERR(job.name) << e.what() << std::endl;
+          job.ok = false;
+        }
+        job.milliseconds = std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+
+        Utils::logSink() = nullptr;
+        Utils::errSink() = nullptr;
+
+        lock.lock();
+        running--;
+        finish(job);
+      }
+    };
+
+    size_t threadCount = std::min(maxThreads, jobs.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i)
+      threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+      t.join();
+
+    Utils::logSink() = outerLog;
+    Utils::errSink() = outerErr;
+
+    return std::count_if(jobs.begin(), jobs.end(),
+                         [](const std::unique_ptr<Job> &job) {
+                           return !job->ok;
+                         });
+  }
+
+  const std::vector<std::unique_ptr<Job>> &results() const { return jobs; }
+
+private:
+  size_t maxThreads;
+  std::vector<std::unique_ptr<Job>> jobs;
+
+  static void fail(Job &job, const std::string &why) {
+    job.started = true;
+    std::ostream *sink = Utils::errSink();
+    Utils::errSink() = &job.err;
+    HERR(job.name) << why << std::endl;
+    Utils::errSink() = sink;
+  }
+
+  static void flush(Job &job, std::ostream &out, std::ostream &err,
+                    bool verbose) {
+    out << job.out.str();
+    err << job.err.str();
+    if (verbose) {
+      std::ostream *sink = Utils::logSink();
+      Utils::logSink() = &out;
+      HLOG(job.name) << (job.ok ? "Finished" : "Failed") << " in "
+                     << job.milliseconds << " ms." << std::endl;
+      Utils::logSink() = sink;
+    }
+  }
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include "utils.h"
+#include "utils.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Content-addressed files in $XDG_DATA_HOME/hoshimi/store/objects, named by
+// a hash of their contents. `hoshimi prerender` renders every theme into it,
+// and switching to a prerendered theme then replaces each target by a
+// symlink to its object.
+//
+// Objects are never written after they are created and are read-only, so
+// an app or editor that writes through the link fails instead of changing
+// every theme that shares the object. Hoshimi itself never writes through a
+// link into the store (see CommitBatch::resolve): the link is replaced.
+class ContentStore {
+public:
+  static fs::path root() {
+    char *home = getHoshimiHome(NULL);
+    fs::path path = fs::path(home ? home : "") / "store";
+    free(home);
+    return path;
+  }
+
+  static fs::path objects() { return root() / "objects"; }
+
+  // 128 bit FNV-1a of the contents, as hex. Executable files get an "x" on
+  // top: the mode is part of what a link hands out.
+  static std::string name(const char *data, size_t size, bool executable) {
+    // The hash in two 64 bit halves. The prime is 2^88 + 0x13b, so a
+    // multiplication is the low half times 0x13b, carried into the high
+    // half, plus the low half shifted into the high one by 88 - 64 bits.
+    uint64_t high = 0x6c62272e07bb0142ull;
+    uint64_t low = 0x62b821756295c58dull;
+    const uint64_t prime = 0x13b;
+    for (size_t i = 0; i < size; ++i) {
+      low ^= (unsigned char)data[i];
+      uint64_t carry =
+          ((low >> 32) * prime + (((low & 0xffffffffull) * prime) >> 32)) >>
+          32;
+      high = high * prime + carry + (low << 24);
+      low *= prime;
+    }
+
+    char out[34];
+    snprintf(out, sizeof(out), "%016llx%016llx", (unsigned long long)high,
+             (unsigned long long)low);
+    return std::string(out) + (executable ? "x" : "");
+  }
+
+  // Whether path is a symlink to an object
+  static bool owns(const fs::path &path) {
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0 || !S_ISLNK(st.st_mode))
+      return false;
+    std::error_code ec;
+    fs::path target = fs::read_symlink(path, ec);
+    return !ec && target.parent_path() == objects();
+  }
+
+  // What path holds right now, in the form of an object name: the object a
+  // link points to, the name the contents of a file would get, or "-" for
+  // a file that does not exist
+  static std::string identify(const fs::path &path) {
+    if (owns(path)) {
+      std::error_code ec;
+      return fs::read_symlink(path, ec).filename().string();
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      if (fd >= 0)
+        close(fd);
+      return "-";
+    }
+
+    std::string out;
+    if (st.st_size == 0) {
+      out = name("", 0, st.st_mode & 0111);
+    } else {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED) {
+        out = name((const char *)map, st.st_size, st.st_mode & 0111);
+        munmap(map, st.st_size);
+      }
+    }
+    close(fd);
+    return out.empty() ? "-" : out;
+  }
+
+  // Add contents to the store, returns the object's name, or an empty one
+  // if it could not be written. Contents already in the store cost a stat.
+  static std::string put(const std::string &contents, bool executable) {
+    const std::string object =
+        name(contents.data(), contents.size(), executable);
+    const fs::path path = objects() / object;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == contents.size())
+      return object;
+
+    std::error_code ec;
+    fs::create_directories(objects(), ec);
+    const fs::path tmp =
+        path.string() + ".hoshimi-" + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      HERR("Store " + path.string()) << strerror(errno) << std::endl;
+      return std::string();
+    }
+
+    if (!Utils::writeAll(fd, contents.data(), contents.size()) ||
+        fchmod(fd, executable ? 0555 : 0444) != 0) {
+      HERR("Store " + path.string()) << strerror(errno) << std::endl;
+      close(fd);
+      unlink(tmp.c_str());
+      return std::string();
+    }
+
+    if (close(fd) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+      HERR("Store " + path.string()) << strerror(errno) << std::endl;
+      unlink(tmp.c_str());
+      return std::string();
+    }
+    return object;
+  }
+
+  // Whether the object is there and as large as it was when it was added
+  static bool has(const std::string &object, off_t size) {
+    struct stat st;
+    return stat((objects() / object).c_str(), &st) == 0 &&
+           S_ISREG(st.st_mode) && st.st_size == size;
+  }
+
+  // Remove the links into the store from dir, for generators that write
+  // their files in place
+  static void detach(const fs::path &dir) {
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      if (entry.is_symlink(ec) && owns(entry.path()))
+        fs::remove(entry.path(), ec);
+    }
+  }
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "utils.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads that live as long as the process, for work made of
+// many small tasks that spawn more tasks, like walking and installing a tree
+// of files. Unlike Scheduler, which runs a known list of jobs, tasks are added
+// while the pool runs.
+//
+// Every thread has its own queue. A task submitted from a pool thread goes to
+// the back of that thread's queue and is the next one it runs, so a directory
+// is finished while it is still warm; a thread whose queue is empty takes the
+// oldest task from another thread's queue. Tasks submitted from outside the
+// pool are spread over the queues.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  // The pool shared by everything in the process. Started on first use, so a
+  // process that forks before using it (see Fleet) has no threads to lose.
+  static ThreadPool &shared() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  explicit ThreadPool(size_t threads = std::thread::hardware_concurrency()) {
+    threads = std::max<size_t>(1, threads);
+    for (size_t i = 0; i < threads; ++i)
+      queues.emplace_back(new Queue);
+    for (size_t i = 0; i < threads; ++i)
+      workers.emplace_back([this, i]() { work(i); });
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  size_t size() const { return workers.size(); }
+
+  void submit(Task task) {
+    const Current &self = current();
+    size_t index = self.pool == this ? self.index
+                                     : spread.fetch_add(1) % queues.size();
+    {
+      std::lock_guard<std::mutex> lock(queues[index]->mutex);
+      queues[index]->tasks.push_back(std::move(task));
+    }
+    queued.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+    wake.notify_one();
+  }
+
+  // Run one queued task on the calling thread, if there is one. Lets a
+  // thread that waits for tasks help with them instead of blocking.
+  bool runOne() {
+    const Current &self = current();
+    Task task;
+    if (!take(self.pool == this ? self.index : 0, task))
+      return false;
+    run(task);
+    return true;
+  }
+
+  // Tasks that are waited for together. A task may add more tasks to its
+  // group, wait() returns once all of them are done.
+  class Group {
+  public:
+    explicit Group(ThreadPool &pool = shared()) : pool(pool) {}
+    Group(const Group &) = delete;
+    Group &operator=(const Group &) = delete;
+    ~Group() { wait(); }
+
+    void run(Task task) {
+      pending.fetch_add(1);
+      pool.submit([this, task = std::move(task)]() {
+        ThreadPool::run(task);
+        // Under the mutex, wait() takes it before it lets the group go
+        std::lock_guard<std::mutex> lock(mutex);
+        if (pending.fetch_sub(1) == 1)
+          done.notify_all();
+      });
+    }
+
+    // The waiting thread runs queued tasks until the group is done, so
+    // waiting from inside a task does not take a thread from the pool
+    void wait() {
+      while (pending.load() > 0) {
+        if (pool.runOne())
+          continue;
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait_for(lock, std::chrono::milliseconds(1),
+                      [this]() { return pending.load() == 0; });
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+    }
+
+  private:
+    ThreadPool &pool;
+    std::atomic<size_t> pending{0};
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  // The pool and queue of the calling thread, if it is a pool thread
+  struct Current {
+    ThreadPool *pool = nullptr;
+    size_t index = 0;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> spread{0};
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  static Current &current() {
+    thread_local Current self;
+    return self;
+  }
+
+  // The newest task of queue index, or else the oldest one of another queue
+  bool take(size_t index, Task &task) {
+    for (size_t i = 0; i < queues.size(); ++i) {
+      Queue &queue = *queues[(index + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.tasks.empty())
+        continue;
+      if (i == 0) {
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+      } else {
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+      }
+      queued.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  static void run(const Task &task) {
+    try {
+      task();
+    } catch (const std::exception &e) {
+      HERR("pool") << e.what() << std::endl;
+    }
+  }
+
+  void work(size_t index) {
+    current() = {this, index};
+    Task task;
+    while (true) {
+      if (take(index, task)) {
+        run(task);
+        task = nullptr;
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [this]() { return stopping || queued.load() > 0; });
+      if (stopping && queued.load() == 0)
+        return;
+    }
+  }
+};
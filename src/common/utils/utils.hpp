@@ -1,9 +1,12 @@
 #pragma once
 
 #include <algorithm>
+#include <cerrno>
+#include <cstdlib>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
+#include <string>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <vector>
@@ -13,9 +16,11 @@ namespace fs = std::filesystem;
 // Logging helpers: use like `HLOG("Install") << "Found " << n << " files" <<
 // std::endl;`
 #define HLOG(tag)                                                              \
-  std::cout << "\033[1;39m[LOG]\033[0m " << "\033[2m[" << tag << "]\033[0m "
+  Utils::logStream() << "\033[1;39m[LOG]\033[0m " << "\033[2m[" << tag        \
+                     << "]\033[0m "
 #define HERR(tag)                                                              \
-  std::cerr << "\033[1;31m[Error]\033[0m " << "\033[2m[" << tag << "]\033[0m "
+  Utils::errStream() << "\033[1;31m[Error]\033[0m " << "\033[2m[" << tag      \
+                     << "]\033[0m "
 
 #ifdef DEBUG
 #include <iostream>
@@ -34,6 +39,23 @@ public:
 
 class Utils {
 public:
+  // Per-thread log redirection. When a sink is set, HLOG / HERR on that thread
+  // write into it instead of stdout / stderr (see Scheduler).
+  static std::ostream *&logSink() {
+    thread_local std::ostream *sink = nullptr;
+    return sink;
+  }
+  static std::ostream *&errSink() {
+    thread_local std::ostream *sink = nullptr;
+    return sink;
+  }
+  static std::ostream &logStream() {
+    return logSink() ? *logSink() : std::cout;
+  }
+  static std::ostream &errStream() {
+    return errSink() ? *errSink() : std::cerr;
+  }
+
   static struct winsize getTerminalSize() {
     struct winsize w;
     ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
@@ -83,6 +105,40 @@ public:
     fflush(stdout); // Force flush the output
   }
 
+  // Write all of data to fd, at offset, or at the file position if offset is
+  // negative. Short writes and EINTR are retried; on failure errno is set.
+  static bool writeAll(int fd, const char *data, size_t size,
+                       off_t offset = -1) {
+    while (size > 0) {
+      ssize_t n = offset < 0 ? ::write(fd, data, size)
+                             : pwrite(fd, data, size, offset);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        if (n == 0)
+          errno = EIO;
+        return false;
+      }
+      data += n;
+      size -= n;
+      if (offset >= 0)
+        offset += n;
+    }
+    return true;
+  }
+
+  // Where hoshimi keeps its runtime files: $XDG_RUNTIME_DIR/hoshimi, or
+  // $TMPDIR/hoshimi-<uid>/hoshimi without one. hoshimi_palette.h finds the
+  // palette the same way for C readers.
+  static fs::path runtimeDir() {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    fs::path dir = runtime && *runtime
+                       ? fs::path(runtime)
+                       : fs::temp_directory_path() /
+                             ("hoshimi-" + std::to_string(getuid()));
+    return dir / "hoshimi";
+  }
+
   static bool endsWith(const std::string &fullString,
                        const std::string &ending) {
     // Check if the ending string is longer than the full
@@ -1,21 +1,32 @@
+#pragma once
+
 #include "common/colorscheme.hpp"
+#include "common/formats.hpp"
+#include "common/hyprland.hpp"
 #include "common/json/json.hpp"
+#include "common/palette256.hpp"
+#include "common/template.hpp"
+#include "common/utils/commit.hpp"
+#include "common/utils/process.hpp"
+#include "common/utils/processes.hpp"
+#include "common/utils/scheduler.hpp"
+#include "common/utils/threadpool.hpp"
 #include "common/utils/utils.h"
 #include "common/utils/utils.hpp"
+#include <array>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
 #include <filesystem>
+#include <memory>
 #include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <thread>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
-enum FileType {
-  QS,
-  VALUE_PAIR,
-  CSS,
-  DEFAULT_VALUE,
-};
-
 class FilesManager {
 public:
   static fs::path getdotfilesDirectory() {
@@ -54,6 +65,18 @@ private:
   inline static fs::path DOTFILES_DIRECTORY;
   inline static fs::path BACKUP_DIRECTORY;
   inline static std::once_flag init_flag;
+  inline static const std::string DOTFILES_REPOSITORY =
+      "https://github.com/Matercan/hoshimi-dots.git";
+
+  static bool cloneDotfiles(const std::string &into) {
+    HLOG("Install") << "Running: git clone " << DOTFILES_REPOSITORY << " "
+                    << into << "." << std::endl;
+    Process::Options options;
+    options.output = Process::INHERIT;
+    Process::Result result;
+    return Process::run({"git", "clone", DOTFILES_REPOSITORY, into}, result,
+                        options);
+  }
 
   static void initIfNeeded() {
     std::call_once(init_flag, []() {
@@ -71,15 +94,9 @@ private:
       free(home);
 
       if (err != 2 && !dir_exists(HOSHIMI_HOME.c_str(), &err)) {
-        const std::string DOWNLOAD_COMMAND =
-            "git clone https://github.com/Matercan/hoshimi-dots.git " +
-            HOSHIMI_HOME;
-
         HLOG("Install") << "Cloning dotfiles from GitHub to " << HOSHIMI_HOME
                         << "." << std::endl;
-        HLOG("Install") << "Running: " << DOWNLOAD_COMMAND << "." << std::endl;
-        int result = system(DOWNLOAD_COMMAND.c_str());
-        if (result != 0) {
+        if (!cloneDotfiles(HOSHIMI_HOME)) {
           std::cerr << "Git clone failed" << std::endl;
         }
       }
@@ -139,244 +156,212 @@ private:
     return pathS;
   }
 
-  void install_file(const fs::directory_entry &dir_entry, size_t &processed,
-                    size_t &total_files, bool &progress_bar_active,
-                    const bool &verbose,
-                    const std::vector<std::string> &packages,
-                    const std::vector<std::string> &notPackages,
-                    const bool &onlyPackages) {
-    // Add mutex for thread safety
-    static std::mutex progress_mutex;
+  // One file of the dotfiles and what installing it does to its place in the
+  // home directory. Everything install needs to know about the file is found
+  // out once, while the manifest is built.
+  struct InstallEntry {
+    enum Action { COPY, LINK, REMOVE };
+
+    fs::path source;
+    fs::path target;
+    Action action;
+    // Copied instead of linked, hoshimi writes into it
+    bool modifiable;
+    // Something is at target already and is moved to the backup first
+    bool occupied;
+  };
+
+  struct InstallProgress {
+    std::mutex mutex;
+    size_t processed = 0;
+    size_t total = 0;
+    bool barActive = false;
+    bool verbose = false;
+  };
+
+  struct InstallFilter {
+    std::vector<std::string> packages;
+    std::vector<std::string> notPackages;
+    bool onlyPackages;
+    bool verbose;
+
+    // Files are matched by their path below .config
+    bool wanted(const std::string &configRelativePath) const {
+      auto matches = [&configRelativePath](
+                         const std::vector<std::string> &list) {
+        return std::any_of(list.begin(), list.end(),
+                           [&configRelativePath](const std::string &pkg) {
+                             return configRelativePath.find(pkg) !=
+                                    std::string::npos;
+                           });
+      };
+      return !matches(notPackages) && (!onlyPackages || matches(packages));
+    }
+  };
+
+  void addEntry(const fs::directory_entry &dir_entry,
+                std::vector<InstallEntry> &manifest,
+                const InstallFilter &filter) {
+    const fs::path &source = dir_entry.path();
+    const bool install = filter.wanted(findConfigRelativePath(source));
+    if (filter.verbose)
+      HLOG("install " + source.string())
+          << " will_install: " << install << "." << std::endl;
+    if (!install)
+      return;
 
-    // Clear progress bar before verbose output
-    if (progress_bar_active && verbose) {
-      std::cout << "\r" << std::string(Utils::getTerminalSize().ws_col, ' ')
-                << "\r";
-      progress_bar_active = false;
-    }
-    if (verbose) {
-      HLOG("install") << "Processing: " << dir_entry << "." << std::endl;
-    }
+    InstallEntry entry;
+    entry.source = source;
+    entry.target = findHomeEquivilent(source);
+    struct stat st;
+    entry.occupied = lstat(entry.target.c_str(), &st) == 0;
+    entry.modifiable = isModifiable(source);
 
-    fs::path const relative_path = findDotfilesRelativePath(dir_entry.path());
-    fs::path const home_equivalent = findHomeEquivilent(dir_entry.path());
-    fs::path const backup_path = BACKUP_DIRECTORY / relative_path;
-    std::string const config_relative_path =
-        findConfigRelativePath(dir_entry.path());
-    if (verbose) {
-      HLOG("install") << "Checking path: " << config_relative_path << "."
-                      << std::endl;
-    }
+    std::error_code ec;
+    if (entry.modifiable)
+      entry.action = InstallEntry::COPY;
+    else if (dir_entry.is_symlink(ec))
+      entry.action = InstallEntry::REMOVE;
+    else
+      entry.action = InstallEntry::LINK;
+    manifest.push_back(std::move(entry));
+  }
 
-    // Check if file matches any package in the include list
-    bool file_in_packages = false;
-    if (!packages.empty()) {
-      file_in_packages = std::any_of(
-          packages.begin(), packages.end(),
-          [&config_relative_path](const std::string &pkg) {
-            return config_relative_path.find(pkg) != std::string::npos;
-          });
-    }
+  // Everything install will do, found in a single walk over the dotfiles.
+  // Directories are tasks on the shared pool that add a task for every
+  // subdirectory, so a deep tree keeps every thread busy.
+  struct ManifestBuilder {
+    FilesManager &files;
+    const InstallFilter &filter;
+    ThreadPool::Group group;
+    std::mutex mutex;
+    std::vector<InstallEntry> manifest;
 
-    // Check if file matches any package in the exclude list
-    bool file_excluded = false;
-    if (!notPackages.empty()) {
-      file_excluded = std::any_of(
-          notPackages.begin(), notPackages.end(),
-          [&config_relative_path](const std::string &pkg) {
-            return config_relative_path.find(pkg) != std::string::npos;
-          });
-    }
+    ManifestBuilder(FilesManager &files, const InstallFilter &filter)
+        : files(files), filter(filter) {}
 
-    // Determine if file should be installed
-    bool file_installed =
-        !file_excluded && (!onlyPackages || (onlyPackages && file_in_packages));
+    void walk(const fs::path &dir) {
+      std::error_code ec;
+      fs::directory_iterator it(
+          dir, fs::directory_options::skip_permission_denied, ec);
+      if (ec && filter.verbose)
+        HERR("install") << "Could not access directory " << dir << ": "
+                        << ec.message() << std::endl;
+
+      std::vector<InstallEntry> found;
+      for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        // The type comes from the directory listing, no stat needed. A link
+        // to a directory is an entry of its own and is not followed, as a
+        // recursive iterator would not: it keeps its REMOVE, and a link
+        // cycle cannot walk forever.
+        if (!it->is_symlink(ec) && !ec && it->is_directory(ec)) {
+          fs::path subdirectory = it->path();
+          group.run([this, subdirectory]() { walk(subdirectory); });
+        } else {
+          files.addEntry(*it, found, filter);
+        }
+      }
 
-    if (verbose) {
-      HLOG("install " + dir_entry.path().string())
-          << " in_packages: " << file_in_packages
-          << " excluded: " << file_excluded
-          << " will_install: " << file_installed << "." << std::endl;
+      std::lock_guard<std::mutex> lock(mutex);
+      std::move(found.begin(), found.end(), std::back_inserter(manifest));
     }
+  };
 
-    if (!file_installed)
-      return;
+  std::vector<InstallEntry> buildManifest(const InstallFilter &filter) {
+    if (!fs::is_directory(DOTFILES_DIRECTORY))
+      throw fs::filesystem_error(
+          "Not a directory", DOTFILES_DIRECTORY,
+          std::make_error_code(std::errc::not_a_directory));
 
-    // First, handle backup of existing files/directories
-    if (fs::exists(home_equivalent)) {
-      // Create parent directories in backup if needed
-      fs::create_directories(backup_path.parent_path());
+    ManifestBuilder builder(*this, filter);
+    builder.group.run([&builder, this]() { builder.walk(DOTFILES_DIRECTORY); });
+    builder.group.wait();
 
-      if (fs::is_directory(home_equivalent)) {
-        if (verbose) {
-          HLOG("install") << "Backing up directory: " << home_equivalent
-                          << " to " << backup_path << "." << std::endl;
-        }
-        // For directories, only backup if backup doesn't exist
-        if (!fs::exists(backup_path)) {
-          fs::create_directory(backup_path);
-        }
-      } else {
-        if (verbose) {
-          HLOG("install") << "Backing up file: " << home_equivalent << " to "
-                          << backup_path << "." << std::endl;
-        }
-        fs::rename(home_equivalent, backup_path);
-      }
+    std::sort(builder.manifest.begin(), builder.manifest.end(),
+              [](const InstallEntry &a, const InstallEntry &b) {
+                return a.source < b.source;
+              });
+    return std::move(builder.manifest);
+  }
+
+  void install_file(const InstallEntry &entry, InstallProgress &progress) {
+    const bool verbose = progress.verbose;
+    // Add static mutex for cout synchronization
+    static std::mutex cout_mutex;
+
+    if (verbose) {
+      std::lock_guard<std::mutex> cout_lock(cout_mutex);
+      HLOG("install") << "Processing: " << entry.source << "." << std::endl;
     }
 
-    // Now create symlinks/directories
-    if (fs::is_directory(dir_entry)) {
-      if (!fs::exists(home_equivalent)) {
+    try {
+      // First, move whatever is in the way to the backup
+      if (entry.occupied) {
+        fs::path const backup_path =
+            BACKUP_DIRECTORY / findDotfilesRelativePath(entry.source);
+        fs::create_directories(backup_path.parent_path());
         if (verbose) {
-          HLOG("install") << "Creating directory: " << home_equivalent << "."
-                          << std::endl;
+          std::lock_guard<std::mutex> cout_lock(cout_mutex);
+          HLOG("install") << "Backing up: " << entry.target << " to "
+                          << backup_path << "." << std::endl;
         }
-        fs::create_directories(home_equivalent);
-      }
-    } else {
-      // For files, create symlink (file should be backed up by now)
-      if (verbose) {
-        HLOG("install") << "Creating symlink: " << dir_entry << " -> "
-                        << home_equivalent << "." << std::endl;
-      }
-
-      // Extra safety check
-      if (fs::exists(home_equivalent)) {
-        fs::remove(home_equivalent);
+        fs::rename(entry.target, backup_path);
       }
 
-      // Create parent directory if it doesn't exist
-      try {
-        fs::create_directories(home_equivalent.parent_path());
-      } catch (const fs::filesystem_error &e) {
-        char *err =
-            hoshimi_error_strerror(init_err(4, dir_entry.path().c_str()));
-        HERR("install " + dir_entry.path().string())
-            << err << ": " << e.what() << std::endl;
-        free(err);
-        return;
-      }
-
-      // Add static mutex for cout synchronization
-      static std::mutex cout_mutex;
+      fs::create_directories(entry.target.parent_path());
 
-      if (isModifiable(dir_entry.path())) {
+      if (entry.action == InstallEntry::COPY) {
         {
           std::lock_guard<std::mutex> cout_lock(cout_mutex);
-          if (processed < total_files)
-            HLOG("install " + dir_entry.path().string())
-                << "File modifiable by Hoshimi, symlink will not be created."
-                << std::endl;
+          HLOG("install " + entry.source.string())
+              << "File modifiable by Hoshimi, symlink will not be created."
+              << std::endl;
         }
-        fs::copy(dir_entry, home_equivalent);
-      } else if (!fs::is_symlink(dir_entry)) {
-        {
+        fs::copy(entry.source, entry.target);
+      } else if (entry.action == InstallEntry::LINK) {
+        if (verbose) {
           std::lock_guard<std::mutex> cout_lock(cout_mutex);
-          if (verbose)
-            HLOG("install")
-                << "Creating symlink for: " << dir_entry.path().filename()
-                << "." << std::endl;
+          HLOG("install") << "Creating symlink: " << entry.source << " -> "
+                          << entry.target << "." << std::endl;
         }
-        fs::create_symlink(dir_entry, home_equivalent);
+        fs::create_symlink(entry.source, entry.target);
       } else {
-        {
+        if (verbose) {
           std::lock_guard<std::mutex> cout_lock(cout_mutex);
-          if (verbose)
-            HLOG("install")
-                << "Removing existing symlink: " << dir_entry.path().filename()
-                << "." << std::endl;
+          HLOG("install") << "Removing existing symlink: "
+                          << entry.source.filename() << "." << std::endl;
         }
-        fs::remove(home_equivalent);
+        fs::remove(entry.target);
       }
+    } catch (const fs::filesystem_error &e) {
+      char *err = hoshimi_error_strerror(init_err(4, entry.source.c_str()));
+      HERR("install " + entry.source.string())
+          << err << ": " << e.what() << std::endl;
+      free(err);
     }
 
-    // Update progress (only for files)
-    if (!fs::is_directory(dir_entry)) {
-      std::lock_guard<std::mutex> lock(progress_mutex);
-      processed++;
-
-      if (verbose) {
-        HLOG("install") << "Progress: " << processed << "/" << total_files
-                        << " (" << int((float)processed / total_files * 100.0)
-                        << "%)" << "." << std::endl;
-      } else if (processed <= total_files) { // Add bounds check
-        float progress = (float)processed / total_files;
-        Utils::print_progress_bar(progress, processed, total_files);
-        progress_bar_active = true;
-      }
+    std::lock_guard<std::mutex> lock(progress.mutex);
+    progress.processed++;
+    if (verbose) {
+      HLOG("install") << "Progress: " << progress.processed << "/"
+                      << progress.total << " ("
+                      << int((float)progress.processed / progress.total * 100.0)
+                      << "%)" << "." << std::endl;
+    } else {
+      Utils::print_progress_bar((float)progress.processed / progress.total,
+                                progress.processed, progress.total);
+      progress.barActive = true;
     }
-
-    return;
   }
 
-  void installDirectory(const fs::directory_entry &dir_entry, size_t &processed,
-                        size_t &total_files, bool &progress_bar_active,
-                        const bool &verbose,
-                        const std::vector<std::string> &packages,
-                        const std::vector<std::string> &notPackages,
-                        const bool &onlyPackages) {
-
-    static std::mutex threads_mutex;
-    std::vector<std::thread> threads;
-    const size_t max_threads = std::thread::hardware_concurrency();
-
-    // Add error handling for directory access
-    std::error_code ec;
-    fs::directory_iterator dir_it(
-        dir_entry, fs::directory_options::skip_permission_denied, ec);
-
-    if (ec) {
-      if (verbose) {
-        std::cerr << "Warning: Could not access directory " << dir_entry.path()
-                  << ": " << ec.message() << std::endl;
-      }
-      return;
-    }
-
-    for (auto const &entry : dir_it) {
-      try {
-        if (fs::is_directory(entry, ec)) {
-          if (!ec) {
-            installDirectory(entry, processed, total_files, progress_bar_active,
-                             verbose, packages, notPackages, onlyPackages);
-          }
-        } else if (!ec) {
-          std::lock_guard<std::mutex> lock(threads_mutex);
-
-          // Wait if we have too many threads
-          if (threads.size() >= max_threads) {
-            for (auto &t : threads) {
-              if (t.joinable())
-                t.join();
-            }
-            threads.clear();
-          }
-
-          threads.emplace_back([this, entry, &processed, &total_files,
-                                &progress_bar_active, &verbose, &packages,
-                                &notPackages, &onlyPackages]() {
-            install_file(entry, processed, total_files, progress_bar_active,
-                         verbose, packages, notPackages, onlyPackages);
-          });
-        }
-      } catch (const fs::filesystem_error &e) {
-        if (verbose) {
-          char *err =
-              hoshimi_error_strerror(init_err(4, dir_entry.path().c_str()));
-          HERR("install " + dir_entry.path().string())
-              << err << ": " << e.what() << std::endl;
-          free(err);
-        }
-        continue;
-      }
-    }
-
-    // Wait for remaining threads
-    for (auto &t : threads) {
-      if (t.joinable())
-        t.join();
-    }
+  // Entries are independent of each other, every one is a task on the
+  // shared pool
+  void installEntries(const std::vector<InstallEntry> &manifest,
+                      InstallProgress &progress) {
+    ThreadPool::Group group;
+    for (const auto &entry : manifest)
+      group.run([this, &entry, &progress]() { install_file(entry, progress); });
+    group.wait();
   }
 
 public:
@@ -395,15 +380,9 @@ public:
     }
 
     if (!fs::exists(HOSHIMI_HOME)) {
-      const std::string DOWNLOAD_COMMAND =
-          "git clone https://github.com/Matercan/hoshimi-dots.git " +
-          HOSHIMI_HOME;
-
       HLOG("Install") << "Cloning dotfiles from GitHub to " << HOSHIMI_HOME
                       << "." << std::endl;
-      HLOG("Install") << "Running: " << DOWNLOAD_COMMAND << "." << std::endl;
-      int result = system(DOWNLOAD_COMMAND.c_str());
-      if (result != 0) {
+      if (!cloneDotfiles(HOSHIMI_HOME)) {
         std::cerr << "Git clone failed" << std::endl;
       }
     }
@@ -431,46 +410,10 @@ public:
       fs::create_directories(BACKUP_DIRECTORY);
     }
 
-    // Count total files first
-    size_t total_files = 0;
-    std::mutex count_mutex;
-
+    std::vector<InstallEntry> manifest;
+    const InstallFilter filter{packages, notPackages, onlyPackages, verbose};
     try {
-      for (const auto &dir_entry :
-           fs::recursive_directory_iterator(DOTFILES_DIRECTORY)) {
-        if (!fs::is_directory(dir_entry)) {
-          std::string const config_relative_path = fs::relative(
-              dir_entry.path(), DOTFILES_DIRECTORY.string() + ".config");
-
-          // Use same logic as install_file
-          bool file_in_packages = false;
-          if (!packages.empty()) {
-            file_in_packages = std::any_of(
-                packages.begin(), packages.end(),
-                [&config_relative_path](const std::string &pkg) {
-                  return config_relative_path.find(pkg) != std::string::npos;
-                });
-          }
-
-          bool file_excluded = false;
-          if (!notPackages.empty()) {
-            file_excluded = std::any_of(
-                notPackages.begin(), notPackages.end(),
-                [&config_relative_path](const std::string &pkg) {
-                  return config_relative_path.find(pkg) != std::string::npos;
-                });
-          }
-
-          bool will_install =
-              !file_excluded &&
-              (!onlyPackages || (onlyPackages && file_in_packages));
-
-          if (will_install) {
-            std::lock_guard<std::mutex> lock(count_mutex);
-            total_files++;
-          }
-        }
-      }
+      manifest = buildManifest(filter);
     } catch (const fs::filesystem_error &e) {
       char *err =
           hoshimi_error_strerror(init_err(2, DOTFILES_DIRECTORY.c_str()));
@@ -481,34 +424,17 @@ public:
     }
 
     if (verbose) {
-      HLOG("Install") << "Total files to process: " << total_files << "."
+      HLOG("Install") << "Total files to process: " << manifest.size() << "."
                       << std::endl;
     }
 
-    size_t processed = 0;
-    bool progress_bar_active = false;
-
-    for (auto const &dir_entry :
-         fs::recursive_directory_iterator(DOTFILES_DIRECTORY)) {
-      std::error_code ec;
-      if (fs::is_directory(dir_entry.path(), ec) && !ec) {
-        installDirectory(dir_entry, processed, total_files, progress_bar_active,
-                         verbose, packages, notPackages, onlyPackages);
-      } else if (!ec) {
-        // Direct file entry: process directly to avoid skipping files when
-        // installDirectory expects a directory
-        install_file(dir_entry, processed, total_files, progress_bar_active,
-                     verbose, packages, notPackages, onlyPackages);
-      } else {
-        if (verbose) {
-          std::cerr << "Warning: failed to stat " << dir_entry.path() << ": "
-                    << ec.message() << std::endl;
-        }
-      }
-    }
+    InstallProgress progress;
+    progress.total = manifest.size();
+    progress.verbose = verbose;
+    installEntries(manifest, progress);
 
     // Clear progress bar at the end
-    if (progress_bar_active) {
+    if (progress.barActive) {
       std::cout << "\r" << std::string(Utils::getTerminalSize().ws_col, ' ')
                 << "\r";
       std::cout.flush();
@@ -525,8 +451,47 @@ private:
   std::string fileContents;
   FileType filetype;
 
+  // Edits made by replaceValue. They are only rendered into newContents when
+  // something needs the text, so a run of replaceValue calls costs one index
+  // lookup each and a single pass over the file.
+  std::unique_ptr<ConfigDocument> document;
+  bool indexFromCache = false;
+
+  ConfigDocument &configDocument(FileType type) {
+    if (document && document->getType() == type)
+      return *document;
+    flush();
+
+    // The cached index describes the file on disk, so it can only be used
+    // before anything else touched the contents
+    ConfigIndex index;
+    indexFromCache = newContents == fileContents &&
+                     ConfigIndexCache::load(file, type, newContents.size(),
+                                            index);
+    if (indexFromCache)
+      document.reset(new ConfigDocument(type, newContents, std::move(index)));
+    else
+      document.reset(new ConfigDocument(type, newContents));
+    return *document;
+  }
+
+  // Render pending edits into newContents. renderedIndex receives the index
+  // of the result.
+  void flush(ConfigIndex *renderedIndex = nullptr) {
+    if (!document)
+      return;
+    if (document->edited())
+      newContents = document->render(renderedIndex);
+    else if (renderedIndex)
+      *renderedIndex = document->getIndex();
+    document.reset();
+  }
+
 public:
-  std::string contents() { return newContents; }
+  std::string contents() {
+    flush();
+    return newContents;
+  }
 
   WriterBase(fs::path writingFile) {
     file = writingFile;
@@ -572,38 +537,57 @@ public:
     filetype = ft;
   }
 
+  // Stage the new contents into the active CommitBatch, or write them right
+  // away when there is none. Unchanged files are not written at all. The index
+  // of an edited file is cached once the file is in place, keyed by its new
+  // mtime, so the next source does not tokenize it again.
   bool write() {
-    std::ofstream o(file.string());
-
-    if (!o.is_open()) {
-      char *err = hoshimi_error_strerror(init_err(2, file.c_str()));
-      HERR("Config " + file.string()) << err << std::endl;
-      free(err);
+    bool indexed = document != nullptr;
+    bool cached = indexed && indexFromCache && !document->edited();
+    FileType type = indexed ? document->getType() : filetype;
+    ConfigIndex index;
+    flush(&index);
+
+    if (newContents == fileContents && fs::exists(file) &&
+        !CommitBatch::capturing()) {
+      if (indexed && !cached)
+        ConfigIndexCache::store(file, type, index);
+      return true;
+    }
+    if (!write(file))
       return false;
-    }
-
-    o << newContents;
 
-    o.close();
+    if (indexed)
+      CommitBatch::whenCommitted(file, [file = file, type, index]() {
+        ConfigIndexCache::store(file, type, index);
+      });
     return true;
   }
-  void write(const std::string &filePath) {
-    std::ofstream o(filePath);
+  bool write(const fs::path &filePath) {
+    flush();
+    if (CommitBatch *batch = CommitBatch::active()) {
+      batch->stage(filePath, newContents);
+      return true;
+    }
 
-    if (!o.is_open()) {
-      char *err = hoshimi_error_strerror(init_err(2, file.c_str()));
-      HERR("Config " + file.string()) << err << std::endl;
+    if (!CommitBatch::writeFile(filePath, newContents)) {
+      char *err = hoshimi_error_strerror(init_err(2, filePath.c_str()));
+      HERR("Config " + filePath.string()) << err << std::endl;
       free(err);
-      return;
+      return false;
     }
 
-    o << newContents;
-
-    o.close();
-    return;
+    return true;
   }
 
   void revert() {
+    document.reset();
+    // Nothing has been written yet while a batch is active
+    if (CommitBatch *batch = CommitBatch::active()) {
+      batch->discard(file);
+      return;
+    }
+
     std::ofstream o(file.string());
 
     if (!o.is_open()) {
@@ -621,8 +605,12 @@ public:
   fs::path getFile() { return file; }
 
   // Empty file (from given point)
-  void empty() { newContents = ""; }
+  void empty() {
+    document.reset();
+    newContents = "";
+  }
   void empty(const int &line) {
+    flush();
     std::istringstream stream(newContents);
     std::string line_content;
     std::string updated_contents;
@@ -638,6 +626,7 @@ public:
     newContents = updated_contents;
   }
   void empty(const char *text) {
+    flush();
     std::istringstream stream(newContents);
     std::string line_content;
     std::string updated_contents;
@@ -652,9 +641,16 @@ public:
   }
 
   // Append contents to file
-  void append(std::string text) { newContents += text; }
-  void append(const char *text) { newContents += std::string(text); }
+  void append(std::string text) {
+    flush();
+    newContents += text;
+  }
+  void append(const char *text) {
+    flush();
+    newContents += std::string(text);
+  }
   void append(const std::string &text, const int &line) {
+    flush();
     std::istringstream stream(newContents);
     std::string line_content;
     std::string updated_contents;
@@ -677,6 +673,7 @@ public:
     newContents = updated_contents;
   }
   void appendBeforeLine(const std::string &text, const int &line) {
+    flush();
     std::istringstream stream(newContents);
     std::string line_content;
     std::string updated_contents;
@@ -700,6 +697,7 @@ public:
   }
 
   void writeLine(const std::string &text, const int &line) {
+    flush();
     std::istringstream stream(newContents);
     std::string line_content;
     std::string updated_contents;
@@ -723,304 +721,183 @@ public:
     newContents = updated_contents;
   }
 
+  // Set the value of key, see ConfigIndex for how keys are named in each
+  // format. Returns whether the contents changed; a key that does not exist is
+  // left alone.
   bool replaceValue(const std::string &key, const std::string &value,
-                    FileType *fileType) {
-    if (filetype != FileType::DEFAULT_VALUE)
-      fileType = &filetype;
-
-    std::string updatedContents;
-    std::string line;
-    std::istringstream newContentsStream(newContents);
-
-    if (*fileType == FileType::QS) {
-      bool written = false;
-      while (getline(newContentsStream, line)) {
-        if (written) {
-          updatedContents += line + "\n";
-          continue;
-        }
-        if (boost::algorithm::contains(line, key + ":")) {
-          if (line.find(":") == std::string::npos) {
-            updatedContents += line + "\n";
-            continue;
-          }
-
-          std::string newLine = "";
-          std::vector<std::string> split;
-
-          boost::algorithm::split(split, line, boost::is_any_of(":"),
-                                  boost::token_compress_on);
-
-          newLine += split[0] + ": " + value;
-          updatedContents += newLine + "\n";
-          written = true;
-          continue;
-        } else {
-          updatedContents += line + "\n";
-        }
-      }
-    }
-    if (*fileType == FileType::VALUE_PAIR) {
-      while (getline(newContentsStream, line)) {
-        bool written = false;
-        if (written) {
-          updatedContents += line + "\n";
-          continue;
-        }
-        if (boost::algorithm::contains(line, key)) {
-          std::string newLine;
-          std::vector<std::string> split;
-          boost::algorithm::split(split, line, boost::is_any_of("="),
-                                  boost::token_compress_on);
-
-          for (size_t i = 0; i < split.size() - 1; ++i)
-            newLine += split[i] + "=";
-
-          newLine += value;
-          updatedContents += newLine + "\n";
-          written = true;
-        } else {
-          updatedContents += line + "\n";
-        }
-      }
-    }
-    if (*fileType == FileType::CSS) {
-      while (getline(newContentsStream, line)) {
-        bool written = false;
-        if (written) {
-          updatedContents += line + "\n";
-          continue;
-        }
-        if (boost::algorithm::contains(line, key)) {
-          std::string newLine;
-          std::vector<std::string> split;
-          boost::algorithm::split(split, line, boost::is_any_of(":"),
-                                  boost::token_compress_on);
-
-          newLine += split[0] + ": " + value;
-          updatedContents += newLine + ";\n";
-          written = true;
-          continue;
-        } else {
-          updatedContents += line + "\n";
-        }
-      }
-    }
+                    FileType *fileType = nullptr) {
+    FileType type = filetype;
+    if (type == FileType::DEFAULT_VALUE && fileType)
+      type = *fileType;
+    if (type == FileType::DEFAULT_VALUE)
+      return false;
 
-    std::string oldContents = newContents;
-    newContents = updatedContents;
-    return newContents != oldContents;
+    return configDocument(type).set(key, value);
   }
-  bool replaceValue(std::string key, std::string value, std::string afterLine) {
 
-    auto fileType = &filetype;
-    std::string updatedContents;
-    std::string line;
-    std::istringstream newContentsStream(newContents);
-    bool foundLine = false;
-
-    if (*fileType == FileType::QS) {
-      bool written = false;
-      while (getline(newContentsStream, line)) {
-        if (written) {
-          updatedContents += line + "\n";
-          continue;
-        } else if (!foundLine) {
-          if (boost::algorithm::contains(line, afterLine)) {
-            foundLine = true;
-          }
-          updatedContents += line + "\n";
-        } else if (boost::algorithm::contains(line, key + ":")) {
-          if (line.find(":") == std::string::npos) {
-            updatedContents += line + "\n";
-            continue;
-          }
+  bool hasKey(const std::string &key, FileType *fileType = nullptr) {
+    FileType type = filetype;
+    if (type == FileType::DEFAULT_VALUE && fileType)
+      type = *fileType;
+    if (type == FileType::DEFAULT_VALUE)
+      return false;
 
-          std::string newLine = "";
-          std::vector<std::string> split;
+    return configDocument(type).has(key);
+  }
 
-          boost::algorithm::split(split, line, boost::is_any_of(":"),
-                                  boost::token_compress_on);
+  // Like replaceValue, but when the file does not have key yet, line (which
+  // sets it) is added to missing, for insertAfter
+  void replaceOrCollect(const std::string &key, const std::string &value,
+                        const std::string &line, std::string &missing) {
+    if (!replaceValue(key, value) && !hasKey(key))
+      missing += line;
+  }
 
-          newLine += split[0] + ": " + value;
-          updatedContents += newLine + "\n";
-          written = true;
-          continue;
-        } else {
-          updatedContents += line + "\n";
-        }
-      }
-    } else if (*fileType == FileType::VALUE_PAIR) {
-      bool written = false;
-      while (getline(newContentsStream, line)) {
-        if (written) {
-          updatedContents += line + "\n";
-          continue;
-        } else if (!foundLine) {
-          if (boost::algorithm::contains(line, afterLine)) {
-            foundLine = true;
-          }
-          updatedContents += line + "\n";
-        } else if (boost::algorithm::contains(line, key)) {
-          std::string newLine;
-          std::vector<std::string> split;
-          boost::algorithm::split(split, line, boost::is_any_of("="),
-                                  boost::token_compress_on);
-
-          for (size_t i = 0; i < split.size() - 1; ++i)
-            newLine += split[i] + "=";
-
-          newLine += value;
-          updatedContents += newLine + "\n";
-        } else {
-          updatedContents += line + "\n";
-        }
-      }
-    }
+  // Insert lines below the line that sets anchor, or at the end of the file
+  // if nothing does. Returns whether the anchor was found.
+  bool insertAfter(const std::string &anchor, const std::string &lines) {
+    if (filetype == FileType::DEFAULT_VALUE)
+      return false;
 
-    std::string oldContents = newContents;
-    newContents = updatedContents;
-    return newContents != oldContents;
+    // Positions are only known once the pending edits are in the text
+    flush();
+    const ConfigIndex::Span *span =
+        configDocument(filetype).getIndex().find(anchor);
+    size_t at = newContents.size();
+    if (span) {
+      size_t lineEnd = newContents.find('\n', span->end);
+      at = lineEnd == std::string::npos ? newContents.size() : lineEnd + 1;
+    }
+    document.reset();
+
+    if (at == newContents.size() && !newContents.empty() &&
+        newContents.back() != '\n')
+      newContents += '\n', at++;
+    newContents.insert(at, lines);
+    return span != nullptr;
   }
 
+  // Like replaceValue, but a missing key is an error. A value that is already
+  // set is not.
   bool replaceWithChecking(std::string key, std::string value) {
-    bool exit_code = replaceValue(key, value, nullptr);
-    if (!exit_code) {
-      std::string source = "Config" + file.string();
-      hoshimi_error_t *err = init_err(3, "Config");
-      char *err_s = hoshimi_error_strerror(err);
-      HERR(source) << err_s << std::endl;
-      free_hoshimi_error(err);
-      free(err_s);
-    }
-    return exit_code;
+    replaceValue(key, value);
+    if (hasKey(key))
+      return true;
+
+    std::string source = "Config " + file.string();
+    hoshimi_error_t *err = init_err(3, "Config");
+    char *err_s = hoshimi_error_strerror(err);
+    HERR(source) << err_s << ", no " << key << std::endl;
+    free_hoshimi_error(err);
+    free(err_s);
+    return false;
   }
   void replaceWithChecking(std::string key, std::string value, bool &exitCode) {
-    if (!replaceValue(key, value, nullptr)) {
-      std::string source = "Config" + file.string();
-      hoshimi_error_t *error = init_err(3, "Config");
-      char *err_s = hoshimi_error_strerror(error);
-      HERR(source) << err_s << std::endl;
-      free_hoshimi_error(error);
-      free(err_s);
+    if (!replaceWithChecking(key, value))
       exitCode = false;
-    }
-  }
-  void replaceWithChecking(std::string key, std::string value,
-                           std::string afterLine, bool &exitCode) {
-    if (!replaceValue(key, value, afterLine)) {
-      std::string source = "Config" + file.string();
-      hoshimi_error_t *error = init_err(3, "Config");
-      char *err_s = hoshimi_error_strerror(error);
-      HERR(source) << err_s << std::endl;
-      free_hoshimi_error(error);
-      free(err_s);
-      exitCode = false;
-    }
   }
 };
 
+// Colors.qml and Variables.qml each get one generated block of properties
+// (see QmlPropertyBlock), rendered in a single pass from the resolved
+// configuration.
 class QuickshellWriter {
 private:
   Colorscheme colors;
   ShellHandler::Config config;
-  WriterBase *colorsWriter;
-  WriterBase *shellWriter;
 
-public:
-  QuickshellWriter() {
-    colors = ColorsHandler().getColors();
-    config = ShellHandler().getConfig();
-    colorsWriter = new WriterBase(
-        file_t::findHomeEquivilent(file_t::getQuickshellFolder() /
-                                   "functions/Colors.qml"),
-        FileType::QS);
-    shellWriter = new WriterBase(
-        file_t::findHomeEquivilent(file_t::getQuickshellFolder() /
-                                   "globals/Variables.qml"),
-        FileType::QS);
+  static bool writeBlock(WriterBase &writer, const QmlPropertyBlock &block) {
+    std::string updated = block.apply(writer.contents());
+    writer.empty();
+    writer.append(updated);
+
+    if (!writer.write()) {
+      std::string source = "Config " + writer.getFile().string();
+      char *err = hoshimi_error_strerror(init_err(2, writer.getFile().c_str()));
+      HERR(source) << err << std::endl;
+      free(err);
+      writer.revert();
+      return false;
+    }
+    return true;
   }
 
-  ~QuickshellWriter() {
-    delete colorsWriter;
-    delete shellWriter;
+public:
+  static fs::path colorsPath() {
+    return file_t::findHomeEquivilent(file_t::getQuickshellFolder() /
+                                      "functions/Colors.qml");
+  }
+  static fs::path shellPath() {
+    return file_t::findHomeEquivilent(file_t::getQuickshellFolder() /
+                                      "globals/Variables.qml");
   }
 
-  bool writeColors() {
-    if (!file_t::isModifiable(colorsWriter->getFile())) {
-      HERR("Config " + colorsWriter->getFile().string())
-          << "File not modifiable by Hoshimi, skipping." << std::endl;
-      colorsWriter->appendBeforeLine(
-          "// File not modifiable by Hoshimi, skipping.\n", 0);
-    }
-    bool exitCode = true;
-    if (colors.backgroundColor.light())
-      colorsWriter->replaceWithChecking("light", "true");
-    else
-      colorsWriter->replaceWithChecking("light", "false");
+  QuickshellWriter(const Colorscheme &colors,
+                   const ShellHandler::Config &config)
+      : colors(colors), config(config) {}
 
+  QmlPropertyBlock colorsBlock() const {
+    QmlPropertyBlock block;
+    block.add("light", "property bool light",
+              colors.backgroundColor.light() ? "true" : "false");
+
+    std::vector<std::array<char, Color::FORMAT_SIZE>> palette(
+        colors.palette.size());
+    Color::formatAll(colors.palette.data(), colors.palette.size(),
+                     Color::FLAGS::WQUOT, palette.data());
     for (size_t i = 0; i < colors.palette.size(); ++i) {
-      colorsWriter->replaceWithChecking(
-          "paletteColor" + std::to_string(i + 1),
-          colors.palette[i].toHex(Color::FLAGS::WQUOT));
+      std::string name = "paletteColor" + std::to_string(i + 1);
+      block.add(name, "property color " + name, palette[i].data());
     }
-    colorsWriter->replaceWithChecking(
-        "backgroundColor", colors.backgroundColor.toHex(Color::FLAGS::WQUOT),
-        exitCode);
-    colorsWriter->replaceWithChecking(
-        "foregroundColor", colors.foregroundColor.toHex(Color::FLAGS::WQUOT),
-        exitCode);
 
     Utils utils;
     const auto &names = utils.COLOR_NAMES;
+    block.add(names[0], "property color " + names[0],
+              colors.backgroundColor.toHex(Color::FLAGS::WQUOT));
+    block.add(names[1], "property color " + names[1],
+              colors.foregroundColor.toHex(Color::FLAGS::WQUOT));
+
     size_t max_i = std::min(colors.main.size(), names.size());
-    for (size_t i = 2; i < max_i; ++i) {
-      colorsWriter->replaceWithChecking(
-          names[i], colors.main[i].toHex(Color::FLAGS::WQUOT), exitCode);
-    }
+    for (size_t i = 2; i < max_i; ++i)
+      block.add(names[i], "property color " + names[i],
+                colors.main[i].toHex(Color::FLAGS::WQUOT));
     if (colors.main.size() > names.size()) {
       HLOG("Config") << "colors.main has " << colors.main.size()
                      << " entries but only " << names.size()
                      << " names available; skipping extras." << std::endl;
     }
 
-    if (!colorsWriter->write()) {
-      exitCode = false;
-      HERR(colorsWriter->getFile().filename())
-          << hoshimi_error_strerror(
-                 init_err(2, colorsWriter->getFile().filename().c_str()))
-          << std::endl;
-    }
-
-    if (!exitCode)
-      colorsWriter->revert();
-
-    utils.destroyOsuDir(NULL);
-
-    return exitCode;
+    return block;
   }
 
-  bool writeShell() {
-    bool exitCode = true;
+  QmlPropertyBlock shellBlock() const {
+    QmlPropertyBlock block;
+    block.add("wallpaper", "property string wallpaper",
+              "\"" + config.wallpaper + "\"");
 
-    shellWriter->replaceWithChecking("wallpaper",
-                                     "\"" + config.wallpaper + "\"", exitCode);
     char *home = getHoshimiHome(NULL);
-    shellWriter->replaceValue(
-        "osuDirectory", "\"" + std::string(home) + "/assets/osuGen\"", nullptr);
+    block.add("osuDirectory", "property string osuDirectory",
+              "\"" + std::string(home ? home : "") + "/assets/osuGen\"");
     free(home);
 
-    if (!shellWriter->write()) {
-      exitCode = false;
-      std::string source = "Config " + shellWriter->getFile().string();
-      hoshimi_error_t *err = init_err(2, "Config");
-      HERR(source) << hoshimi_error_strerror(err) << std::endl;
+    return block;
+  }
+
+  bool writeColors() {
+    WriterBase writer(colorsPath());
+    if (!file_t::isModifiable(writer.getFile())) {
+      HERR("Config " + writer.getFile().string())
+          << "File not modifiable by Hoshimi, skipping." << std::endl;
+      writer.appendBeforeLine("// File not modifiable by Hoshimi, skipping.\n",
+                              0);
     }
 
-    if (!exitCode)
-      shellWriter->revert();
+    return writeBlock(writer, colorsBlock());
+  }
 
-    return exitCode;
+  bool writeShell() {
+    WriterBase writer(shellPath());
+    return writeBlock(writer, shellBlock());
   }
 };
 
@@ -1030,41 +907,43 @@ private:
   WriterBase writer;
 
 public:
-  void reloadGhostty() {
-    system("# Trigger ghostty config reload\n"
-           "if pgrep -x ghostty &> /dev/null; then\n"
-           "ghostty_addresses=$(hyprctl clients -j | jq -r \'.[] | "
-           "select(.class == \"com.mitchellh.ghostty\") | .address\')\n"
-
-           "if [[ -n \"$ghostty_addresses\" ]]; then\n"
-           "# Save current active window\n"
-           "current_window=$(hyprctl activewindow -j | jq -r '.address')\n"
-
-           "# Focus each ghostty window and send reload key combo\n"
-           "while IFS= read -r address; do\n"
-           "hyprctl dispatch focuswindow \"address:$address\" > /dev/null &\n"
-           "sleep 0.1\n"
-           "hyprctl dispatch sendshortcut \"CTRL SHIFT, comma, "
-           "address:$address\" > /dev/null &\n"
-           "done <<< \"$ghostty_addresses\"\n"
-
-           "# Return focus to original window\n"
-           "if [[ -n \"$current_window\" ]]; then\n"
-           "hyprctl dispatch focuswindow \"address:$current_window\" > "
-           "/dev/null &\n"
-           "fi\n"
-           "fi\n"
-           "fi\n");
-  }
-
-  GhosttyWriter() {
-    colors = ColorsHandler().getColors();
-    writer =
-        WriterBase(file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
-                                              ".config/ghostty/themes/hoshimi"),
-                   FileType::VALUE_PAIR);
+  // Ghostty reloads its config on ctrl+shift+comma, which Hyprland can send
+  // to every Ghostty window. All of them are done in one batch request, then
+  // focus goes back to the window that had it.
+  static void reloadGhostty() {
+    Hyprland hyprland;
+    std::vector<Hyprland::Client> clients;
+    if (!hyprland.available() || !hyprland.clients(clients))
+      return;
+
+    std::vector<std::string> commands;
+    for (const auto &client : clients) {
+      if (client.windowClass != "com.mitchellh.ghostty")
+        continue;
+      commands.push_back("dispatch focuswindow address:" + client.address);
+      commands.push_back("dispatch sendshortcut CTRL SHIFT, comma, address:" +
+                         client.address);
+    }
+    if (commands.empty())
+      return;
+
+    std::string active = hyprland.activeWindow();
+    if (!active.empty())
+      commands.push_back("dispatch focuswindow address:" + active);
+
+    if (!hyprland.batch(commands))
+      HERR("ghostty") << "Hyprland did not reload every window" << std::endl;
+  }
+
+  static fs::path path() {
+    return file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
+                                      ".config/ghostty/themes/hoshimi");
   }
 
+  GhosttyWriter() : GhosttyWriter(ColorsHandler().getColors()) {}
+  GhosttyWriter(const Colorscheme &colors)
+      : colors(colors), writer(path(), FileType::VALUE_PAIR) {}
+
   bool writeConfig() {
     bool exitCode = true;
 
@@ -1082,10 +961,22 @@ public:
                                colors.activeColor.toHex(), exitCode);
 
     for (int i = 0; i < 16; ++i) {
-      writer.replaceValue("palette = " + std::to_string(i),
-                          colors.palette[i].toHex(), nullptr);
+      writer.replaceValue("palette[" + std::to_string(i) + "]",
+                          colors.palette[i].toHex());
     }
 
+    Palette256 extended(colors);
+    std::string missing;
+    for (int i = 16; i < 256; ++i) {
+      std::string hex = extended[i].toHex();
+      writer.replaceOrCollect("palette[" + std::to_string(i) + "]", hex,
+                              "palette = " + std::to_string(i) + "=" + hex +
+                                  "\n",
+                              missing);
+    }
+    if (!missing.empty())
+      writer.insertAfter("palette[15]", missing);
+
     if (!writer.write()) {
       exitCode = false;
 
@@ -1096,9 +987,8 @@ public:
 
     if (!exitCode)
       writer.revert();
-    else {
-      reloadGhostty();
-    }
+    else
+      CommitBatch::whenCommitted(reloadGhostty);
 
     return exitCode;
   }
@@ -1111,38 +1001,49 @@ private:
   WriterBase writer;
 
 public:
-  FootWriter() {
-    colors = ColorsHandler().getColors();
-    writer =
-        WriterBase(file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
-                                              ".config/foot/foot.ini"),
-                   FileType::VALUE_PAIR);
+  static fs::path path() {
+    return file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
+                                      ".config/foot/foot.ini");
   }
 
+  FootWriter() : FootWriter(ColorsHandler().getColors()) {}
+  FootWriter(const Colorscheme &colors)
+      : colors(colors), writer(path(), FileType::VALUE_PAIR) {}
+
   bool writeConfig() {
     bool exitCode = true;
 
+    // Keys of the [colors] section
     writer.replaceWithChecking(
-        "background", colors.backgroundColor.toHex(Color::FLAGS::NHASH),
+        "colors.background", colors.backgroundColor.toHex(Color::FLAGS::NHASH),
         exitCode);
     writer.replaceWithChecking(
-        "foreground", colors.foregroundColor.toHex(Color::FLAGS::NHASH),
+        "colors.foreground", colors.foregroundColor.toHex(Color::FLAGS::NHASH),
         exitCode);
     writer.replaceWithChecking(
-        "selection-background",
+        "colors.selection-background",
         colors.foregroundColor.toHex(Color::FLAGS::NHASH), exitCode);
     for (int i = 0; i < 8; ++i) {
-      writer.replaceWithChecking("regular" + std::to_string(i),
+      writer.replaceWithChecking("colors.regular" + std::to_string(i),
                                  colors.palette[i].toHex(Color::FLAGS::NHASH),
                                  exitCode);
     }
-    writer.append("\n");
     for (int i = 8; i < 16; ++i) {
-      writer.replaceWithChecking("bright" + std::to_string(i - 8),
+      writer.replaceWithChecking("colors.bright" + std::to_string(i - 8),
                                  colors.palette[i].toHex(Color::FLAGS::NHASH),
                                  exitCode);
     }
 
+    Palette256 extended(colors);
+    std::string missing;
+    for (int i = 16; i < 256; ++i) {
+      std::string hex = extended[i].toHex(Color::FLAGS::NHASH);
+      writer.replaceOrCollect("colors." + std::to_string(i), hex,
+                              std::to_string(i) + "=" + hex + "\n", missing);
+    }
+    if (!missing.empty())
+      writer.insertAfter("colors.bright7", missing);
+
     if (!writer.write()) {
       HERR("Config " + writer.getFile().string())
           << hoshimi_error_strerror(init_err(2, writer.getFile().c_str()))
@@ -1163,18 +1064,18 @@ private:
   WriterBase writer;
 
 public:
-  KittyWriter() {
-    colors = ColorsHandler().getColors();
-    writer =
-        WriterBase(file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
-                                              ".config/kitty/hoshimi.conf"),
-                   FileType::VALUE_PAIR);
+  static fs::path path() {
+    return file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
+                                      ".config/kitty/hoshimi.conf");
   }
 
-  void reloadKitty() {
-    // Send SIGUSR1 to kitty to reload config if running
-    system(
-        "if pgrep -x kitty > /dev/null; then kill -USR1 $(pgrep -x kitty); fi");
+  KittyWriter() : KittyWriter(ColorsHandler().getColors()) {}
+  KittyWriter(const Colorscheme &colors)
+      : colors(colors), writer(path(), FileType::VALUE_PAIR) {}
+
+  static void reloadKitty() {
+    // kitty reloads its config on SIGUSR1
+    ProcessTable::get().signal("kitty", SIGUSR1);
   }
 
   bool writeConfig() {
@@ -1195,6 +1096,16 @@ public:
                           colors.palette[i].toHex(), nullptr);
     }
 
+    Palette256 extended(colors);
+    std::string missing;
+    for (int i = 16; i < 256; ++i) {
+      std::string key = "color" + std::to_string(i);
+      std::string hex = extended[i].toHex();
+      writer.replaceOrCollect(key, hex, key + " " + hex + "\n", missing);
+    }
+    if (!missing.empty())
+      writer.insertAfter("color15", missing);
+
     if (!writer.write()) {
       exitCode = false;
       HERR("Config " + writer.getFile().string())
@@ -1205,7 +1116,7 @@ public:
     if (!exitCode)
       writer.revert();
     else
-      reloadKitty();
+      CommitBatch::whenCommitted(reloadKitty);
 
     return exitCode;
   }
@@ -1216,21 +1127,20 @@ private:
   Colorscheme colors;
   WriterBase writer;
 
-  fs::path getAlacrittyPath() {
+public:
+  static fs::path path() {
     return file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
                                       ".config/alacritty/themes/hoshimi.toml");
   }
 
-public:
-  AlacrittyWriter() {
-    writer = WriterBase(getAlacrittyPath(), FileType::VALUE_PAIR);
-    colors = ColorsHandler().getColors();
-  }
+  AlacrittyWriter() : AlacrittyWriter(ColorsHandler().getColors()) {}
+  AlacrittyWriter(const Colorscheme &colors)
+      : colors(colors), writer(path(), FileType::VALUE_PAIR) {}
 
-  void reloadAlacritty() { return; }
+  static void reloadAlacritty() { return; }
 
   bool writeConfig() {
-    fs::path path = getAlacrittyPath();
+    fs::path path = AlacrittyWriter::path();
 
     // Build the file contents
     writer.empty();
@@ -1270,6 +1180,16 @@ public:
     }
     writer.append("\n");
 
+    // The rest of the 256 colors
+    Palette256 extended(colors);
+    std::string indexed;
+    for (int i = 16; i < 256; ++i) {
+      indexed += "[[colors.indexed_colors]]\nindex = " + std::to_string(i) +
+                 "\ncolor = " + extended[i].toHex(Color::FLAGS::WQUOT) +
+                 "\n\n";
+    }
+    writer.append(indexed);
+
     // Write to file
     bool retVal = writer.write();
 
@@ -1279,12 +1199,16 @@ public:
       writer.revert();
       return false;
     }
-    reloadAlacritty();
+    CommitBatch::whenCommitted(reloadAlacritty);
     return retVal;
   }
 };
 
-class CustomWriter : public WriterBase {
+// Keeps the lines of a "writers" entry at the end of its file, below a marker
+// comment. The part above the marker belongs to the user and is never copied:
+// the marker is found by scanning the mapped file backwards, and only the tail
+// from the marker on is rewritten.
+class CustomWriter {
   ShellHandler::CustomWriter writer;
   std::string denoter;
 
@@ -1292,50 +1216,108 @@ class CustomWriter : public WriterBase {
 
   CommentType commentType;
 
-  void revertFile() {
-    std::istringstream stream(contents());
-    std::string line_content;
-    std::string updated_contents;
-
-    while (getline(stream, line_content)) {
-      if (Utils::endsWith(line_content, denoter)) {
-        break;
-      }
-      updated_contents += line_content + "\n";
-    }
-
+  std::string tail() const {
+    std::string contents;
     if (commentType == CommentType::LUA)
-      updated_contents += "-- ";
+      contents += "-- ";
     else if (commentType == CommentType::C_LIKE)
-      updated_contents += "// ";
+      contents += "// ";
     else if (commentType == CommentType::ASM_LIKE)
-      updated_contents += "# ";
-
-    updated_contents += denoter + "\n";
+      contents += "# ";
 
-    empty();
-    append(updated_contents);
+    contents += denoter + "\n";
+    for (const auto &line : writer.linesAdded)
+      contents += line + "\n";
+    return contents;
   }
 
-  void addContents() {
-    std::stringstream str;
-    std::copy(writer.linesAdded.begin(), writer.linesAdded.end(),
-              std::ostream_iterator<std::string>(str, "\n"));
-
-    append(str.str());
+  // Start of the last line ending with the marker, or -1
+  static off_t findMarker(const char *data, size_t size,
+                          const std::string &denoter) {
+    size_t end = size;
+    while (true) {
+      const char *newline = (const char *)memrchr(data, '\n', end);
+      size_t begin = newline ? newline - data + 1 : 0;
+      if (end - begin >= denoter.size() &&
+          memcmp(data + end - denoter.size(), denoter.data(),
+                 denoter.size()) == 0)
+        return begin;
+      if (!newline)
+        return -1;
+      end = newline - data;
+    }
   }
 
-  void writeContents() { write(); }
+  void error(const std::string &message) const {
+    HERR("Config " + writer.file.string()) << message << std::endl;
+  }
 
 public:
-  void writeFile() {
-    revertFile();
-    addContents();
-    write();
+  fs::path getFile() const { return writer.file; }
+
+  bool writeFile() {
+    std::string contents = tail();
+
+    int fd = open(writer.file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      if (errno != ENOENT) {
+        error(strerror(errno));
+        return false;
+      }
+      // A new file only holds the marker and the lines
+      WriterBase created;
+      created.append(contents);
+      return created.write(writer.file);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      error(strerror(errno));
+      close(fd);
+      return false;
+    }
+
+    off_t offset = st.st_size;
+    bool unchanged = false;
+    if (st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        error(strerror(errno));
+        close(fd);
+        return false;
+      }
+      const char *data = (const char *)map;
+
+      off_t marker = findMarker(data, st.st_size, denoter);
+      if (marker >= 0)
+        offset = marker;
+      else if (data[st.st_size - 1] != '\n')
+        contents = "\n" + contents;
+
+      unchanged = (size_t)(st.st_size - offset) == contents.size() &&
+                  memcmp(data + offset, contents.data(), contents.size()) == 0;
+      munmap(map, st.st_size);
+    }
+    close(fd);
+
+    if (unchanged && !CommitBatch::capturing())
+      return true;
+
+    if (CommitBatch *batch = CommitBatch::active()) {
+      batch->stageTail(writer.file, offset, std::move(contents), st);
+      return true;
+    }
+    if (!CommitBatch::writeTail(writer.file, offset, contents, st)) {
+      char *err = hoshimi_error_strerror(init_err(2, writer.file.c_str()));
+      error(err);
+      free(err);
+      return false;
+    }
+    return true;
   }
 
   CustomWriter(ShellHandler::CustomWriter writer, std::string denoter)
-      : WriterBase(writer.file), writer(writer), denoter(std::move(denoter)) {
+      : writer(writer), denoter(std::move(denoter)) {
     if (Utils::endsWith(writer.file, ".lua"))
       commentType = CommentType::LUA;
     else if (Utils::endsWith(writer.file, ".qml"))
@@ -1350,17 +1332,111 @@ private:
   std::vector<CustomWriter> writers;
 
 public:
-  CustomWriters() {
-    auto tmpWriters = ShellHandler().getConfig().writers;
-
+  CustomWriters() : CustomWriters(ShellHandler().getConfig().writers) {}
+  CustomWriters(const std::vector<ShellHandler::CustomWriter> &tmpWriters) {
     for (size_t i = 0; i < tmpWriters.size(); ++i)
       writers.push_back(CustomWriter(tmpWriters[i], "Written by hoshimi"));
   }
 
-  void allWrite() {
-    for (size_t i = 0; i < writers.size(); ++i) {
-      writers[i].writeFile();
+  // Targets are independent files, so they are updated in parallel
+  bool allWrite() {
+    Scheduler scheduler;
+    for (auto &writer : writers)
+      scheduler.add(writer.getFile().string(),
+                    [&writer]() { return writer.writeFile(); });
+    return scheduler.run() == 0;
+  }
+};
+
+// Renders the theme's "templates" entries, each one a template file compiled
+// by TemplateCache and the file it is rendered into.
+class TemplateWriters {
+private:
+  Colorscheme colors;
+  std::vector<ShellHandler::TemplateTarget> targets;
+
+public:
+  TemplateWriters()
+      : TemplateWriters(ColorsHandler().getColors(),
+                        ShellHandler().getConfig().templates) {}
+  TemplateWriters(const Colorscheme &colors,
+                  const std::vector<ShellHandler::TemplateTarget> &targets)
+      : colors(colors), targets(targets) {}
+
+  bool writeAll() {
+    bool exitCode = true;
+
+    for (const auto &target : targets) {
+      Template compiled;
+      if (!TemplateCache::load(target.templateFile, compiled)) {
+        exitCode = false;
+        continue;
+      }
+
+      std::error_code ec;
+      fs::create_directories(target.file.parent_path(), ec);
+
+      WriterBase writer;
+      writer.append(compiled.render(colors));
+      if (!writer.write(target.file))
+        exitCode = false;
     }
+
+    return exitCode;
+  }
+};
+
+// Pushes the border colors straight into a running Hyprland, so they change
+// without the compositor re-parsing its whole config. Nothing is written to
+// disk; the keywords are sent in one batch once the rest of the theme is
+// committed.
+class HyprlandWriter {
+private:
+  Colorscheme colors;
+  Hyprland hyprland;
+
+  static std::string color(const Color &color) {
+    return "rgb(" + color.toHex(Color::FLAGS::NHASH) + ")";
+  }
+
+public:
+  HyprlandWriter(const Colorscheme &colors, Hyprland hyprland = Hyprland())
+      : colors(colors), hyprland(std::move(hyprland)) {}
+
+  // The border options and whether each takes the active color (or the
+  // inactive one)
+  static const std::vector<std::pair<std::string, bool>> &borders() {
+    static const std::vector<std::pair<std::string, bool>> options = {
+        {"general:col.active_border", true},
+        {"general:col.inactive_border", false},
+        {"group:col.border_active", true},
+        {"group:col.border_inactive", false},
+        {"group:groupbar:col.active", true},
+        {"group:groupbar:col.inactive", false},
+    };
+    return options;
+  }
+
+  std::vector<std::string> keywords() const {
+    const std::string active = color(colors.activeColor);
+    const std::string inactive = color(colors.borderColor);
+    std::vector<std::string> out;
+    for (const auto &[option, isActive] : borders())
+      out.push_back("keyword " + option + " " + (isActive ? active : inactive));
+    return out;
+  }
+
+  bool writeColors() {
+    // Not running under Hyprland is not an error, there is just nothing to
+    // recolor
+    if (!hyprland.available())
+      return true;
+
+    CommitBatch::whenCommitted([hyprland = hyprland, keywords = keywords()]() {
+      if (!hyprland.batch(keywords))
+        HERR("hyprland") << "Failed to set the border colors" << std::endl;
+    });
+    return true;
   }
 };
 
@@ -1370,12 +1446,14 @@ private:
   WriterBase *themeWriter;
 
 public:
-  EquibopWriter() {
-    colors = ColorsHandler().getColors();
-    themeWriter = new WriterBase(
-        file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
-                                   ".config/equibop/themes/gliss.theme.css"),
-        FileType::CSS);
+  static fs::path path() {
+    return file_t::findHomeEquivilent(file_t::getdotfilesDirectory() /
+                                      ".config/equibop/themes/gliss.theme.css");
+  }
+
+  EquibopWriter() : EquibopWriter(ColorsHandler().getColors()) {}
+  EquibopWriter(const Colorscheme &colors) : colors(colors) {
+    themeWriter = new WriterBase(path(), FileType::CSS);
   }
 
   ~EquibopWriter() { delete themeWriter; }
@@ -0,0 +1,349 @@
+#pragma once
+
+#include "common/json/json.hpp"
+#include "common/utils/utils.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <functional>
+#include <grp.h>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <pwd.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Runs a job (a source or an install) for many user homes at once, for
+// machines shared by many users.
+//
+// Every home gets its own forked child: the child points HOME and the XDG
+// directories at the home, takes on the uid and gid of the home's owner when
+// started as root, and moves into the home, so everything hoshimi finds
+// through the environment is that user's and everything it writes is owned by
+// them. At most `jobs` children run at once, one per core by default.
+//
+// Before any child starts, every home's theme is loaded once in this process
+// with the ThemeCache on, so the children inherit the merged themes and homes
+// sharing theme files only merge them once. As root, each home is loaded with
+// its owner's ids, and the cache only hands a child a theme whose files it
+// can read itself. Nothing here may touch FilesManager, whose paths are
+// resolved once per process and would then be inherited by every child.
+class Fleet {
+public:
+  struct Home {
+    fs::path path;
+    std::string user;
+    uid_t uid = 0;
+    gid_t gid = 0;
+  };
+
+  struct Result {
+    Home home;
+    // Why the job could not be started, empty if it was
+    std::string error;
+    int exitCode = -1;
+    long wallMs = 0;
+    long cpuMs = 0;
+    std::string output;
+
+    bool ok() const { return error.empty() && exitCode == 0; }
+  };
+
+  // The home's owner, from the directory itself
+  static bool resolve(const fs::path &path, Home &home, std::string &error) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      error = "not a directory";
+      return false;
+    }
+    if (geteuid() != 0 && st.st_uid != geteuid()) {
+      error = "owned by someone else, only root can write as them";
+      return false;
+    }
+
+    home.path = fs::absolute(path).lexically_normal();
+    home.uid = st.st_uid;
+    home.gid = st.st_gid;
+    struct passwd *pw = getpwuid(st.st_uid);
+    home.user = pw ? pw->pw_name : std::to_string(st.st_uid);
+    if (pw)
+      home.gid = pw->pw_gid;
+    return true;
+  }
+
+  explicit Fleet(std::vector<Home> homes,
+                 size_t jobs = std::thread::hardware_concurrency())
+      : homes(std::move(homes)), jobs(std::max(jobs, (size_t)1)) {}
+
+  // Load every home's theme into the cache, returns how many distinct themes
+  // that took
+  size_t warm() {
+    ThemeCache::get().enabled = true;
+    for (const Home &home : homes) {
+      // As root, a home's theme is read with its owner's ids, or a link in
+      // the home could hand the child a file only root may read
+      Credentials saved;
+      if (!saved.become(home))
+        continue;
+      Environment env = Environment::save();
+      enterEnvironment(home);
+      try {
+        ColorsHandler colors;
+      } catch (const std::exception &) {
+        // The child runs into the same error and reports it
+      }
+      env.restore();
+      if (!saved.restore()) {
+        // Carrying on with another user's ids would be worse than no cache
+        HERR("fleet") << "Could not switch back from " << home.user << ": "
+                      << strerror(errno) << std::endl;
+        _exit(1);
+      }
+    }
+    return ThemeCache::get().size();
+  }
+
+  std::vector<Result> run(const std::function<int()> &job) {
+    std::vector<Result> results(homes.size());
+    std::map<pid_t, size_t> running;
+    std::vector<int> outputs(homes.size(), -1);
+    std::vector<std::chrono::steady_clock::time_point> started(homes.size());
+
+    // Whatever is still buffered would be written once by every child
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(nullptr);
+
+    size_t next = 0;
+    while (next < homes.size() || !running.empty()) {
+      while (next < homes.size() && running.size() < jobs) {
+        size_t i = next++;
+        results[i].home = homes[i];
+
+        // Output goes to an anonymous file, read once the child is done
+        int output = memfd_create("hoshimi-fleet", MFD_CLOEXEC);
+        if (output < 0) {
+          results[i].error = std::string("memfd_create: ") + strerror(errno);
+          continue;
+        }
+
+        started[i] = std::chrono::steady_clock::now();
+        pid_t pid = fork();
+        if (pid < 0) {
+          results[i].error = std::string("fork: ") + strerror(errno);
+          close(output);
+          continue;
+        }
+        if (pid == 0) {
+          dup2(output, STDOUT_FILENO);
+          dup2(output, STDERR_FILENO);
+          std::string error;
+          if (!enter(homes[i], error)) {
+            std::cerr << "hoshimi fleet: " << error << std::endl;
+            _exit(125);
+          }
+          int code = job();
+          std::cout.flush();
+          std::cerr.flush();
+          fflush(nullptr);
+          _exit(code);
+        }
+
+        outputs[i] = output;
+        running[pid] = i;
+      }
+
+      if (running.empty())
+        continue;
+
+      int status = 0;
+      struct rusage usage {};
+      pid_t pid = wait4(-1, &status, 0, &usage);
+      if (pid < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      auto it = running.find(pid);
+      if (it == running.end())
+        continue;
+
+      Result &result = results[it->second];
+      result.wallMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::steady_clock::now() -
+                          started[it->second])
+                          .count();
+      result.cpuMs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000 +
+                     (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+      result.exitCode = WIFEXITED(status) ? WEXITSTATUS(status)
+                                          : 128 + WTERMSIG(status);
+      result.output = readAll(outputs[it->second]);
+      close(outputs[it->second]);
+      running.erase(it);
+    }
+
+    return results;
+  }
+
+  static void printSummary(const std::vector<Result> &results,
+                           std::ostream &out) {
+    size_t width = 4;
+    for (const Result &result : results)
+      width = std::max(width, result.home.path.string().size());
+
+    out << std::left << std::setw(width + 2) << "HOME" << std::setw(14)
+        << "USER" << std::setw(10) << "RESULT" << std::setw(10) << "TIME"
+        << "CPU" << std::endl;
+    for (const Result &result : results) {
+      std::string status = !result.error.empty() ? "failed"
+                           : result.exitCode == 0
+                               ? "ok"
+                               : "exit " + std::to_string(result.exitCode);
+      out << std::left << std::setw(width + 2) << result.home.path.string()
+          << std::setw(14) << result.home.user << std::setw(10) << status
+          << std::setw(10) << (std::to_string(result.wallMs) + " ms")
+          << result.cpuMs << " ms" << std::endl;
+      if (!result.error.empty())
+        out << "  " << result.error << std::endl;
+    }
+  }
+
+private:
+  std::vector<Home> homes;
+  size_t jobs;
+
+  // The effective ids and groups of a root process, to take on a home
+  // owner's for a while in warm(). Without root nothing changes.
+  struct Credentials {
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
+    std::vector<gid_t> groups;
+    bool switched = false;
+
+    bool become(const Home &home) {
+      if (uid != 0 || home.uid == 0)
+        return true;
+      int n = getgroups(0, nullptr);
+      groups.resize(n > 0 ? n : 0);
+      if (n < 0 || getgroups(n, groups.data()) != n)
+        return false;
+
+      switched = true;
+      if (initgroups(home.user.c_str(), home.gid) == 0 &&
+          setegid(home.gid) == 0 && seteuid(home.uid) == 0)
+        return true;
+      restore();
+      return false;
+    }
+
+    bool restore() {
+      if (!switched)
+        return true;
+      switched = false;
+      return seteuid(uid) == 0 && setegid(gid) == 0 &&
+             setgroups(groups.size(), groups.data()) == 0;
+    }
+  };
+
+  // The variables a home's environment changes, to undo it after warm()
+  struct Environment {
+    std::vector<std::pair<std::string, std::string>> set;
+    std::vector<std::string> unset;
+
+    static Environment save() {
+      Environment saved;
+      for (const char *name : variables()) {
+        const char *value = getenv(name);
+        if (value)
+          saved.set.push_back({name, value});
+        else
+          saved.unset.push_back(name);
+      }
+      return saved;
+    }
+
+    void restore() const {
+      for (const auto &[name, value] : set)
+        setenv(name.c_str(), value.c_str(), 1);
+      for (const auto &name : unset)
+        unsetenv(name.c_str());
+    }
+  };
+
+  static const std::vector<const char *> &variables() {
+    static const std::vector<const char *> names = {
+        "HOME",           "USER",           "LOGNAME",
+        "XDG_CONFIG_HOME", "XDG_DATA_HOME",  "XDG_STATE_HOME",
+        "XDG_CACHE_HOME",  "XDG_RUNTIME_DIR", "HYPRLAND_INSTANCE_SIGNATURE",
+        "WAYLAND_DISPLAY", "DISPLAY"};
+    return names;
+  }
+
+  // The home's own paths, and nothing of the session hoshimi was started in:
+  // another user's compositor and terminals are not ours to reload
+  static void enterEnvironment(const Home &home) {
+    setenv("HOME", home.path.c_str(), 1);
+    setenv("USER", home.user.c_str(), 1);
+    setenv("LOGNAME", home.user.c_str(), 1);
+    for (const char *name :
+         {"XDG_CONFIG_HOME", "XDG_DATA_HOME", "XDG_STATE_HOME",
+          "XDG_CACHE_HOME", "HYPRLAND_INSTANCE_SIGNATURE", "WAYLAND_DISPLAY",
+          "DISPLAY"})
+      unsetenv(name);
+
+    const std::string runtime = "/run/user/" + std::to_string(home.uid);
+    std::error_code ec;
+    if (fs::is_directory(runtime, ec))
+      setenv("XDG_RUNTIME_DIR", runtime.c_str(), 1);
+    else
+      unsetenv("XDG_RUNTIME_DIR");
+  }
+
+  // In the child: become the home's owner and move into the home
+  static bool enter(const Home &home, std::string &error) {
+    enterEnvironment(home);
+
+    if (geteuid() == 0 && home.uid != 0) {
+      if (initgroups(home.user.c_str(), home.gid) != 0 ||
+          setgid(home.gid) != 0 || setuid(home.uid) != 0) {
+        error = "could not switch to " + home.user + ": " + strerror(errno);
+        return false;
+      }
+    }
+
+    if (chdir(home.path.c_str()) != 0) {
+      error = "could not enter " + home.path.string() + ": " + strerror(errno);
+      return false;
+    }
+    return true;
+  }
+
+  static std::string readAll(int fd) {
+    std::string out;
+    if (lseek(fd, 0, SEEK_SET) < 0)
+      return out;
+    char buffer[8192];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+      if (n > 0)
+        out.append(buffer, n);
+    }
+    return out;
+  }
+};
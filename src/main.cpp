@@ -1,9 +1,21 @@
+#include "common/quickshell.hpp"
+#include "common/sharedpalette.hpp"
+#include "common/terminals.hpp"
+#include "common/utils/process.hpp"
+#include "common/utils/scheduler.hpp"
 #include "common/utils/utils.hpp"
 #include "files.hpp"
+#include "fleet.hpp"
 #include "osu/osu.h"
+#include "prerender.hpp"
+#include "stages.hpp"
+#include "transition.hpp"
 #include "version.h"
 #include <algorithm>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -13,6 +25,7 @@ std::vector<std::string> packages;
 std::vector<std::string> notPackages;
 int commandsRun = 0;
 int maxFollowupCommands;
+std::string transitionDuration;
 
 struct Flag {
   bool present;
@@ -38,7 +51,11 @@ enum Flags {
   PACKAGES,
   NOT_PACKAGES,
   NO_COMMANDS,
-  MAX_COMMANDS
+  MAX_COMMANDS,
+  SYNC,
+  LIVE_TERMINALS,
+  DURATION,
+  HOMES
 };
 
 void print_help(const std::string &program_name,
@@ -63,6 +80,12 @@ void print_help(const std::string &program_name,
   std::cout << "    source        Source the current configuration, updating "
                "the modifiable dotfiles \n";
   std::cout << "    restart       (re)start the shell and reload terminals. \n";
+  std::cout << "    transition    Fade the running desktop into another theme, "
+               "then source it\n";
+  std::cout << "    fleet         Source or install for many user homes at "
+               "once\n";
+  std::cout << "    prerender     Render themes ahead of time so switching to "
+               "them is instant\n";
   std::cout << "    osugen    generate osu items needed for the race. \n\n";
 
   std::cout << "OPTIONS:\n";
@@ -81,6 +104,14 @@ void print_help(const std::string &program_name,
                "commands\n";
   std::cout << "    --max-followup-commands                 Maximum number of "
                "followup commands before the program terminates\n";
+  std::cout << "    --sync                                  Flush the sourced "
+               "files to disk before running followup commands\n";
+  std::cout << "    --live-terminals                        Recolor every "
+               "open terminal when sourcing\n";
+  std::cout << "    --duration <600ms>                      How long a "
+               "transition takes, in ms or s\n";
+  std::cout << "    --homes <dir> [dir...]                  The homes a fleet "
+               "command works on\n";
   std::cout << "    --version                               Show version "
                "information\n\n";
 
@@ -93,11 +124,23 @@ void print_help(const std::string &program_name,
   std::cout << "    " + program_name +
                    " config config set catppuccin/latte -np foot "
                    "--max-followup-commands 3\n";
+  std::cout << "    " + program_name +
+                   " transition catppuccin/mocha --duration 600ms\n";
+  std::cout << "    " + program_name + " fleet --homes /home/* source\n";
+  std::cout << "    " + program_name + " prerender --all\n";
 
   std::cout << "Subcommands have their own help" << std::endl;
 }
 
-void restart(std::vector<Flag> &config);
+int restart(std::vector<Flag> &config);
+
+int transition(std::vector<Flag> &config, const std::string &theme);
+
+int fleet(std::vector<Flag> &config, int argc, char *argv[]);
+
+int prerender(std::vector<Flag> &config, int argc, char *argv[]);
+
+int installDotfiles(std::vector<Flag> &config);
 
 int archInstall(std::vector<Flag> &config, bool &retFlag);
 
@@ -106,7 +149,10 @@ void getPackageInfo(int argc, std::vector<Flag> &config, char *argv[]);
 void getConfigArg(int argc, char *argv[], bool &setB, std::string &configArg,
                   std::vector<std::string> &vec);
 
-void sourceConfig(std::vector<Flag> config);
+bool sourceConfig(std::vector<Flag> config);
+
+void runCommands(const std::vector<ShellHandler::Command> &commands,
+                 const std::vector<Flag> &config);
 
 int main(int argc, char *argv[]) {
   HDBG("Utils") << "ass" << std::endl;
@@ -123,7 +169,12 @@ int main(int argc, char *argv[]) {
       Flag(false, {"--no-secondary-commands"},
            "Don't show the secondnary commands"),
       Flag(false, {"--max-followup-commands"},
-           "Maximum number of followup commands to run")};
+           "Maximum number of followup commands to run"),
+      Flag(false, {"--sync"}, "Flush the sourced files to disk"),
+      Flag(false, {"--live-terminals"},
+           "Recolor open terminals after sourcing"),
+      Flag(false, {"--duration"}, "How long a transition takes"),
+      Flag(false, {"--homes"}, "The homes a fleet command works on")};
 
   // Check if we have enough arguments
   if (argc < 2) {
@@ -132,6 +183,7 @@ int main(int argc, char *argv[]) {
   }
 
   getPackageInfo(argc, config, argv);
+  Process::verbose = config[VERBOSE].present;
   std::string command = argv[1];
 
   if (command == "install") {
@@ -161,18 +213,7 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
-    if (filesManager.install_dotfiles(packages, notPackages,
-                                      config[VERBOSE].present,
-                                      config[PACKAGES].present) != 0)
-      return 1;
-
-    if (!config[NO_COMMANDS].present)
-      sourceConfig(config);
-
-    std::cout << std::endl << "Hoshimi Dotfiles installed ";
-    if (!config[FORCE].present)
-      std::cout << "and files backed up";
-    std::cout << "." << std::endl;
+    return installDotfiles(config);
   } else if (command == "update") {
     commandsRun++;
     FilesManager filesManager;
@@ -193,9 +234,11 @@ int main(int argc, char *argv[]) {
     std::filesystem::path HOSHIMI_HOME =
         filesManager.getdotfilesDirectory().parent_path();
 
-    const std::string UPDATE_COMMAND =
-        "cd " + HOSHIMI_HOME.string() + " && git pull";
-    if (system(UPDATE_COMMAND.c_str()) == 0) {
+    Process::Options options;
+    options.output = Process::INHERIT;
+    Process::Result result;
+    if (Process::run({"git", "-C", HOSHIMI_HOME.string(), "pull"}, result,
+                     options)) {
       return 0;
     } else {
       std::cout << "Hoshimi failed to update. Check if the directory "
@@ -211,6 +254,9 @@ int main(int argc, char *argv[]) {
       std::cout << "You can specify which packages to source with the "
                    "-p/--packages and -np/--not-packages flags."
                 << std::endl;
+      std::cout << "Only the parts whose inputs changed since the last source "
+                   "are redone, use -f/--force to redo everything."
+                << std::endl;
       std::cout << "Use '" << argv[0]
                 << " help' to see all available commands and options."
                 << std::endl;
@@ -303,7 +349,58 @@ int main(int argc, char *argv[]) {
       return 0;
     }
 
-    restart(config);
+    return restart(config);
+  } else if (command == "transition") {
+    if (config[HELP].present || argc < 3 || argv[2][0] == '-') {
+      std::cout << "Usage: " << argv[0]
+                << " transition <theme> [--duration 600ms]" << std::endl;
+      std::cout << "Fades the open terminals, Hyprland's borders and "
+                   "Quickshell into the theme, then makes it the configured "
+                   "theme and sources it."
+                << std::endl;
+      std::cout << "Use '" << argv[0]
+                << " help' to see all available commands and options."
+                << std::endl;
+      return config[HELP].present ? 0 : 1;
+    }
+
+    return transition(config, argv[2]);
+  } else if (command == "fleet") {
+    if (config[HELP].present) {
+      std::cout << "Usage: " << argv[0]
+                << " fleet --homes <dir> [dir...] <source|install> [options]"
+                << std::endl;
+      std::cout << "Sources or installs for every home at once, as the "
+                   "home's owner when run as root, and prints a summary."
+                << std::endl;
+      std::cout << "Homes that use the same theme files share one resolved "
+                   "theme."
+                << std::endl;
+      std::cout << "Use '" << argv[0]
+                << " help' to see all available commands and options."
+                << std::endl;
+      return 0;
+    }
+
+    return fleet(config, argc, argv);
+  } else if (command == "prerender") {
+    if (config[HELP].present) {
+      std::cout << "Usage: " << argv[0] << " prerender <--all|theme...>"
+                << std::endl;
+      std::cout << "Renders the files source writes as a whole, and the osu "
+                   "assets, for the themes into a store. Setting the theme to "
+                   "one of them then only links those files into place."
+                << std::endl;
+      std::cout << "Files edited since are rendered as usual, prerender "
+                   "again to bring them back into the store."
+                << std::endl;
+      std::cout << "Use '" << argv[0]
+                << " help' to see all available commands and options."
+                << std::endl;
+      return 0;
+    }
+
+    return prerender(config, argc, argv);
   } else if (command == "osugen") {
     commandsRun++;
 
@@ -340,113 +437,314 @@ int main(int argc, char *argv[]) {
   }
 }
 
-void sourceConfig(std::vector<Flag> config) {
+bool shouldSource(const std::string &package, const std::vector<Flag> &config) {
+  if (config[PACKAGES].present)
+    return std::find(packages.begin(), packages.end(), package) !=
+           packages.end();
+  if (config[NOT_PACKAGES].present)
+    return std::find(notPackages.begin(), notPackages.end(), package) ==
+           notPackages.end();
+  return true;
+}
+
+std::function<bool()> stageJob(const std::string &name,
+                               const Colorscheme &colors,
+                               const ShellHandler::Config &shellConfig,
+                               Config *&osuConfig) {
+  if (name == "ghostty") {
+    auto gs = std::make_shared<GhosttyWriter>(colors);
+    return [gs]() { return gs->writeConfig(); };
+  } else if (name == "foot") {
+    auto ft = std::make_shared<FootWriter>(colors);
+    return [ft]() { return ft->writeConfig(); };
+  } else if (name == "alacritty") {
+    auto as = std::make_shared<AlacrittyWriter>(colors);
+    return [as]() { return as->writeConfig(); };
+  } else if (name == "quickshell-colors") {
+    auto qs = std::make_shared<QuickshellWriter>(colors, shellConfig);
+    return [qs]() { return qs->writeColors(); };
+  } else if (name == "quickshell-shell") {
+    auto qs = std::make_shared<QuickshellWriter>(colors, shellConfig);
+    return [qs]() { return qs->writeShell(); };
+  } else if (name == "equibop") {
+    auto eq = std::make_shared<EquibopWriter>(colors);
+    return [eq]() { return eq->writeColors(); };
+  } else if (name == "hyprland") {
+    auto hs = std::make_shared<HyprlandWriter>(colors);
+    return [hs]() { return hs->writeColors(); };
+  } else if (name == "custom") {
+    auto cs = std::make_shared<CustomWriters>(shellConfig.writers);
+    return [cs]() { return cs->allWrite(); };
+  } else if (name == "templates") {
+    auto ts = std::make_shared<TemplateWriters>(colors, shellConfig.templates);
+    return [ts]() { return ts->writeAll(); };
+  } else if (name == "osu-circles" || name == "osu-sounds") {
+    // Both osu stages share one loaded config, and the skin is unpacked into
+    // osu/ once, before anything runs
+    if (!osuConfig) {
+      osuConfig = load_config();
+      ShellHandler::extractOsuSkin(shellConfig.osuSkin);
+    }
+    Config *c = osuConfig;
+    if (name == "osu-circles")
+      return [c]() { return c && generateCircles(c) == 0; };
+    return [c]() { return c && generateSounds(c) == 0; };
+  }
+
+  HERR("source") << "Unknown stage " << name << std::endl;
+  return []() { return false; };
+}
+
+// What a stage's writer does once its files are in place, for stages that
+// are switched to prerendered files instead of being run
+std::function<void()> stageReload(const std::string &name) {
+  if (name == "ghostty")
+    return GhosttyWriter::reloadGhostty;
+  if (name == "alacritty")
+    return AlacrittyWriter::reloadAlacritty;
+  return nullptr;
+}
+
+bool sourceConfig(std::vector<Flag> config) {
   commandsRun++;
 
   if (commandsRun > maxFollowupCommands && config[MAX_COMMANDS].present) {
     HLOG("Program") << "Max number of commands run, stopping before sourcing"
                     << std::endl;
-    return;
-  }
-
-  if (config[PACKAGES].present) {
-    for (size_t i = 0; i < packages.size(); ++i) {
-      if (packages[i] == "ghostty") {
-        GhosttyWriter().writeConfig();
-      } else if (packages[i] == "quickshell") {
-        genOsu(nullptr);
-        Utils::destroyOsuDir(NULL);
-        QuickshellWriter qs;
-        qs.writeColors();
-        qs.writeShell();
-      } else if (packages[i] == "alacritty") {
-        AlacrittyWriter().writeConfig();
-      } else if (packages[i] == "foot") {
-        FootWriter().writeConfig();
-      } else if (packages[i] == "custom") {
-        CustomWriters().allWrite();
-      } else if (packages[i] == "equibop") {
-        EquibopWriter().writeColors();
-      }
-    }
-  } else if (config[NOT_PACKAGES].present) {
-    if (std::find(notPackages.begin(), notPackages.end(), "ghostty") ==
-        notPackages.end()) {
-      GhosttyWriter().writeConfig();
-    }
-    if (std::find(notPackages.begin(), notPackages.end(), "quickshell") ==
-        notPackages.end()) {
-      QuickshellWriter *qs = new QuickshellWriter();
-      genOsu(nullptr);
-      Utils::destroyOsuDir(NULL);
-      qs->writeColors();
-      qs->writeShell();
-      delete qs;
-    }
-    if (std::find(notPackages.begin(), notPackages.end(), "alacritty") ==
-        notPackages.end()) {
-      AlacrittyWriter().writeConfig();
-    }
-    if (std::find(notPackages.begin(), notPackages.end(), "foot") ==
-        notPackages.end()) {
-      FootWriter().writeConfig();
-    }
-    if (std::find(notPackages.begin(), notPackages.end(), "custom") ==
-        notPackages.end()) {
-      CustomWriters().allWrite();
+    return true;
+  }
+
+  // The configuration is resolved once, here, and handed to every stage. The
+  // writers touch disjoint files, so the stages then run concurrently.
+  ShellHandler shell;
+  const ShellHandler::Config shellConfig = shell.getConfig();
+  ColorsHandler colorsHandler;
+  const Colorscheme colors = colorsHandler.getColors();
+  if (config[VERBOSE].present) {
+    for (const auto &adjustment : colorsHandler.adjusted)
+      HLOG("contrast") << adjustment.role << " "
+                       << adjustment.before.toHex() << " -> "
+                       << adjustment.after.toHex() << ", contrast "
+                       << adjustment.contrastBefore << " -> "
+                       << adjustment.contrastAfter
+                       << (adjustment.met ? "" : " (target not reachable)")
+                       << std::endl;
+  }
+
+  SourceState state;
+  Scheduler scheduler;
+  CommitBatch batch;
+  std::vector<SourceStage> scheduled;
+  Config *osuConfig = nullptr;
+
+  // A theme that was prerendered is switched to by linking its files into
+  // place, stage by stage. Stages whose files can not be switched are run.
+  Prerendered prerendered, current;
+  const bool switching =
+      !config[FORCE].present &&
+      prerendered.load(Prerendered::manifestPath(shell.getThemeName())) &&
+      prerendered.inputs == Prerendered::inputsHash(shell, shellConfig);
+  if (switching)
+    current.load(Prerendered::currentPath());
+  std::vector<SourceStage> switched;
+
+  for (const auto &stage : sourceStages(shellConfig)) {
+    if (!shouldSource(stage.package, config))
+      continue;
+
+    if (!config[FORCE].present &&
+        state.unchanged(stage.name, state.inputHash(stage, shell))) {
+      if (config[VERBOSE].present)
+        HLOG("source") << stage.name << " is up to date, skipping."
+                       << std::endl;
+      continue;
     }
-    if (std::find(notPackages.begin(), notPackages.end(), "equibop") ==
-        notPackages.end()) {
-      EquibopWriter().writeColors();
+
+    int linked = switching ? prerendered.apply(stage.name, current, batch) : -1;
+    if (linked >= 0) {
+      if (config[VERBOSE].present)
+        HLOG("source") << stage.name << " switched to " << linked
+                       << " prerendered files." << std::endl;
+      if (auto reload = stageReload(stage.name); reload && linked > 0)
+        batch.afterCommit(reload);
+      switched.push_back(stage);
+      continue;
     }
-  } else {
-    GhosttyWriter *gs = new GhosttyWriter();
-    gs->writeConfig();
-    delete gs;
-    AlacrittyWriter *as = new AlacrittyWriter();
-    as->writeConfig();
-    delete as;
-    FootWriter *fs = new FootWriter();
-    fs->writeConfig();
-    delete fs;
-
-    QuickshellWriter *qs = new QuickshellWriter();
-    genOsu(nullptr);
-    Utils::destroyOsuDir(NULL);
-    qs->writeColors();
-    qs->writeShell();
-    delete qs;
 
-    CustomWriters *cs = new CustomWriters();
-    cs->allWrite();
-    delete cs;
+    scheduler.add(stage.name,
+                  stageJob(stage.name, colors, shellConfig, osuConfig));
+    scheduled.push_back(stage);
+  }
 
-    EquibopWriter *eq = new EquibopWriter();
-    eq->writeColors();
-    delete eq;
+  // The osu generators write into their files, which must not be links into
+  // the store left by a switch to a prerendered theme. Both stages write the
+  // same directory at the same time, so the links go before either runs.
+  if (osuConfig)
+    ContentStore::detach(osuConfig->downloadPath);
+
+  // Open terminals are recolored on every run that asks for it, there is no
+  // file to compare against
+  if (config[LIVE_TERMINALS].present) {
+    scheduler.add("live-terminals", [&colors, &config]() {
+      CommitBatch::whenCommitted([sequence = LiveTerminals::sequence(colors),
+                                  verbose = config[VERBOSE].present]() {
+        auto ptys = LiveTerminals::userPtys();
+        size_t sent = LiveTerminals::sendAll(ptys, sequence);
+        if (verbose)
+          HLOG("live-terminals") << "Recolored " << sent << " of "
+                                 << ptys.size() << " terminals." << std::endl;
+      });
+      return true;
+    });
   }
 
-  if (config[NO_COMMANDS].present)
-    return;
-  auto shellConfig = ShellHandler().getConfig();
+  // Writers only stage their output, nothing is written until every stage is
+  // done and the whole batch is committed. Stages stay independent as they
+  // were before the batch: one that fails, e.g. on a file it cannot parse,
+  // does not hold back the others. It is not recorded below, so it runs
+  // again on the next source.
+  CommitBatch::active() = &batch;
+  scheduler.run(config[VERBOSE].present);
+  CommitBatch::active() = nullptr;
+
+  const bool committed = batch.commit(config[SYNC].present);
+  if (!committed && batch.changedFiles().empty()) {
+    HERR("source") << "Failed to write the new theme, no files were changed."
+                   << std::endl;
+  } else if (!committed) {
+    HERR("source") << "Failed to write the new theme, and these files could "
+                      "not be put back:"
+                   << std::endl;
+    for (const auto &file : batch.changedFiles())
+      HERR("source") << file.string() << std::endl;
+  }
+
+  // The shared palette follows every source, whichever stages ran
+  SharedPalette palette;
+  if (committed && palette.open())
+    palette.publish(colors);
+  else if (committed)
+    HERR("source") << "Failed to publish the palette to "
+                   << SharedPalette::file() << std::endl;
+
+  // Inputs are hashed again after the run, the stages' own output files are
+  // among them
+  const auto &results = scheduler.results();
+  for (size_t i = 0; i < scheduled.size(); ++i) {
+    if (results[i]->ok && committed)
+      state.record(scheduled[i].name, state.inputHash(scheduled[i], shell));
+  }
+  if (committed && !switched.empty()) {
+    for (const auto &stage : switched) {
+      state.record(stage.name, state.inputHash(stage, shell));
+      current.stages[stage.name] = prerendered.stages[stage.name];
+    }
+    current.theme = prerendered.theme;
+    current.inputs = prerendered.inputs;
+    current.save(Prerendered::currentPath());
+  }
+  state.save();
+
+  if (osuConfig)
+    free_config(osuConfig);
   Utils::destroyOsuDir(NULL);
-  for (size_t i = 0; i < shellConfig.commands.size(); ++i) {
+
+  if (config[NO_COMMANDS].present)
+    return committed;
+
+  runCommands(shellConfig.commands, config);
+  return committed;
+}
+
+int installDotfiles(std::vector<Flag> &config) {
+  FilesManager filesManager;
+  if (filesManager.install_dotfiles(packages, notPackages,
+                                    config[VERBOSE].present,
+                                    config[PACKAGES].present) != 0)
+    return 1;
+
+  if (!config[NO_COMMANDS].present)
+    sourceConfig(config);
+
+  std::cout << std::endl << "Hoshimi Dotfiles installed ";
+  if (!config[FORCE].present)
+    std::cout << "and files backed up";
+  std::cout << "." << std::endl;
+  return 0;
+}
+
+// The theme's followup commands, each as its own child on the scheduler.
+// Commands only wait for the ones named in their "after", so unrelated
+// reloads overlap. Output is captured and printed per command.
+void runCommands(const std::vector<ShellHandler::Command> &commands,
+                 const std::vector<Flag> &config) {
+  // The budget is spent in the order the commands are listed, whatever order
+  // they end up running in
+  size_t allowed = 0;
+  for (; allowed < commands.size(); ++allowed) {
     commandsRun++;
 
     if (commandsRun > maxFollowupCommands && config[MAX_COMMANDS].present) {
       HLOG("Program")
           << "Max number of commands run, stopping before running comamnd: "
-          << shellConfig.commands[i] << std::endl;
-      return;
+          << commands[allowed].command << std::endl;
+      break;
     }
+  }
 
-    HLOG("main") << "Running command: " << shellConfig.commands[i] << std::endl;
-
-    if (system(shellConfig.commands[i].c_str()) != 0) {
-      HERR("main") << "\nFailed to run command: " << shellConfig.commands[i]
-                   << std::endl;
+  std::map<std::string, size_t> byName;
+  for (size_t i = 0; i < allowed; ++i)
+    byName.emplace(commands[i].name, i);
+
+  Scheduler scheduler;
+  for (size_t i = 0; i < allowed; ++i) {
+    const ShellHandler::Command &command = commands[i];
+
+    std::vector<size_t> after;
+    std::string missing;
+    for (const auto &dependency : command.after) {
+      auto it = byName.find(dependency);
+      if (it == byName.end() || it->second == i)
+        missing = dependency;
+      else
+        after.push_back(it->second);
     }
+
+    scheduler.add(command.name, [command, missing]() {
+      if (!missing.empty()) {
+        HERR("main") << "Not running " << command.command << ", '" << missing
+                     << "' is not a command that runs before it" << std::endl;
+        return false;
+      }
+
+      HLOG("main") << "Running command: " << command.command << std::endl;
+
+      // Only commands that use shell syntax pay for a shell
+      std::vector<std::string> argv;
+      if (!Process::words(command.command, argv))
+        argv = {"/bin/sh", "-c", command.command};
+
+      // Output goes to the job's log as it arrives
+      Process::Options options;
+      options.timeoutMs = (int)(command.timeout * 1000);
+      options.onOutput = [](const char *data, size_t size, bool error) {
+        (error ? Utils::errStream() : Utils::logStream()).write(data, size);
+      };
+
+      Process::Result result;
+      bool ok = Process::run(argv, result, options);
+
+      if (result.timedOut)
+        HERR("main") << "Command timed out after " << command.timeout
+                     << " s: " << command.command << std::endl;
+      else if (!ok)
+        HERR("main") << "\nFailed to run command: " << command.command
+                     << std::endl;
+      return ok;
+    }, after);
   }
+
+  scheduler.run(config[VERBOSE].present);
 }
 
 void getConfigArg(int argc, char *argv[], bool &setB, std::string &configArg,
@@ -490,7 +788,7 @@ void getPackageInfo(int argc, std::vector<Flag> &config, char *argv[]) {
     if (argc == 2)
       break;
     int packagesArgument = -1, noPackagesArgument = -1,
-        maxCommandsArgument = -1;
+        maxCommandsArgument = -1, durationArgument = -1;
 
     for (size_t j = 0; j < config.size(); ++j) {
       if (count(config[j].args.begin(), config[j].args.end(), argv[i])) {
@@ -501,6 +799,8 @@ void getPackageInfo(int argc, std::vector<Flag> &config, char *argv[]) {
           noPackagesArgument = ++i;
         else if (j == MAX_COMMANDS)
           maxCommandsArgument = ++i;
+        else if (j == DURATION)
+          durationArgument = ++i;
       }
     }
 
@@ -514,6 +814,8 @@ void getPackageInfo(int argc, std::vector<Flag> &config, char *argv[]) {
       std::stringstream strValue;
       strValue << argv[i];
       strValue >> maxFollowupCommands;
+    } else if (i == durationArgument) {
+      transitionDuration = argv[i];
     }
   }
 }
@@ -531,7 +833,7 @@ int archInstall(std::vector<Flag> &config, bool &retFlag) {
   retFlag = true;
   // Loop through all of the lnes in the lines of the file arch-packages
 
-  std::string packagesToInstall = "";
+  std::vector<std::string> packagesToInstall = {"paru", "-S"};
 
   std::string HOSHIMI_HOME;
 
@@ -562,7 +864,10 @@ int archInstall(std::vector<Flag> &config, bool &retFlag) {
 
   std::string s;
   while (getline(f, s)) {
-    packagesToInstall += s + " ";
+    std::vector<std::string> names;
+    if (Process::words(s, names))
+      packagesToInstall.insert(packagesToInstall.end(), names.begin(),
+                               names.end());
     if (config[0].present)
       std::cout << "Going to install: " << s << std::endl;
   }
@@ -570,17 +875,20 @@ int archInstall(std::vector<Flag> &config, bool &retFlag) {
   f.close();
 
   // Install the packages the packages
-  system(("paru -S " + packagesToInstall).c_str());
+  Process::Options options;
+  options.output = Process::INHERIT;
+  Process::Result result;
+  Process::run(packagesToInstall, result, options);
   retFlag = false;
   return {};
 }
 
-void restart(std::vector<Flag> &config) {
+int restart(std::vector<Flag> &config) {
   commandsRun++;
   if (commandsRun > maxFollowupCommands && config[MAX_COMMANDS].present) {
     HLOG("Program") << "Max number of commands run, stopping before restarting"
                     << std::endl;
-    return;
+    return 0;
   }
 
   if (!config[NO_COMMANDS].present)
@@ -596,14 +904,310 @@ void restart(std::vector<Flag> &config) {
     HLOG("Program")
         << "Max number nof commands run, stopping before generating osu items"
         << std::endl;
-    return;
+    return 0;
   }
 
   genOsu(nullptr);
   Utils::destroyOsuDir(NULL);
 
-  system("killall qs; \n "
-         "nohup  qs > /dev/null 2>&1 &");
+  QuickshellSupervisor::Status status = QuickshellSupervisor().restart();
+  if (!status.ready) {
+    HERR("main") << "Quickshell failed to restart: " << status.reason
+                 << std::endl;
+    return 1;
+  }
+
+  HLOG("main") << "Hoshimi restarted, Quickshell switched over in "
+               << status.milliseconds << " ms" << std::endl;
+  return 0;
+}
+
+// "600ms", "0.6s" or a plain number of milliseconds, -1 if it is none of those
+long parseDuration(const std::string &text) {
+  char *rest = nullptr;
+  double value = strtod(text.c_str(), &rest);
+  if (rest == text.c_str() || value < 0)
+    return -1;
+
+  const std::string unit = rest;
+  if (unit.empty() || unit == "ms")
+    return (long)value;
+  if (unit == "s")
+    return (long)(value * 1000);
+  return -1;
+}
+
+int transition(std::vector<Flag> &config, const std::string &theme) {
+  commandsRun++;
+  if (commandsRun > maxFollowupCommands && config[MAX_COMMANDS].present) {
+    HLOG("Program") << "Max number of commands run, stopping before the "
+                       "transition"
+                    << std::endl;
+    return 0;
+  }
+
+  long duration = 600;
+  if (config[DURATION].present) {
+    duration = parseDuration(transitionDuration);
+    if (duration < 0) {
+      HERR("transition") << "Invalid duration: " << transitionDuration
+                         << ", expected something like 600ms or 1.5s"
+                         << std::endl;
+      return 1;
+    }
+  }
+
+  Colorscheme from, to;
+  try {
+    from = ColorsHandler().getColors();
+    to = ColorsHandler(theme).getColors();
+  } catch (const std::exception &e) {
+    HERR("transition") << e.what() << std::endl;
+    return 1;
+  }
+
+  // Only the live paths animate, the files are written once, for the target
+  Transition::Stats stats = Transition(from, to).run(duration);
+  if (config[VERBOSE].present)
+    HLOG("transition") << stats.frames << " frames in " << stats.milliseconds
+                       << " ms, " << stats.dropped
+                       << " dropped, slowest frame " << stats.slowestUs
+                       << " us. " << stats.terminals << " terminals"
+                       << (stats.hyprland ? ", Hyprland" : "")
+                       << (stats.shared ? ", shared palette" : "") << "."
+                       << std::endl;
+
+  JsonWriter js;
+  if (!js.writeJson({"config"}, theme.c_str())) {
+    HERR("transition") << "Failed to set the theme to " << theme << std::endl;
+    return 1;
+  }
+
+  sourceConfig(config);
+  return 0;
+}
+
+// hoshimi fleet --homes <dir>... <source|install>: the homes run until the
+// next option, the command is the first of source and install
+int fleet(std::vector<Flag> &config, int argc, char *argv[]) {
+  std::vector<std::string> paths;
+  std::string action;
+  bool inHomes = false;
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--homes") {
+      inHomes = true;
+    } else if (arg[0] == '-') {
+      inHomes = false;
+    } else if (action.empty() && (arg == "source" || arg == "install")) {
+      action = arg;
+      inHomes = false;
+    } else if (inHomes) {
+      std::vector<std::string> split;
+      boost::split(split, arg, boost::is_any_of(","),
+                   boost::token_compress_on);
+      for (const auto &path : split)
+        if (!path.empty())
+          paths.push_back(path);
+    }
+  }
+
+  if (paths.empty() || action.empty()) {
+    HERR("fleet") << "Usage: " << argv[0]
+                  << " fleet --homes <dir> [dir...] <source|install>"
+                  << std::endl;
+    return 1;
+  }
+
+  std::vector<Fleet::Home> homes;
+  std::vector<Fleet::Result> rejected;
+  for (const auto &path : paths) {
+    Fleet::Home home;
+    std::string error;
+    if (Fleet::resolve(path, home, error)) {
+      homes.push_back(home);
+    } else {
+      Fleet::Result result;
+      result.home.path = path;
+      result.error = error;
+      rejected.push_back(result);
+    }
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  Fleet fleet(homes);
+  size_t themes = fleet.warm();
+
+  std::vector<Fleet::Result> results =
+      fleet.run([&config, &action]() -> int {
+        if (action == "install")
+          return installDotfiles(config);
+        return sourceConfig(config) ? 0 : 1;
+      });
+  results.insert(results.end(), rejected.begin(), rejected.end());
+  long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                     .count();
+
+  size_t failed = 0;
+  for (const auto &result : results) {
+    if (result.ok() && !config[VERBOSE].present)
+      continue;
+    if (!result.ok())
+      failed++;
+    if (result.output.empty())
+      continue;
+    std::cout << "--- " << result.home.path.string() << std::endl
+              << result.output;
+    if (result.output.back() != '\n')
+      std::cout << std::endl;
+  }
+
+  Fleet::printSummary(results, std::cout);
+  std::cout << results.size() << " homes in " << elapsed << " ms, " << themes
+            << " distinct themes";
+  if (failed)
+    std::cout << ", " << failed << " failed";
+  std::cout << "." << std::endl;
+  return failed ? 1 : 0;
+}
+
+// Render one theme into the store and write its manifest
+bool prerenderTheme(const std::vector<Flag> &config, const std::string &theme,
+                    const Prerendered &current,
+                    std::map<fs::path, std::string> &families) {
+  // Everything below, the osu generators included, loads this theme
+  JsonHandlerBase::themeOverride() = theme;
+
+  Prerendered out;
+  Config *osuConfig = nullptr;
+  const fs::path scratch =
+      ContentStore::root() / ("scratch-" + std::to_string(getpid()));
+  try {
+    ShellHandler shell;
+    const ShellHandler::Config shellConfig = shell.getConfig();
+    const Colorscheme colors = ColorsHandler().getColors();
+    out.theme = theme;
+    out.inputs = Prerendered::inputsHash(shell, shellConfig);
+
+    char *home = getHoshimiHome(NULL);
+    const fs::path osuGen =
+        CommitBatch::resolve(fs::path(home ? home : "") / "assets/osuGen");
+    free(home);
+
+    for (const auto &stage : sourceStages(shellConfig)) {
+      if (!shouldSource(stage.package, config) ||
+          !Prerendered::renders(stage.name))
+        continue;
+
+      auto job = stageJob(stage.name, colors, shellConfig, osuConfig);
+      std::map<fs::path, std::string> staged;
+      bool ok;
+      if (stage.name == "osu-circles" || stage.name == "osu-sounds") {
+        // The generators write their files themselves, into a scratch
+        // directory in place of osuGen
+        std::error_code ec;
+        fs::remove_all(scratch, ec);
+        fs::create_directories(scratch / "osuGen", ec);
+        if (osuConfig) {
+          free(osuConfig->downloadPath);
+          osuConfig->downloadPath = strdup((scratch / "osuGen").c_str());
+        }
+        ok = job();
+        staged = Prerendered::collect(scratch / "osuGen", osuGen);
+      } else {
+        // Writers stage every file, changed or not, and nothing is written
+        CommitBatch batch;
+        batch.capture = true;
+        CommitBatch::active() = &batch;
+        ok = job();
+        CommitBatch::active() = nullptr;
+        staged = batch.take();
+      }
+
+      if (!out.add(stage.name, ok, staged, current, families) &&
+          config[VERBOSE].present)
+        HLOG("prerender") << theme << ": " << stage.name
+                          << " failed, it will be rendered when switching."
+                          << std::endl;
+    }
+  } catch (const std::exception &e) {
+    HERR("prerender") << theme << ": " << e.what() << std::endl;
+    CommitBatch::active() = nullptr;
+    out.theme.clear();
+  }
+
+  if (osuConfig)
+    free_config(osuConfig);
+  Utils::destroyOsuDir(NULL);
+  std::error_code ec;
+  fs::remove_all(scratch, ec);
+  JsonHandlerBase::themeOverride().clear();
+
+  return !out.theme.empty() && out.save(Prerendered::manifestPath(theme));
+}
+
+// hoshimi prerender <--all|theme...>
+int prerender(std::vector<Flag> &config, int argc, char *argv[]) {
+  commandsRun++;
+  if (commandsRun > maxFollowupCommands && config[MAX_COMMANDS].present) {
+    HLOG("Program") << "Max number of commands run, stopping before "
+                       "prerendering"
+                    << std::endl;
+    return 0;
+  }
+
+  bool all = false;
+  std::vector<std::string> themes;
+  for (int i = 2; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--all")
+      all = true;
+    else if (arg[0] != '-' &&
+             std::find(packages.begin(), packages.end(), arg) ==
+                 packages.end() &&
+             std::find(notPackages.begin(), notPackages.end(), arg) ==
+                 notPackages.end() &&
+             arg != std::to_string(maxFollowupCommands))
+      themes.push_back(arg);
+  }
+  if (all)
+    themes = Prerendered::themes(ShellHandler().getThemesPath());
+  if (themes.empty()) {
+    HERR("prerender") << "Usage: " << argv[0] << " prerender <--all|theme...>"
+                      << std::endl;
+    return 1;
+  }
+
+  // Themes sharing files merge them once
+  ThemeCache::get().enabled = true;
+
+  Prerendered current;
+  current.load(Prerendered::currentPath());
+  std::map<fs::path, std::string> families;
+
+  auto begin = std::chrono::steady_clock::now();
+  size_t failed = 0;
+  for (const auto &theme : themes) {
+    if (!prerenderTheme(config, theme, current, families)) {
+      failed++;
+      continue;
+    }
+    if (config[VERBOSE].present)
+      HLOG("prerender") << theme << " prerendered." << std::endl;
+  }
 
-  HLOG("main") << "Hoshimi restarted" << std::endl;
+  // Objects only themes that are gone refer to are removed once every theme
+  // was rendered again
+  size_t removed = all ? Prerendered::prune() : 0;
+  long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - begin)
+                     .count();
+
+  HLOG("prerender") << themes.size() - failed << " of " << themes.size()
+                    << " themes prerendered in " << elapsed << " ms";
+  if (removed)
+    Utils::logStream() << ", " << removed << " unused files removed";
+  Utils::logStream() << "." << std::endl;
+  return failed ? 1 : 0;
 }
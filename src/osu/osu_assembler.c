@@ -7,6 +7,7 @@
 
 int main(const int argc, const char **argv) {
   Config *config = load_config();
+  prepare_osu_skin();
 
   free(config->downloadPath);
   config->downloadPath = strdup("osuGen");
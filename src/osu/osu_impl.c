@@ -174,7 +174,6 @@ int generateCircles(Config *config) {
       stbi_image_free(overlay);
       for (int j = 0; j < i; j++)
         stbi_image_free(numbers[j]);
-      free_config(config);
       free_colorscheme(colors);
       return 1;
     }
@@ -457,6 +456,7 @@ int generateSounds(Config *config) {
 
 void genOsu(void *foo) {
   Config *config = load_config();
+  prepare_osu_skin();
 
   generateSounds(config);
   generateCircles(config);
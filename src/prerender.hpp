@@ -0,0 +1,294 @@
+#pragma once
+
+#include "common/utils/commit.hpp"
+#include "common/utils/store.hpp"
+#include "stages.hpp"
+#include "version.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// A theme rendered ahead of time by `hoshimi prerender`: for every stage, the
+// object in the ContentStore each of its files gets. Switching to the theme
+// then links the files to their objects instead of rendering them.
+//
+// Writers edit the files they find rather than replacing them, so what a theme
+// renders to depends on the rest of the file. Every entry keeps the family of
+// its target: what the file held when it was prerendered, from before any
+// switch. A file can only be switched while it still belongs to that family,
+// that is while it still holds exactly that, or the object an earlier switch
+// of the same family linked it to. Anything else, e.g. an edit by the user or
+// a source that rendered the file, means the stage is rendered as usual.
+//
+// Kept in store/themes/<theme>.manifest. store/current holds the entries that
+// were last switched to, in the same format.
+class Prerendered {
+public:
+  struct Entry {
+    std::string object;
+    off_t size = 0;
+    std::string family;
+    fs::path target;
+  };
+
+  struct Stage {
+    bool ok = false;
+    std::vector<Entry> entries;
+  };
+
+  std::string theme;
+  // Hash of everything the rendered files were made from, see inputsHash()
+  std::string inputs;
+  std::map<std::string, Stage> stages;
+
+  static fs::path manifestPath(const std::string &theme) {
+    return ContentStore::root() / "themes" / (theme + ".manifest");
+  }
+
+  static fs::path currentPath() { return ContentStore::root() / "current"; }
+
+  // The stages whose files belong to hoshimi as a whole, and can be links to
+  // read-only objects. The others edit part of a file the user edits too
+  // (custom, foot, quickshell, equibop) or write no files at all (hyprland),
+  // and are always run.
+  static bool renders(const std::string &stage) {
+    static const std::set<std::string> owned = {
+        "ghostty", "alacritty", "templates", "osu-circles", "osu-sounds"};
+    return owned.count(stage) > 0;
+  }
+
+  // Every theme under the themes directory, e.g. "catppuccin/latte". The
+  // shared "*.json" files are not themes.
+  static std::vector<std::string> themes(const fs::path &themesPath) {
+    std::vector<std::string> out;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(themesPath, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      const fs::path &path = it->path();
+      if (path.extension() != ".json" || path.filename() == "*.json" ||
+          !it->is_regular_file(ec))
+        continue;
+      out.push_back(
+          path.lexically_relative(themesPath).replace_extension().string());
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+  }
+
+  // Hash of the resolved keys the stages render from and the files they read
+  // besides their own output. Unlike SourceState, the output files are left
+  // out: they are checked entry by entry through their families.
+  static std::string inputsHash(JsonHandlerBase &resolved,
+                                const ShellHandler::Config &shellConfig) {
+    InputHash hash;
+    hash.mix(HOSHIMI_VERSION);
+    std::set<std::string> keys;
+    for (const auto &stage : sourceStages(shellConfig))
+      keys.insert(stage.keys.begin(), stage.keys.end());
+    for (const auto &key : keys) {
+      hash.mix(key);
+      hash.mix(resolved.getResolved(key));
+    }
+    for (const auto &target : shellConfig.templates)
+      hash.stamp(target.templateFile);
+    hash.stamp(shellConfig.osuSkin);
+    return hash.hex();
+  }
+
+  // A manifest from another version of hoshimi is not loaded unless
+  // anyVersion is set, the writers may have changed in between
+  bool load(const fs::path &path, bool anyVersion = false) {
+    std::ifstream f(path);
+    std::string line;
+    if (!std::getline(f, line) ||
+        (line != "hoshimi " HOSHIMI_VERSION && !anyVersion))
+      return false;
+
+    Stage *stage = nullptr;
+    while (std::getline(f, line)) {
+      std::istringstream in(line);
+      std::string word;
+      in >> word;
+      if (word == "theme") {
+        in >> theme;
+      } else if (word == "inputs") {
+        in >> inputs;
+      } else if (word == "stage") {
+        std::string name, status;
+        in >> name >> status;
+        stage = &stages[name];
+        stage->ok = status == "ok";
+      } else if (stage) {
+        Entry entry;
+        entry.object = word;
+        in >> entry.size >> entry.family;
+        std::string target;
+        std::getline(in >> std::ws, target);
+        entry.target = target;
+        if (!in.fail() && !target.empty())
+          stage->entries.push_back(entry);
+      }
+    }
+    return true;
+  }
+
+  bool save(const fs::path &path) const {
+    std::string out = "hoshimi " HOSHIMI_VERSION "\n";
+    out += "theme " + theme + "\n";
+    out += "inputs " + inputs + "\n";
+    for (const auto &[name, stage] : stages) {
+      out += "stage " + name + (stage.ok ? " ok\n" : " failed\n");
+      for (const auto &entry : stage.entries)
+        out += entry.object + " " + std::to_string(entry.size) + " " +
+               entry.family + " " + entry.target.string() + "\n";
+    }
+
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    return CommitBatch::writeFile(path, out);
+  }
+
+  // Add what a stage rendered to the store. staged maps each target to its
+  // contents; families remembers the family of every target seen so far,
+  // which is the same for every theme of one prerender.
+  bool add(const std::string &name, bool ok,
+           const std::map<fs::path, std::string> &staged,
+           const Prerendered &current,
+           std::map<fs::path, std::string> &families) {
+    Stage &stage = stages[name];
+    stage.ok = ok;
+    stage.entries.clear();
+    if (!ok)
+      return false;
+
+    for (const auto &[target, contents] : staged) {
+      struct stat st;
+      bool executable = stat(target.c_str(), &st) == 0 && (st.st_mode & 0111);
+
+      Entry entry;
+      entry.object = ContentStore::put(contents, executable);
+      if (entry.object.empty()) {
+        stage.ok = false;
+        stage.entries.clear();
+        return false;
+      }
+      entry.size = contents.size();
+      entry.target = target;
+
+      auto family = families.find(target);
+      if (family == families.end()) {
+        const std::string now = ContentStore::identify(target);
+        const Entry *linked = current.find(target);
+        family = families
+                     .emplace(target, linked && linked->object == now
+                                          ? linked->family
+                                          : now)
+                     .first;
+      }
+      entry.family = family->second;
+      stage.entries.push_back(entry);
+    }
+    return true;
+  }
+
+  // Stage the links that switch a stage's files to this theme. Returns how
+  // many files change, or -1 if the stage has to be rendered instead.
+  int apply(const std::string &name, const Prerendered &current,
+            CommitBatch &batch) const {
+    auto it = stages.find(name);
+    if (!renders(name) || it == stages.end() || !it->second.ok)
+      return -1;
+
+    std::vector<const Entry *> changed;
+    for (const auto &entry : it->second.entries) {
+      if (!ContentStore::has(entry.object, entry.size))
+        return -1;
+
+      const std::string now = ContentStore::identify(entry.target);
+      if (now == entry.object)
+        continue;
+      const Entry *linked = current.find(entry.target);
+      if (now != entry.family &&
+          !(linked && linked->object == now &&
+            linked->family == entry.family))
+        return -1;
+      changed.push_back(&entry);
+    }
+
+    for (const Entry *entry : changed) {
+      std::error_code ec;
+      fs::create_directories(entry->target.parent_path(), ec);
+      batch.stageLink(entry->target, entry->object);
+    }
+    return changed.size();
+  }
+
+  const Entry *find(const fs::path &target) const {
+    for (const auto &[_, stage] : stages) {
+      for (const auto &entry : stage.entries) {
+        if (entry.target == target)
+          return &entry;
+      }
+    }
+    return nullptr;
+  }
+
+  // The files a generator left in dir, as targets in the directory they are
+  // meant for
+  static std::map<fs::path, std::string> collect(const fs::path &dir,
+                                                 const fs::path &into) {
+    std::map<fs::path, std::string> out;
+    std::error_code ec;
+    for (const auto &entry : fs::directory_iterator(dir, ec)) {
+      if (!entry.is_regular_file(ec))
+        continue;
+      std::ifstream f(entry.path(), std::ios::binary);
+      out[into / entry.path().filename()].assign(
+          std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    return out;
+  }
+
+  // Remove the objects no manifest refers to any more. Whatever is linked
+  // right now stays, whichever version linked it.
+  static size_t prune() {
+    std::set<std::string> used;
+    auto use = [&used](const fs::path &path, bool anyVersion) {
+      Prerendered manifest;
+      if (!manifest.load(path, anyVersion))
+        return;
+      for (const auto &[_, stage] : manifest.stages)
+        for (const auto &entry : stage.entries)
+          used.insert(entry.object);
+    };
+
+    std::error_code ec;
+    use(currentPath(), true);
+    for (auto it =
+             fs::recursive_directory_iterator(ContentStore::root() / "themes",
+                                              ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+      if (it->path().extension() == ".manifest")
+        use(it->path(), false);
+    }
+
+    size_t removed = 0;
+    for (const auto &entry :
+         fs::directory_iterator(ContentStore::objects(), ec)) {
+      if (!used.count(entry.path().filename().string()) &&
+          fs::remove(entry.path(), ec))
+        removed++;
+    }
+    return removed;
+  }
+};
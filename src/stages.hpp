@@ -0,0 +1,174 @@
+#pragma once
+
+#include "files.hpp"
+#include "version.h"
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// FNV-1a over strings and file stamps, for the input hashes of SourceState
+// and Prerendered. A file is identified by its mtime, size and inode rather
+// than its contents, which is enough to notice any edit without reading it.
+struct InputHash {
+  uint64_t hash = 14695981039346656037ull;
+
+  void mix(const std::string &s) {
+    for (unsigned char c : s)
+      hash = (hash ^ c) * 1099511628211ull;
+    hash = (hash ^ 0xff) * 1099511628211ull;
+  }
+
+  void stamp(const fs::path &file) {
+    mix(file.string());
+    struct stat st;
+    if (stat(file.c_str(), &st) != 0)
+      return mix("missing");
+    mix(std::to_string(st.st_mtim.tv_sec) + "." +
+        std::to_string(st.st_mtim.tv_nsec) + ":" +
+        std::to_string(st.st_size) + ":" + std::to_string(st.st_ino));
+  }
+
+  std::string hex() const {
+    char out[17];
+    snprintf(out, sizeof(out), "%016" PRIx64, hash);
+    return out;
+  }
+};
+
+// A unit of work done by `hoshimi source`, together with everything it reads:
+// keys of the resolved configuration (see JsonHandlerBase::getResolved) and
+// external files. A stage only reruns when the hash of its inputs changed.
+struct SourceStage {
+  std::string name;
+  std::string package;
+  std::vector<std::string> keys;
+  std::vector<fs::path> files;
+};
+
+inline std::vector<SourceStage>
+sourceStages(const ShellHandler::Config &shellConfig) {
+  std::vector<fs::path> customFiles;
+  for (const auto &writer : shellConfig.writers)
+    customFiles.push_back(writer.file);
+
+  std::vector<fs::path> templateFiles;
+  for (const auto &target : shellConfig.templates) {
+    templateFiles.push_back(target.templateFile);
+    templateFiles.push_back(target.file);
+  }
+
+  char *home = getHoshimiHome(NULL);
+  fs::path osuGen = fs::path(home ? home : "") / "assets/osuGen";
+  free(home);
+
+  return {
+      {"ghostty", "ghostty", {"colors"}, {GhosttyWriter::path()}},
+      {"foot", "foot", {"colors"}, {FootWriter::path()}},
+      {"alacritty", "alacritty", {"colors"}, {AlacrittyWriter::path()}},
+      {"quickshell-colors",
+       "quickshell",
+       {"colors"},
+       {QuickshellWriter::colorsPath()}},
+      {"quickshell-shell",
+       "quickshell",
+       {"wallpaper", "globals.wallpaperDirectory"},
+       {QuickshellWriter::shellPath()}},
+      {"equibop", "equibop", {"colors"}, {EquibopWriter::path()}},
+      // The socket is an input so a new Hyprland instance gets recolored
+      {"hyprland", "hypr", {"colors"}, {Hyprland::defaultSocket()}},
+      {"custom", "custom", {"writers"}, customFiles},
+      {"templates", "templates", {"colors", "templates"}, templateFiles},
+      {"osu-circles",
+       "quickshell",
+       {"colors", "globals.osuSkin"},
+       {shellConfig.osuSkin, osuGen}},
+      {"osu-sounds",
+       "quickshell",
+       {"globals.osuSkin"},
+       {shellConfig.osuSkin, osuGen}},
+  };
+}
+
+// Input hashes of the stages from the last successful source, kept in
+// $XDG_STATE_HOME/hoshimi/source.state.
+class SourceState {
+public:
+  SourceState() : path(statePath()) {
+    std::ifstream f(path);
+    std::string header;
+    // State written by another version of hoshimi is discarded, the writers
+    // may have changed in between.
+    if (!std::getline(f, header) || header != "hoshimi " HOSHIMI_VERSION)
+      return;
+
+    std::string name, hash;
+    while (f >> name >> hash)
+      hashes[name] = hash;
+  }
+
+  // Hash of everything the stage reads, see InputHash
+  std::string inputHash(const SourceStage &stage,
+                        JsonHandlerBase &resolved) const {
+    InputHash hash;
+    hash.mix(stage.name);
+    for (const auto &key : stage.keys) {
+      hash.mix(key);
+      hash.mix(resolved.getResolved(key));
+    }
+    for (const auto &file : stage.files)
+      hash.stamp(file);
+    return hash.hex();
+  }
+
+  bool unchanged(const std::string &name, const std::string &hash) const {
+    auto it = hashes.find(name);
+    return it != hashes.end() && it->second == hash;
+  }
+
+  void record(const std::string &name, const std::string &hash) {
+    hashes[name] = hash;
+  }
+
+  bool save() const {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    fs::path tmp = path.string() + ".tmp";
+    std::ofstream o(tmp);
+    if (!o.is_open()) {
+      char *err = hoshimi_error_strerror(init_err(2, tmp.c_str()));
+      HERR("State") << err << std::endl;
+      free(err);
+      return false;
+    }
+
+    o << "hoshimi " HOSHIMI_VERSION "\n";
+    for (const auto &[name, hash] : hashes)
+      o << name << " " << hash << "\n";
+    o.close();
+
+    fs::rename(tmp, path, ec);
+    return !ec;
+  }
+
+private:
+  fs::path path;
+  std::map<std::string, std::string> hashes;
+
+  static fs::path statePath() {
+    const char *xdg_state_home = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    fs::path dir = xdg_state_home
+                       ? fs::path(xdg_state_home)
+                       : fs::path(home ? home : "") / ".local/state";
+    return dir / "hoshimi/source.state";
+  }
+};
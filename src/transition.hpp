@@ -0,0 +1,230 @@
+#pragma once
+
+#include "common/colormath.hpp"
+#include "common/hyprland.hpp"
+#include "common/sharedpalette.hpp"
+#include "common/terminals.hpp"
+#include "files.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Animates the running desktop from one colorscheme to another. Every frame
+// the colors are mixed in OKLab and pushed through the paths that apply them
+// right away: OSC sequences to the open terminals, one batch of keywords to
+// Hyprland and the shared palette Quickshell reads. No file is written, that
+// is left to the source that follows the last frame.
+//
+// Everything a frame needs is set up beforehand: the terminals are opened
+// once, and the terminal sequence and the Hyprland batch are built once with
+// the colors at fixed offsets, which each frame overwrites in place. Rendering
+// a frame allocates nothing.
+class Transition {
+public:
+  struct Stats {
+    int frames = 0;
+    int dropped = 0;
+    long slowestUs = 0;
+    long milliseconds = 0;
+    size_t terminals = 0;
+    bool hyprland = false;
+    bool shared = false;
+  };
+
+  Transition(const Colorscheme &from, const Colorscheme &to,
+             Hyprland hyprland = Hyprland())
+      : hyprland(std::move(hyprland)) {
+    paletteSize = std::min(from.palette.size(), to.palette.size());
+    paletteSize = std::min(paletteSize, (size_t)16);
+
+    for (size_t i = 0; i < SharedPalette::ROLES; ++i) {
+      targets[i] = to.main[i];
+      start[i] = ColorMath::oklab(from.main[i]);
+      end[i] = ColorMath::oklab(to.main[i]);
+    }
+    for (size_t i = 0; i < paletteSize; ++i) {
+      size_t k = SharedPalette::ROLES + i;
+      targets[k] = to.palette[i];
+      start[k] = ColorMath::oklab(from.palette[i]);
+      end[k] = ColorMath::oklab(to.palette[i]);
+    }
+
+    // The sequence sets the palette, then the foreground, the background and
+    // the cursor
+    terminalSequence = LiveTerminals::sequence(to);
+    std::vector<size_t> offsets = LiveTerminals::colorOffsets(terminalSequence);
+    const size_t ansi = std::min(to.palette.size(), (size_t)16);
+    const size_t last[] = {FOREGROUND, BACKGROUND, SELECTED};
+    for (size_t i = 0; i < offsets.size() && i < ansi + 3; ++i) {
+      size_t color = i < ansi ? SharedPalette::ROLES + i : last[i - ansi];
+      if (color < SharedPalette::ROLES + paletteSize)
+        terminalSlots.push_back({offsets[i], color});
+    }
+    for (const auto &pty : LiveTerminals::userPtys()) {
+      int fd = LiveTerminals::open(pty);
+      if (fd >= 0)
+        ptys.push_back(fd);
+    }
+
+    if (this->hyprland.available()) {
+      hyprlandBatch = "[[BATCH]]";
+      for (const auto &[option, active] : HyprlandWriter::borders()) {
+        if (hyprlandBatch.size() > 9)
+          hyprlandBatch += ";";
+        hyprlandBatch += "keyword " + option + " rgb(";
+        hyprlandSlots.push_back(
+            {hyprlandBatch.size(), active ? ACTIVE : BORDER});
+        hyprlandBatch += "000000)";
+      }
+      reply.reserve(4096);
+    }
+
+    shared.open();
+  }
+
+  Transition(const Transition &) = delete;
+  Transition &operator=(const Transition &) = delete;
+  ~Transition() {
+    for (int fd : ptys)
+      close(fd);
+  }
+
+  // Play the transition over durationMs at fps frames a second. A frame that
+  // is late is dropped rather than played late, so the transition takes as
+  // long as it was asked to. The last frame is always the target colors.
+  Stats run(long durationMs, int fps = 60) {
+    Stats stats;
+    stats.terminals = ptys.size();
+    stats.hyprland = !hyprlandBatch.empty();
+    stats.shared = shared.isOpen();
+
+    const long frameNs = 1000000000L / std::max(fps, 1);
+    const long durationNs = std::max(durationMs, 0L) * 1000000L;
+    const long frames = std::max(durationNs / frameNs, 1L);
+
+    timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (long frame = 1; frame <= frames; ++frame) {
+      timespec deadline = begin;
+      long target = begin.tv_nsec + frame * frameNs;
+      deadline.tv_sec += target / 1000000000L;
+      deadline.tv_nsec = target % 1000000000L;
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                             nullptr) == EINTR)
+        ;
+
+      // Catch up by skipping a frame once the next one is already due
+      timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (frame < frames && nanoseconds(begin, now) > (frame + 1) * frameNs) {
+        stats.dropped++;
+        continue;
+      }
+
+      render(frame == frames ? 1.0f : (float)frame / frames);
+      stats.frames++;
+
+      timespec done;
+      clock_gettime(CLOCK_MONOTONIC, &done);
+      stats.slowestUs =
+          std::max(stats.slowestUs, nanoseconds(now, done) / 1000);
+    }
+
+    timespec finished;
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    stats.milliseconds = nanoseconds(begin, finished) / 1000000;
+    return stats;
+  }
+
+  // Draw the colors at progress t, 0 to 1
+  void render(float t) {
+    const size_t count = SharedPalette::ROLES + paletteSize;
+    if (t >= 1.0f) {
+      std::copy(targets, targets + count, current);
+    } else {
+      float eased = ease(t);
+      for (size_t i = 0; i < count; ++i) {
+        ColorMath::Lab mixed = ColorMath::mix(start[i], end[i], eased);
+        current[i] = ColorMath::fromOklab<Color>(mixed);
+      }
+    }
+
+    char *sequence = &terminalSequence[0];
+    for (const Slot &slot : terminalSlots) {
+      const Color &color = current[slot.color];
+      char *out = sequence + slot.offset;
+      hex(out, color.r);
+      out[2] = '/';
+      hex(out + 3, color.g);
+      out[5] = '/';
+      hex(out + 6, color.b);
+    }
+    for (int fd : ptys)
+      LiveTerminals::write(fd, terminalSequence.data(),
+                           terminalSequence.size());
+
+    if (!hyprlandBatch.empty()) {
+      char *batch = &hyprlandBatch[0];
+      for (const Slot &slot : hyprlandSlots) {
+        const Color &color = current[slot.color];
+        hex(batch + slot.offset, color.r);
+        hex(batch + slot.offset + 2, color.g);
+        hex(batch + slot.offset + 4, color.b);
+      }
+      hyprland.request(hyprlandBatch.data(), hyprlandBatch.size(), reply);
+    }
+
+    shared.publish(current, current + SharedPalette::ROLES, paletteSize);
+  }
+
+private:
+  // Indexes into Colorscheme::main
+  static constexpr size_t BACKGROUND = 0;
+  static constexpr size_t FOREGROUND = 1;
+  static constexpr size_t SELECTED = 2;
+  static constexpr size_t ACTIVE = 3;
+  static constexpr size_t BORDER = 7;
+
+  struct Slot {
+    size_t offset;
+    size_t color;
+  };
+
+  // The roles, then the palette
+  ColorMath::Lab start[SharedPalette::COLORS];
+  ColorMath::Lab end[SharedPalette::COLORS];
+  Color targets[SharedPalette::COLORS];
+  Color current[SharedPalette::COLORS];
+  size_t paletteSize;
+
+  std::string terminalSequence;
+  std::vector<Slot> terminalSlots;
+  std::vector<int> ptys;
+
+  Hyprland hyprland;
+  std::string hyprlandBatch;
+  std::vector<Slot> hyprlandSlots;
+  std::string reply;
+
+  SharedPalette shared;
+
+  // Slow at both ends, so the change neither starts nor stops abruptly
+  static float ease(float t) {
+    return t < 0.5f ? 4 * t * t * t : 1 - 4 * (1 - t) * (1 - t) * (1 - t);
+  }
+
+  static void hex(char *out, uint8_t value) {
+    static const char digits[] = "0123456789abcdef";
+    out[0] = digits[value >> 4];
+    out[1] = digits[value & 15];
+  }
+
+  static long nanoseconds(const timespec &from, const timespec &to) {
+    return (to.tv_sec - from.tv_sec) * 1000000000L +
+           (to.tv_nsec - from.tv_nsec);
+  }
+};